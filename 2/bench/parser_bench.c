@@ -0,0 +1,164 @@
+/*
+ * Parser throughput benchmark: generates a script of the given size, feeds
+ * it to the parser in chunks like the shell reads stdin, pops all the
+ * command lines and reports MB/s of script parsed.
+ *
+ * Usage: ./parser_bench [-s script_mb] [-c chunk_size] [-l long_line_kb]
+ *                       [-f corpus]
+ * With -l every line gets a long argument list, which stresses lines that
+ * span many chunks. With -f the script is the given file repeated up to the
+ * requested size, for example -f tests.txt -s 512.
+ */
+#include "../parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *sample_lines[] = {
+    "echo \"hello world\" 'single quoted' plain\n",
+    "cat file.txt | grep -v pattern | wc -l > out.txt\n",
+    "true && echo ok || echo \"not \\\"ok\\\"\" >> log.txt\n",
+    "   ls -la /tmp   # a comment at the end\n",
+    "sleep 1 &\n",
+    "printf 'a\\nb\\nc' | tail -n 2 | head -n 1\n",
+};
+
+static char *load_corpus(const char *path, size_t size, size_t *out_size) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return NULL;
+  fseek(f, 0, SEEK_END);
+  size_t file_size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (file_size == 0) {
+    fclose(f);
+    return NULL;
+  }
+  /* Room for the last copy and a possibly added new line. */
+  char *script = malloc(size + file_size + 1);
+  if (fread(script, 1, file_size, f) != file_size) {
+    fclose(f);
+    free(script);
+    return NULL;
+  }
+  fclose(f);
+  size_t pos = file_size;
+  /* A corpus not ending with a new line would glue its copies together. */
+  if (script[pos - 1] != '\n')
+    script[pos++] = '\n';
+  size_t copy_size = pos;
+  while (pos < size) {
+    memcpy(script + pos, script, copy_size);
+    pos += copy_size;
+  }
+  *out_size = pos;
+  return script;
+}
+
+static char *make_script(size_t size, size_t long_line, size_t *out_size) {
+  char *script = malloc(size + long_line + 256);
+  size_t pos = 0;
+  size_t line_count = sizeof(sample_lines) / sizeof(sample_lines[0]);
+  for (size_t i = 0; pos < size; ++i) {
+    if (long_line > 0) {
+      memcpy(script + pos, "echo", 4);
+      pos += 4;
+      for (size_t len = 0; len < long_line; len += 2) {
+        memcpy(script + pos, " a", 2);
+        pos += 2;
+      }
+      script[pos++] = '\n';
+      continue;
+    }
+    const char *line = sample_lines[i % line_count];
+    size_t len = strlen(line);
+    memcpy(script + pos, line, len);
+    pos += len;
+  }
+  *out_size = pos;
+  return script;
+}
+
+int main(int argc, char **argv) {
+  size_t script_mb = 64;
+  size_t chunk_size = 1024;
+  size_t long_line_kb = 0;
+  const char *corpus = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:c:l:f:")) != -1) {
+    switch (opt) {
+    case 's':
+      script_mb = strtoull(optarg, NULL, 10);
+      break;
+    case 'c':
+      chunk_size = strtoull(optarg, NULL, 10);
+      break;
+    case 'l':
+      long_line_kb = strtoull(optarg, NULL, 10);
+      break;
+    case 'f':
+      corpus = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-s script_mb] [-c chunk_size] "
+                      "[-l long_line_kb] [-f corpus]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (chunk_size == 0)
+    chunk_size = 1;
+  size_t size;
+  char *script;
+  if (corpus != NULL) {
+    script = load_corpus(corpus, script_mb << 20, &size);
+    if (script == NULL) {
+      printf("failed to read %s\n", corpus);
+      return 1;
+    }
+  } else {
+    script = make_script(script_mb << 20, long_line_kb << 10, &size);
+  }
+
+  struct parser *p = parser_new();
+  size_t line_count = 0;
+  size_t arg_count = 0;
+  size_t error_count = 0;
+  double start = now_sec();
+  for (size_t pos = 0; pos < size; pos += chunk_size) {
+    size_t len = size - pos < chunk_size ? size - pos : chunk_size;
+    parser_feed(p, script + pos, len);
+    struct command_line *line = NULL;
+    while (true) {
+      enum parser_error err = parser_pop_next(p, &line);
+      if (err == PARSER_ERR_NONE && line == NULL)
+        break;
+      if (err != PARSER_ERR_NONE) {
+        ++error_count;
+        continue;
+      }
+      ++line_count;
+      for (struct expr *e = line->head; e != NULL; e = e->next) {
+        if (e->type == EXPR_TYPE_COMMAND)
+          arg_count += e->cmd.arg_count;
+      }
+      command_line_delete(line);
+    }
+  }
+  double duration = now_sec() - start;
+  parser_delete(p);
+  free(script);
+  printf("%zu bytes, %zu lines, %zu args, %zu errors in %.3f sec: "
+         "%.1f MB/s\n",
+         size, line_count, arg_count, error_count, duration,
+         size / duration / (1 << 20));
+  return 0;
+}
@@ -0,0 +1,40 @@
+#!/usr/bin/env python3
+# Pipeline throughput benchmark: pushes data through a 5-stage pipeline run
+# by the shell and reports GB/s for several plumbing settings: default
+# pipes, bigger pipes (-P) and the splice pump for the redirect (-S).
+#
+# Usage: python3 bench/pipe_bench.py -e ./a.out [-s size_mb] [-o out_file]
+
+import argparse
+import os
+import subprocess
+import time
+
+parser = argparse.ArgumentParser(description='Shell pipeline throughput')
+parser.add_argument('-e', type=str, required=True, help='shell executable')
+parser.add_argument('-s', type=int, default=2048, help='data size in MB')
+parser.add_argument('-o', type=str, default='/dev/null',
+                    help='file the pipeline writes to')
+parser.add_argument('-P', type=int, default=1024 * 1024,
+                    help='pipe size for the big pipe runs')
+args = parser.parse_args()
+
+size = args.s * 1024 * 1024
+script = 'head -c {} /dev/zero | cat | cat | cat | cat > {}\n'.format(
+    size, args.o).encode()
+configs = [
+    ('default', []),
+    ('-P {}'.format(args.P), ['-P', str(args.P)]),
+    ('-S', ['-S']),
+    ('-P {} -S'.format(args.P), ['-P', str(args.P), '-S']),
+]
+for name, flags in configs:
+    if args.o != '/dev/null' and os.path.exists(args.o):
+        os.remove(args.o)
+    start = time.monotonic()
+    subprocess.run([args.e] + flags, input=script, check=False)
+    duration = time.monotonic() - start
+    print('{:<20} {:>6} MB {:>8.3f} sec {:>6.2f} GB/s'.format(
+          name, args.s, duration, size / duration / 1e9))
+if args.o != '/dev/null' and os.path.exists(args.o):
+    os.remove(args.o)
@@ -0,0 +1,35 @@
+#!/usr/bin/env python3
+# Script throughput benchmark: feeds a generated script to each given shell
+# and reports command lines per second. The default script is echo-heavy,
+# like generated build scripts.
+#
+# Usage: python3 bench/script_bench.py -e ./a.out -e bench/mybash_nobuiltin
+
+import argparse
+import subprocess
+import time
+
+parser = argparse.ArgumentParser(description='Shell script throughput')
+parser.add_argument('-e', action='append', required=True,
+                    help='shell executable, can be given several times')
+parser.add_argument('-n', type=int, default=20000, help='number of lines')
+parser.add_argument('--mix', choices=['echo', 'exec', 'pipe'],
+                    default='echo', help='kind of lines in the script')
+args = parser.parse_args()
+
+templates = {
+    'echo': ['echo step {i} done', 'printf "%s=%d\\n" key {i}', 'true',
+             'echo "quoted {i}" > /dev/null', 'false || echo {i}'],
+    'exec': ['ls / > /dev/null', 'cat /dev/null', 'echo {i}'],
+    'pipe': ['echo {i} | cat', 'printf "%d\\n" {i} | grep {i}'],
+}[args.mix]
+script = ''.join(templates[i % len(templates)].format(i=i) + '\n'
+                 for i in range(args.n)).encode()
+
+for exe in args.e:
+    start = time.monotonic()
+    subprocess.run([exe], input=script, stdout=subprocess.DEVNULL,
+                   check=False)
+    duration = time.monotonic() - start
+    print('{:<30} {:>8} lines {:>8.3f} sec {:>10.0f} lines/sec'.format(
+          exe, args.n, duration, args.n / duration))
@@ -0,0 +1,96 @@
+/*
+ * Spawn-rate benchmark: how many short-lived commands per second the shell
+ * could start with fork() + execvp() versus posix_spawnp(). fork() copies the
+ * parent's page tables, so its cost grows with the parent's resident memory;
+ * use -m to emulate a bigger shell process.
+ *
+ * Usage: ./spawn_bench [-n count] [-m resident_mb] [command [args...]]
+ * The default command is `true`.
+ */
+#define _GNU_SOURCE
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run_fork(char **argv) {
+  pid_t pid = fork();
+  if (pid == -1)
+    return -1;
+  if (pid == 0) {
+    execvp(argv[0], argv);
+    _exit(1);
+  }
+  return waitpid(pid, NULL, 0) == -1 ? -1 : 0;
+}
+
+static int run_spawn(char **argv) {
+  pid_t pid;
+  if (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) != 0)
+    return -1;
+  return waitpid(pid, NULL, 0) == -1 ? -1 : 0;
+}
+
+static void bench(const char *name, int (*run)(char **), char **argv,
+                  int count) {
+  double start = now_sec();
+  for (int i = 0; i < count; ++i) {
+    if (run(argv) != 0) {
+      printf("%s: failed to start %s\n", name, argv[0]);
+      exit(1);
+    }
+  }
+  double duration = now_sec() - start;
+  printf("%-6s %8d runs %8.3f sec %10.0f spawns/sec %8.1f us/spawn\n", name,
+         count, duration, count / duration, duration * 1e6 / count);
+}
+
+int main(int argc, char **argv) {
+  int count = 2000;
+  size_t resident_mb = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "+n:m:")) != -1) {
+    switch (opt) {
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 'm':
+      resident_mb = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-n count] [-m resident_mb] [command [args...]]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  char *default_argv[] = {"true", NULL};
+  char **cmd_argv = optind < argc ? argv + optind : default_argv;
+
+  char *ballast = NULL;
+  if (resident_mb > 0) {
+    ballast = malloc(resident_mb << 20);
+    if (ballast == NULL) {
+      printf("failed to allocate %zu MB\n", resident_mb);
+      return 1;
+    }
+    /* Touch every page so it is really mapped. */
+    memset(ballast, 1, resident_mb << 20);
+  }
+  printf("command: %s, resident ballast: %zu MB\n", cmd_argv[0], resident_mb);
+  bench("fork", run_fork, cmd_argv, count);
+  bench("spawn", run_spawn, cmd_argv, count);
+  free(ballast);
+  return 0;
+}
@@ -5,12 +5,82 @@
 #include <stdlib.h>
 #include <string.h>
 
+/**
+ * Runs of ordinary bytes in tokens are found with a vectorized scan: AVX2
+ * when the compiler targets it (-mavx2 or -march=native), else SSE2, which
+ * every x86-64 has. Set to 0 to force the plain byte loop.
+ */
+#ifndef PARSER_USE_SIMD
+#define PARSER_USE_SIMD 1
+#endif
+
+#if PARSER_USE_SIMD && defined(__AVX2__)
+#include <immintrin.h>
+#elif PARSER_USE_SIMD && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 struct parser {
   char *buffer;
+  /** Offset of the first not consumed byte. */
+  uint32_t begin;
+  /** End of the fed data. */
   uint32_t size;
   uint32_t capacity;
+  /**
+   * The data before this offset was already tried and did not make a whole
+   * command line. A line always ends with a new line symbol, so there is no
+   * reason to parse it again until a new one is fed.
+   */
+  uint32_t scanned;
+  /**
+   * Scratch space for the tokens being unescaped, reused for all lines. It
+   * is never shorter than the unconsumed data, and a token never gets longer
+   * than its source text, so appending to it needs no checks.
+   */
+  char *token_buf;
+  uint32_t token_capacity;
+};
+
+/**
+ * Chunk of memory owned by a command line. All its exprs, strings and
+ * argument arrays are allocated here and freed in one go by
+ * command_line_delete().
+ */
+struct parser_arena {
+  /** Previous, already filled chunk. */
+  struct parser_arena *next;
+  uint32_t size;
+  uint32_t used;
+  char data[];
 };
 
+enum {
+  ARENA_ALIGN = sizeof(void *),
+  ARENA_MIN_CHUNK = 1024,
+  ARENA_MAX_CHUNK = 1024 * 1024,
+};
+
+static void *arena_alloc(struct parser_arena **arena, uint32_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(uint32_t)(ARENA_ALIGN - 1);
+  struct parser_arena *a = *arena;
+  if (a == NULL || a->size - a->used < size) {
+    uint32_t chunk_size = a == NULL ? ARENA_MIN_CHUNK : a->size * 2;
+    if (chunk_size > ARENA_MAX_CHUNK)
+      chunk_size = ARENA_MAX_CHUNK;
+    if (chunk_size < size)
+      chunk_size = size;
+    struct parser_arena *new_a = malloc(sizeof(*new_a) + chunk_size);
+    new_a->next = a;
+    new_a->size = chunk_size;
+    new_a->used = 0;
+    *arena = a = new_a;
+  }
+  void *res = a->data + a->used;
+  a->used += size;
+  return res;
+}
+
 enum token_type {
   TOKEN_TYPE_NONE,
   TOKEN_TYPE_STR,
@@ -25,27 +95,21 @@ enum token_type {
 
 struct token {
   enum token_type type;
+  /** Points into the parser's token buffer. */
   char *data;
   uint32_t size;
-  uint32_t capacity;
 };
 
-static char *token_strdup(const struct token *t) {
+static char *token_strdup(struct command_line *line, const struct token *t) {
   assert(t->type == TOKEN_TYPE_STR);
   assert(t->size > 0);
-  char *res = malloc(t->size + 1);
+  char *res = arena_alloc(&line->arena, t->size + 1);
   memcpy(res, t->data, t->size);
   res[t->size] = 0;
   return res;
 }
 
-static void token_append(struct token *t, char c) {
-  if (t->size == t->capacity) {
-    t->capacity = (t->capacity + 1) * 2;
-    t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
-  } else {
-    assert(t->size < t->capacity);
-  }
+static inline void token_append(struct token *t, char c) {
   t->data[t->size++] = c;
 }
 
@@ -54,10 +118,15 @@ static void token_reset(struct token *t) {
   t->type = TOKEN_TYPE_NONE;
 }
 
-static void command_append_arg(struct command *cmd, char *arg) {
+static void command_append_arg(struct command_line *line, struct command *cmd,
+                               char *arg) {
   if (cmd->arg_count == cmd->arg_capacity) {
     cmd->arg_capacity = (cmd->arg_capacity + 1) * 2;
-    cmd->args = realloc(cmd->args, sizeof(*cmd->args) * cmd->arg_capacity);
+    char **args =
+        arena_alloc(&line->arena, sizeof(*cmd->args) * cmd->arg_capacity);
+    if (cmd->arg_count > 0)
+      memcpy(args, cmd->args, sizeof(*cmd->args) * cmd->arg_count);
+    cmd->args = args;
   } else {
     assert(cmd->arg_count < cmd->arg_capacity);
   }
@@ -65,22 +134,23 @@ static void command_append_arg(struct command *cmd, char *arg) {
 }
 
 void command_line_delete(struct command_line *line) {
-  while (line->head != NULL) {
-    struct expr *e = line->head;
-    if (e->type == EXPR_TYPE_COMMAND) {
-      struct command *cmd = &e->cmd;
-      free(cmd->exe);
-      for (uint32_t i = 0; i < cmd->arg_count; ++i)
-        free(cmd->args[i]);
-      free(cmd->args);
-    }
-    line->head = e->next;
-    free(e);
+  struct parser_arena *a = line->arena;
+  while (a != NULL) {
+    struct parser_arena *next = a->next;
+    free(a);
+    a = next;
   }
-  free(line->out_file);
   free(line);
 }
 
+static struct expr *command_line_new_expr(struct command_line *line,
+                                          enum expr_type type) {
+  struct expr *e = arena_alloc(&line->arena, sizeof(*e));
+  memset(e, 0, sizeof(*e));
+  e->type = type;
+  return e;
+}
+
 static void command_line_append(struct command_line *line, struct expr *e) {
   if (line->head == NULL)
     line->head = e;
@@ -95,6 +165,18 @@ struct parser *parser_new(void) {
 
 void parser_feed(struct parser *p, const char *str, uint32_t len) {
   uint32_t cap = p->capacity - p->size;
+  uint32_t unconsumed = p->size - p->begin;
+  if (cap < len && p->begin > 0 && p->begin >= unconsumed) {
+    /*
+     * Drop the consumed prefix only when out of space and when it is not
+     * shorter than the data to move. So every byte is moved O(1) times.
+     */
+    memmove(p->buffer, p->buffer + p->begin, unconsumed);
+    p->scanned = p->scanned > p->begin ? p->scanned - p->begin : 0;
+    p->begin = 0;
+    p->size = unconsumed;
+    cap = p->capacity - p->size;
+  }
   if (cap < len) {
     uint32_t new_capacity = (p->capacity + 1) * 2;
     if (new_capacity - p->size < len)
@@ -108,13 +190,100 @@ void parser_feed(struct parser *p, const char *str, uint32_t len) {
 }
 
 static void parser_consume(struct parser *p, uint32_t size) {
-  assert(p->size >= size);
-  if (size == p->size) {
+  assert(p->size - p->begin >= size);
+  p->begin += size;
+  if (p->begin == p->size) {
+    p->begin = 0;
     p->size = 0;
-    return;
+    p->scanned = 0;
+  }
+}
+
+/**
+ * Bytes which need the token state machine outside of quotes: separators,
+ * quotes, escapes, operators and comments.
+ */
+static const bool parser_is_special[256] = {
+    [' '] = true,  ['\t'] = true, ['\n'] = true, ['\r'] = true,
+    ['\''] = true, ['"'] = true,  ['\\'] = true, ['&'] = true,
+    ['|'] = true,  ['>'] = true,  ['#'] = true,
+};
+
+static inline bool is_special(char c, char quote) {
+  if (quote == '\'')
+    return c == '\'';
+  if (quote == '"')
+    return c == '"' || c == '\\';
+  return parser_is_special[(unsigned char)c];
+}
+
+#if PARSER_USE_SIMD && defined(__AVX2__)
+#define PARSER_VEC_SIZE 32
+typedef __m256i parser_vec;
+#define vec_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define vec_store(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#define vec_eq(v, c) _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))
+#define vec_or(a, b) _mm256_or_si256(a, b)
+#define vec_mask(v) ((uint32_t)_mm256_movemask_epi8(v))
+#elif PARSER_USE_SIMD && defined(__SSE2__)
+#define PARSER_VEC_SIZE 16
+typedef __m128i parser_vec;
+#define vec_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define vec_store(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define vec_eq(v, c) _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+#define vec_or(a, b) _mm_or_si128(a, b)
+#define vec_mask(v) ((uint32_t)_mm_movemask_epi8(v))
+#else
+#define PARSER_VEC_SIZE 0
+#endif
+
+#if PARSER_VEC_SIZE > 0
+
+/** Bit mask of the bytes of @a v which are special with this quoting. */
+static inline uint32_t vec_special_mask(parser_vec v, char quote) {
+  if (quote == '\'')
+    return vec_mask(vec_eq(v, '\''));
+  parser_vec m = vec_or(vec_eq(v, '"'), vec_eq(v, '\\'));
+  if (quote == 0) {
+    m = vec_or(m, vec_eq(v, ' '));
+    m = vec_or(m, vec_eq(v, '\t'));
+    m = vec_or(m, vec_eq(v, '\n'));
+    m = vec_or(m, vec_eq(v, '\r'));
+    m = vec_or(m, vec_eq(v, '\''));
+    m = vec_or(m, vec_eq(v, '&'));
+    m = vec_or(m, vec_eq(v, '|'));
+    m = vec_or(m, vec_eq(v, '>'));
+    m = vec_or(m, vec_eq(v, '#'));
   }
-  memmove(p->buffer, p->buffer + size, p->size - size);
-  p->size -= size;
+  return vec_mask(m);
+}
+
+#endif
+
+/**
+ * Copy the run of ordinary bytes starting at @a pos to @a dst. The run is
+ * scanned a vector at a time and each vector is stored whole, so some bytes
+ * past the run can be written to @a dst too. That stays within the token
+ * buffer: a token is never longer than its source, and a vector is loaded
+ * only when it fits into the input.
+ * @param quote Current quote symbol or 0, it defines what is special.
+ * @retval Length of the run.
+ */
+static inline uint32_t copy_plain(const char *pos, const char *end, char *dst,
+                                  char quote) {
+  const char *begin = pos;
+#if PARSER_VEC_SIZE > 0
+  for (; end - pos >= PARSER_VEC_SIZE; pos += PARSER_VEC_SIZE) {
+    parser_vec v = vec_load(pos);
+    vec_store(dst + (pos - begin), v);
+    uint32_t mask = vec_special_mask(v, quote);
+    if (mask != 0)
+      return pos - begin + __builtin_ctz(mask);
+  }
+#endif
+  for (; pos < end && !is_special(*pos, quote); ++pos)
+    dst[pos - begin] = *pos;
+  return pos - begin;
 }
 
 static uint32_t parse_token(const char *pos, const char *end,
@@ -133,6 +302,14 @@ static uint32_t parse_token(const char *pos, const char *end,
   char quote = 0;
   while (pos < end) {
     char c = *pos;
+    if (!is_special(c, quote)) {
+      uint32_t len = copy_plain(pos, end, out->data + out->size, quote);
+      out->size += len;
+      pos += len;
+      if (pos == end)
+        break;
+      c = *pos;
+    }
     switch (c) {
     case '\'':
     case '"':
@@ -246,14 +423,11 @@ static uint32_t parse_token(const char *pos, const char *end,
         return pos - begin;
       }
       ++pos;
-      while (pos < end) {
-        if (*pos == '\n') {
-          out->type = TOKEN_TYPE_NEW_LINE;
-          return pos + 1 - begin;
-        }
-        ++pos;
-      }
-      return 0;
+      pos = memchr(pos, '\n', end - pos);
+      if (pos == NULL)
+        return 0;
+      out->type = TOKEN_TYPE_NEW_LINE;
+      return pos + 1 - begin;
     default:
       goto append_and_next;
     }
@@ -265,28 +439,41 @@ static uint32_t parse_token(const char *pos, const char *end,
 }
 
 enum parser_error parser_pop_next(struct parser *p, struct command_line **out) {
+  uint32_t scan_from = p->scanned > p->begin ? p->scanned : p->begin;
+  /* The buffer is NULL before the first feed. */
+  if (p->size == scan_from ||
+      memchr(p->buffer + scan_from, '\n', p->size - scan_from) == NULL) {
+    p->scanned = p->size;
+    *out = NULL;
+    return PARSER_ERR_NONE;
+  }
+  uint32_t unconsumed = p->size - p->begin;
+  if (p->token_capacity < unconsumed) {
+    free(p->token_buf);
+    p->token_buf = malloc(unconsumed);
+    p->token_capacity = unconsumed;
+  }
   struct command_line *line = calloc(1, sizeof(*line));
-  char *pos = p->buffer;
+  char *pos = p->buffer + p->begin;
   const char *begin = pos;
-  char *end = pos + p->size;
-  struct token token = {0};
+  char *end = p->buffer + p->size;
+  struct token token = {.data = p->token_buf};
   enum parser_error res = PARSER_ERR_NONE;
 
   while (pos < end) {
     uint32_t used = parse_token(pos, end, &token);
     if (used == 0)
-      goto return_no_line;
+      goto return_incomplete;
     pos += used;
     struct expr *e;
     switch (token.type) {
     case TOKEN_TYPE_STR:
       if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
-        command_append_arg(&line->tail->cmd, token_strdup(&token));
+        command_append_arg(line, &line->tail->cmd, token_strdup(line, &token));
         continue;
       }
-      e = calloc(1, sizeof(*e));
-      e->type = EXPR_TYPE_COMMAND;
-      e->cmd.exe = token_strdup(&token);
+      e = command_line_new_expr(line, EXPR_TYPE_COMMAND);
+      e->cmd.exe = token_strdup(line, &token);
       command_line_append(line, e);
       continue;
     case TOKEN_TYPE_NEW_LINE:
@@ -303,8 +490,7 @@ enum parser_error parser_pop_next(struct parser *p, struct command_line **out) {
         res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
         goto return_error;
       }
-      e = calloc(1, sizeof(*e));
-      e->type = EXPR_TYPE_PIPE;
+      e = command_line_new_expr(line, EXPR_TYPE_PIPE);
       command_line_append(line, e);
       continue;
     case TOKEN_TYPE_AND:
@@ -316,8 +502,7 @@ enum parser_error parser_pop_next(struct parser *p, struct command_line **out) {
         res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
         goto return_error;
       }
-      e = calloc(1, sizeof(*e));
-      e->type = EXPR_TYPE_AND;
+      e = command_line_new_expr(line, EXPR_TYPE_AND);
       command_line_append(line, e);
       continue;
     case TOKEN_TYPE_OR:
@@ -329,8 +514,7 @@ enum parser_error parser_pop_next(struct parser *p, struct command_line **out) {
         res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
         goto return_error;
       }
-      e = calloc(1, sizeof(*e));
-      e->type = EXPR_TYPE_OR;
+      e = command_line_new_expr(line, EXPR_TYPE_OR);
       command_line_append(line, e);
       continue;
     case TOKEN_TYPE_OUT_NEW:
@@ -341,7 +525,7 @@ enum parser_error parser_pop_next(struct parser *p, struct command_line **out) {
       assert(false);
     }
   }
-  goto return_no_line;
+  goto return_incomplete;
 
 close_and_return:
   if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND) {
@@ -351,23 +535,23 @@ close_and_return:
       line->out_type = OUTPUT_TYPE_FILE_APPEND;
     uint32_t used = parse_token(pos, end, &token);
     if (used == 0)
-      goto return_no_line;
+      goto return_incomplete;
     pos += used;
     if (token.type != TOKEN_TYPE_STR) {
       res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
       goto return_error;
     }
-    line->out_file = token_strdup(&token);
+    line->out_file = token_strdup(line, &token);
     used = parse_token(pos, end, &token);
     if (used == 0)
-      goto return_no_line;
+      goto return_incomplete;
     pos += used;
   }
   if (token.type == TOKEN_TYPE_BACKGROUND) {
     line->is_background = true;
     uint32_t used = parse_token(pos, end, &token);
     if (used == 0)
-      goto return_no_line;
+      goto return_incomplete;
     pos += used;
   }
   if (token.type == TOKEN_TYPE_NEW_LINE) {
@@ -400,18 +584,21 @@ return_error:
     }
   }
   res = PARSER_ERR_NONE;
-  goto return_no_line;
+  goto return_incomplete;
+
+return_incomplete:
+  p->scanned = p->size;
 
 return_no_line:
   command_line_delete(line);
   *out = NULL;
 
 return_final:
-  free(token.data);
   return res;
 }
 
 void parser_delete(struct parser *p) {
+  free(p->token_buf);
   free(p->buffer);
   free(p);
 }
@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 struct parser;
+struct parser_arena;
 
 enum parser_error {
   PARSER_ERR_NONE,
@@ -52,6 +53,8 @@ struct command_line {
   /** Valid if the out type is FILE. */
   char *out_file;
   bool is_background;
+  /** Memory of all the exprs and strings of the line. */
+  struct parser_arena *arena;
 };
 
 void command_line_delete(struct command_line *line);
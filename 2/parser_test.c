@@ -755,6 +755,46 @@ static void test_background(void) {
   unit_test_finish();
 }
 
+static void test_many_args(void) {
+  unit_test_start();
+  struct parser *p = parser_new();
+  struct command_line *line = NULL;
+
+  const uint32_t arg_count = 10000;
+  parser_feed(p, "echo", 4);
+  for (uint32_t i = 0; i < arg_count; ++i) {
+    parser_feed(p, i % 2 == 0 ? " a" : " 'b c'", i % 2 == 0 ? 2 : 6);
+    unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+    unit_fail_if(line != NULL);
+  }
+  /* Several lines in one feed, the first ends the long line. */
+  parser_feed(p, "\nls\npwd", 8);
+  unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+  unit_check(line != NULL && line->head == line->tail, "one expr");
+  struct command *cmd = &line->head->cmd;
+  unit_check(strcmp(cmd->exe, "echo") == 0, "exe");
+  unit_check(cmd->arg_count == arg_count, "arg count");
+  bool ok = true;
+  for (uint32_t i = 0; i < arg_count && ok; ++i)
+    ok = strcmp(cmd->args[i], i % 2 == 0 ? "a" : "b c") == 0;
+  unit_check(ok, "args");
+  command_line_delete(line);
+
+  unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+  unit_check(strcmp(line->head->cmd.exe, "ls") == 0, "exe");
+  command_line_delete(line);
+  unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+  unit_check(line == NULL, "no more lines yet");
+
+  parser_feed(p, "\n", 1);
+  unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+  unit_check(strcmp(line->head->cmd.exe, "pwd") == 0, "exe");
+  command_line_delete(line);
+
+  parser_delete(p);
+  unit_test_finish();
+}
+
 static void test_error_one(struct parser *p, const char *expr,
                            enum parser_error err) {
   struct command_line *line = NULL;
@@ -811,5 +851,6 @@ int main(void) {
   test_logical_operators();
   test_background();
   test_errors();
+  test_many_args();
   return 0;
 }
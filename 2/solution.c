@@ -1,172 +1,1318 @@
+#define _GNU_SOURCE
 #include "parser.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
-int execute_cd(struct expr *iterator) {
-  if (iterator->cmd.arg_count != 0) {
-    if (chdir(iterator->cmd.args[0]) != 0) {
-      exit(1);
-    }
+extern char **environ;
+
+int execute_cd(const struct command *cmd) {
+  const char *dir;
+  if (cmd->arg_count != 0) {
+    dir = cmd->args[0];
   } else {
-    const char *home = getenv("HOME");
-    if (home == NULL) {
-      exit(1);
-    }
-    if (chdir(home) != 0) {
-      exit(1);
+    dir = getenv("HOME");
+    if (dir == NULL) {
+      return 1;
     }
   }
+  if (chdir(dir) != 0) {
+    return 1;
+  }
   return 0;
 }
 
-int count_number_command(const struct command_line *line) {
+/** Number of commands in the pipeline [begin, end). */
+static int count_pipeline_commands(const struct expr *begin,
+                                   const struct expr *end) {
   int number_commands = 0;
-  struct expr *iterator = line->head;
-  while (iterator != NULL) {
-    number_commands++;
-    iterator = iterator->next;
+  for (const struct expr *it = begin; it != end; it = it->next) {
+    if (it->type == EXPR_TYPE_COMMAND)
+      number_commands++;
   }
   return number_commands;
 }
 
-static int execute_command_line(const struct command_line *line) {
-  assert(line != NULL);
-  int result = 0;
-  int number_commands = count_number_command(line);
-  struct expr *iterator = line->head;
-  int fd[2];
-  int prev_pipe_read = STDIN_FILENO;
-  bool exit_command = false;
-  int exit_code = 0;
+/** Background job started by the shell and not reaped yet. */
+struct job {
+  int id;
+  pid_t pid;
+};
+
+/**
+ * Table of running background jobs. Jobs are reaped asynchronously: the
+ * shell blocks SIGCHLD, receives it through a signalfd polled together with
+ * stdin, and collects the children with WNOHANG. So a long background job
+ * never stalls reading and running the next commands.
+ */
+struct job_table {
+  struct job *jobs;
+  int count;
+  int capacity;
+  int next_id;
+};
+
+static struct job_table job_table = {NULL, 0, 0, 1};
+/** True in a forked subshell running a background command line. */
+static bool is_subshell = false;
+/** Descriptor delivering SIGCHLD to the shell, -1 if not available. */
+static int sigchld_fd = -1;
+
+/**
+ * Make room for one more job before it is started. Jobs are reaped only by
+ * their pids, so a job which could not be tracked would stay a zombie.
+ */
+static bool job_table_reserve(void) {
+  struct job_table *t = &job_table;
+  if (t->count < t->capacity)
+    return true;
+  int new_capacity = t->capacity == 0 ? 8 : t->capacity * 2;
+  struct job *new_jobs = realloc(t->jobs, new_capacity * sizeof(*new_jobs));
+  if (new_jobs == NULL)
+    return false;
+  t->jobs = new_jobs;
+  t->capacity = new_capacity;
+  return true;
+}
+
+/** Register a started job, the room is reserved beforehand. */
+static void job_table_add(pid_t pid) {
+  struct job_table *t = &job_table;
+  assert(t->count < t->capacity);
+  t->jobs[t->count].id = t->next_id++;
+  t->jobs[t->count].pid = pid;
+  t->count++;
+}
+
+/**
+ * Collect all finished background jobs without blocking. Jobs are waited
+ * for by pid, so children of parallel lines are not stolen from their own
+ * waiters.
+ */
+static void job_table_reap(void) {
+  if (sigchld_fd != -1) {
+    struct signalfd_siginfo info;
+    while (read(sigchld_fd, &info, sizeof(info)) == sizeof(info))
+      ;
+  }
+  struct job_table *t = &job_table;
+  for (int i = 0; i < t->count;) {
+    int status;
+    if (waitpid(t->jobs[i].pid, &status, WNOHANG) != 0)
+      t->jobs[i] = t->jobs[--t->count];
+    else
+      ++i;
+  }
+  if (t->count == 0)
+    t->next_id = 1;
+}
+
+static void shell_exit(int code);
+
+/**
+ * Cache of resolved command paths, like the hash builtin of bash. A command
+ * without '/' is searched in PATH once and then started with posix_spawn()
+ * on the absolute path, saving the failed execve() calls execvp() does on
+ * every PATH entry before the right one. The cache is dropped when PATH
+ * changes, and an entry is dropped when its file disappears (ENOENT). Set
+ * SHELL_USE_PATH_CACHE to 0 to always search with posix_spawnp().
+ */
+#ifndef SHELL_USE_PATH_CACHE
+#define SHELL_USE_PATH_CACHE 1
+#endif
+
+struct path_cache_entry {
+  /** Command name, NULL for a free slot. */
+  char *name;
+  char *path;
+  unsigned hits;
+};
+
+/** Open addressing hash table, the capacity is a power of 2. */
+struct path_cache {
+  struct path_cache_entry *entries;
+  uint32_t capacity;
+  uint32_t count;
+  /** PATH the entries were resolved with. */
+  char *path_env;
+};
+
+static struct path_cache path_cache = {NULL, 0, 0, NULL};
+
+static uint32_t path_cache_hash(const char *name) {
+  /* FNV-1a. */
+  uint32_t h = 2166136261u;
+  for (; *name != 0; ++name)
+    h = (h ^ (unsigned char)*name) * 16777619u;
+  return h;
+}
+
+static void path_cache_clear(void) {
+  struct path_cache *c = &path_cache;
+  for (uint32_t i = 0; i < c->capacity; ++i) {
+    free(c->entries[i].name);
+    free(c->entries[i].path);
+  }
+  free(c->entries);
+  free(c->path_env);
+  c->entries = NULL;
+  c->capacity = 0;
+  c->count = 0;
+  c->path_env = NULL;
+}
+
+/** Slot of the name, or the free slot where it would be inserted. */
+static struct path_cache_entry *path_cache_slot(const char *name) {
+  struct path_cache *c = &path_cache;
+  uint32_t mask = c->capacity - 1;
+  for (uint32_t i = path_cache_hash(name) & mask;; i = (i + 1) & mask) {
+    struct path_cache_entry *e = &c->entries[i];
+    if (e->name == NULL || !strcmp(e->name, name))
+      return e;
+  }
+}
+
+static void path_cache_insert(char *name, char *path) {
+  struct path_cache *c = &path_cache;
+  if ((c->count + 1) * 2 > c->capacity) {
+    struct path_cache old = *c;
+    uint32_t new_capacity = old.capacity == 0 ? 64 : old.capacity * 2;
+    struct path_cache_entry *new_entries =
+        calloc(new_capacity, sizeof(*new_entries));
+    if (new_entries == NULL)
+      shell_exit(1);
+    c->capacity = new_capacity;
+    c->entries = new_entries;
+    for (uint32_t i = 0; i < old.capacity; ++i) {
+      if (old.entries[i].name != NULL)
+        *path_cache_slot(old.entries[i].name) = old.entries[i];
+    }
+    free(old.entries);
+  }
+  struct path_cache_entry *e = path_cache_slot(name);
+  assert(e->name == NULL);
+  e->name = name;
+  e->path = path;
+  e->hits = 0;
+  c->count++;
+}
+
+#if SHELL_USE_PATH_CACHE
+
+/** Remove an entry, re-inserting the rest of its probe chain. */
+static void path_cache_forget(const char *name) {
+  struct path_cache *c = &path_cache;
+  if (c->count == 0)
+    return;
+  struct path_cache_entry *e = path_cache_slot(name);
+  if (e->name == NULL)
+    return;
+  free(e->name);
+  free(e->path);
+  e->name = NULL;
+  c->count--;
+  uint32_t mask = c->capacity - 1;
+  for (uint32_t i = (e - c->entries + 1) & mask; c->entries[i].name != NULL;
+       i = (i + 1) & mask) {
+    struct path_cache_entry moved = c->entries[i];
+    c->entries[i].name = NULL;
+    *path_cache_slot(moved.name) = moved;
+  }
+}
+
+#endif
+
+/**
+ * Search PATH for an executable file like execvp() does.
+ * @param[out] is_absolute False if it was found via a relative PATH entry,
+ *   then it depends on the working directory and must not be cached.
+ * @retval Allocated path or NULL if not found.
+ */
+static char *path_search(const char *name, const char *path_env,
+                         bool *is_absolute) {
+  size_t name_len = strlen(name);
+  const char *dir = path_env;
+  while (true) {
+    const char *dir_end = strchrnul(dir, ':');
+    size_t dir_len = dir_end - dir;
+    /* An empty entry means the current directory. */
+    char *path = malloc(dir_len + name_len + 3);
+    if (path == NULL)
+      return NULL;
+    if (dir_len == 0) {
+      memcpy(path, "./", 2);
+      dir_len = 2;
+    } else {
+      memcpy(path, dir, dir_len);
+      path[dir_len++] = '/';
+    }
+    memcpy(path + dir_len, name, name_len + 1);
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+        access(path, X_OK) == 0) {
+      *is_absolute = path[0] == '/';
+      return path;
+    }
+    free(path);
+    if (*dir_end == 0)
+      return NULL;
+    dir = dir_end + 1;
+  }
+}
+
+/**
+ * Resolve a command name into a path to execute.
+ * @param[out] is_cached True if the result is owned by the cache, else it
+ *   has to be freed.
+ * @retval Path or NULL if the command is not found.
+ */
+static char *path_cache_resolve(const char *name, bool *is_cached) {
+  struct path_cache *c = &path_cache;
+  const char *path_env = getenv("PATH");
+  if (path_env == NULL)
+    path_env = "/bin:/usr/bin";
+  if (c->path_env == NULL || strcmp(c->path_env, path_env) != 0) {
+    path_cache_clear();
+    c->path_env = strdup(path_env);
+    if (c->path_env == NULL)
+      shell_exit(1);
+  }
+  if (c->count > 0) {
+    struct path_cache_entry *e = path_cache_slot(name);
+    if (e->name != NULL) {
+      e->hits++;
+      *is_cached = true;
+      return e->path;
+    }
+  }
+  bool is_absolute;
+  char *path = path_search(name, path_env, &is_absolute);
+  *is_cached = false;
+  if (path == NULL || !is_absolute)
+    return path;
+  char *name_copy = strdup(name);
+  if (name_copy == NULL)
+    return path;
+  path_cache_insert(name_copy, path);
+  path_cache_slot(name)->hits = 1;
+  *is_cached = true;
+  return path;
+}
+
+/** Exit code of a waited child, 128 + signal number if it was killed. */
+static int wait_status_code(int status) {
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  return 128 + WTERMSIG(status);
+}
+
+static void shell_exit(int code) {
+  if (is_subshell)
+    _exit(code);
+  free(job_table.jobs);
+  path_cache_clear();
+  exit(code);
+}
+
+/**
+ * Build an argv array for execve-like calls: the executable name followed
+ * by the arguments and a terminating NULL. The strings are borrowed from
+ * the command, only the array itself has to be freed.
+ */
+static char **command_argv(const struct command *cmd) {
+  char **argv = calloc(cmd->arg_count + 2, sizeof(char *));
+  if (argv == NULL)
+    return NULL;
+  argv[0] = cmd->exe;
+  memcpy(argv + 1, cmd->args, sizeof(char *) * cmd->arg_count);
+  return argv;
+}
+
+static int command_exit_code(const struct command *cmd) {
+  if (cmd->arg_count == 0)
+    return 0;
+  return atoi(cmd->args[0]);
+}
+
+/**
+ * Start one pipeline stage via posix_spawnp(). Redirections are described
+ * as spawn file actions and applied by the child right before exec, so the
+ * shell's address space is never duplicated and nothing is allocated in the
+ * child. Pipe ends are created with O_CLOEXEC, the ones not installed as
+ * stdin/stdout are closed by exec automatically.
+ * @param cmd Command to start.
+ * @param in_fd Descriptor to become stdin, or -1 to inherit the shell's.
+ * @param out_fd Descriptor to become stdout, or -1 to inherit the shell's.
+ * @param line Command line whose output redirect is applied when @a out_fd
+ *   is -1 and @a is_last is set.
+ * @param is_last True if the stage is the last one of the command line.
+ * @param[out] pid Pid of the started process.
+ *
+ * @retval 0 Success.
+ * @retval errno Error code of the failed spawn.
+ */
+static int spawn_command(const struct command *cmd, int in_fd, int out_fd,
+                         const struct command_line *line, bool is_last,
+                         pid_t *pid) {
+  posix_spawn_file_actions_t actions;
+  int rc = posix_spawn_file_actions_init(&actions);
+  if (rc != 0)
+    return rc;
+  if (in_fd != -1)
+    rc = posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+  if (rc == 0 && out_fd != -1)
+    rc = posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+  if (rc == 0 && out_fd == -1 && is_last &&
+      line->out_type != OUTPUT_TYPE_STDOUT) {
+    int flags = O_CREAT | O_WRONLY;
+    if (line->out_type == OUTPUT_TYPE_FILE_NEW)
+      flags |= O_TRUNC;
+    else
+      flags |= O_APPEND;
+    rc = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO,
+                                          line->out_file, flags, 0644);
+  }
+  /* The shell blocks SIGCHLD, the commands must not inherit that. */
+  posix_spawnattr_t attr;
+  sigset_t empty_mask;
+  sigemptyset(&empty_mask);
+  if (rc == 0)
+    rc = posix_spawnattr_init(&attr);
+  if (rc != 0) {
+    posix_spawn_file_actions_destroy(&actions);
+    return rc;
+  }
+  rc = posix_spawnattr_setsigmask(&attr, &empty_mask);
+  if (rc == 0)
+    rc = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+  char **argv = NULL;
+  if (rc == 0) {
+    argv = command_argv(cmd);
+    if (argv == NULL)
+      rc = ENOMEM;
+  }
+#if SHELL_USE_PATH_CACHE
+  if (rc == 0 && strchr(cmd->exe, '/') == NULL) {
+    bool is_cached;
+    char *path = path_cache_resolve(cmd->exe, &is_cached);
+    if (path == NULL) {
+      rc = ENOENT;
+    } else {
+      rc = posix_spawn(pid, path, &actions, &attr, argv, environ);
+      if (!is_cached)
+        free(path);
+      /* ENOENT can also come from a redirect, so check the file itself. */
+      struct stat st;
+      if (rc == ENOENT && is_cached && stat(path, &st) != 0) {
+        /* The file is gone, maybe it was moved to another PATH entry. */
+        path_cache_forget(cmd->exe);
+        path = path_cache_resolve(cmd->exe, &is_cached);
+        rc = path == NULL ? ENOENT
+                          : posix_spawn(pid, path, &actions, &attr, argv,
+                                        environ);
+        if (path != NULL && !is_cached)
+          free(path);
+      }
+    }
+  } else if (rc == 0) {
+    rc = posix_spawn(pid, cmd->exe, &actions, &attr, argv, environ);
+  }
+#else
+  if (rc == 0)
+    rc = posix_spawnp(pid, cmd->exe, &actions, &attr, argv, environ);
+#endif
+  free(argv);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  return rc;
+}
+
+/**
+ * Builtins: commands run by the shell itself, without fork and exec. A
+ * single-command pipeline runs its builtin right in the shell process. In a
+ * longer pipeline a builtin stage gets a forked child which skips exec. Set
+ * SHELL_USE_BUILTINS to 0 to run everything but cd, exit and hash, which
+ * change the shell state, as programs.
+ */
+#ifndef SHELL_USE_BUILTINS
+#define SHELL_USE_BUILTINS 1
+#endif
+
+enum {
+  /**
+   * Returned by a builtin which does not support the given arguments. The
+   * real program is executed then. Builtins decide that before producing
+   * any output.
+   */
+  BUILTIN_FALLBACK = -1,
+};
+
+/**
+ * Output collected in memory: of a builtin to write it in one go, or of a
+ * parallel job until its turn comes.
+ */
+struct out_buffer {
+  char *data;
+  size_t size;
+  size_t capacity;
+};
+
+static void out_buffer_append(struct out_buffer *out, const char *str,
+                              size_t len) {
+  if (out->capacity - out->size < len) {
+    size_t new_capacity = (out->capacity + 1) * 2;
+    if (new_capacity - out->size < len)
+      new_capacity = out->size + len;
+    char *new_data = realloc(out->data, new_capacity);
+    if (new_data == NULL)
+      shell_exit(1);
+    out->data = new_data;
+    out->capacity = new_capacity;
+  }
+  memcpy(out->data + out->size, str, len);
+  out->size += len;
+}
+
+static void out_buffer_char(struct out_buffer *out, char c) {
+  out_buffer_append(out, &c, 1);
+}
+
+static void out_buffer_str(struct out_buffer *out, const char *str) {
+  out_buffer_append(out, str, strlen(str));
+}
+
+static int builtin_cd(const struct command *cmd, struct out_buffer *out) {
+  (void)out;
+  return execute_cd(cmd);
+}
+
+static int builtin_exit(const struct command *cmd, struct out_buffer *out) {
+  (void)out;
+  shell_exit(command_exit_code(cmd));
+  return 0;
+}
+
+/**
+ * hash: print the cached command paths with their hit counts, hash -r:
+ * forget them, hash name...: resolve and cache the names.
+ */
+static int builtin_hash(const struct command *cmd, struct out_buffer *out) {
+  if (cmd->arg_count == 1 && !strcmp(cmd->args[0], "-r")) {
+    path_cache_clear();
+    return 0;
+  }
+  int rc = 0;
+  for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+    bool is_cached;
+    char *path = path_cache_resolve(cmd->args[i], &is_cached);
+    if (path == NULL) {
+      fprintf(stderr, "hash: %s: not found\n", cmd->args[i]);
+      rc = 1;
+    } else if (!is_cached) {
+      free(path);
+    } else {
+      /* Only looked up, not run. */
+      path_cache_slot(cmd->args[i])->hits--;
+    }
+  }
+  if (cmd->arg_count > 0)
+    return rc;
+  struct path_cache *c = &path_cache;
+  if (c->count == 0) {
+    out_buffer_str(out, "hash: hash table empty\n");
+    return 0;
+  }
+  out_buffer_str(out, "hits\tcommand\n");
+  for (uint32_t i = 0; i < c->capacity; ++i) {
+    if (c->entries[i].name == NULL)
+      continue;
+    char hits[32];
+    int len = snprintf(hits, sizeof(hits), "%4u\t", c->entries[i].hits);
+    out_buffer_append(out, hits, len);
+    out_buffer_str(out, c->entries[i].path);
+    out_buffer_char(out, '\n');
+  }
+  return 0;
+}
+
+#if SHELL_USE_BUILTINS
+
+static int builtin_true(const struct command *cmd, struct out_buffer *out) {
+  (void)cmd;
+  (void)out;
+  return 0;
+}
+
+static int builtin_false(const struct command *cmd, struct out_buffer *out) {
+  (void)cmd;
+  (void)out;
+  return 1;
+}
+
+/** Echo with -n and -E. With -e it falls back to the real echo. */
+static int builtin_echo(const struct command *cmd, struct out_buffer *out) {
+  bool need_new_line = true;
+  uint32_t i = 0;
+  for (; i < cmd->arg_count; ++i) {
+    const char *arg = cmd->args[i];
+    if (arg[0] != '-' || arg[1] == 0 ||
+        strspn(arg + 1, "neE") != strlen(arg + 1))
+      break;
+    if (strchr(arg, 'e') != NULL)
+      return BUILTIN_FALLBACK;
+    if (strchr(arg, 'n') != NULL)
+      need_new_line = false;
+  }
+  for (uint32_t first = i; i < cmd->arg_count; ++i) {
+    if (i != first)
+      out_buffer_char(out, ' ');
+    out_buffer_str(out, cmd->args[i]);
+  }
+  if (need_new_line)
+    out_buffer_char(out, '\n');
+  return 0;
+}
+
+static int builtin_pwd(const struct command *cmd, struct out_buffer *out) {
+  (void)cmd;
+  char path[PATH_MAX];
+  if (getcwd(path, sizeof(path)) == NULL)
+    return BUILTIN_FALLBACK;
+  out_buffer_str(out, path);
+  out_buffer_char(out, '\n');
+  return 0;
+}
+
+/** Value of a simple backslash escape, -1 if it is not one. */
+static int printf_escape(char c) {
+  switch (c) {
+  case '\\':
+    return '\\';
+  case '"':
+    return '"';
+  case 'a':
+    return '\a';
+  case 'b':
+    return '\b';
+  case 'f':
+    return '\f';
+  case 'n':
+    return '\n';
+  case 'r':
+    return '\r';
+  case 't':
+    return '\t';
+  case 'v':
+    return '\v';
+  default:
+    return -1;
+  }
+}
+
+/**
+ * Printf with %s, %c, %d, %i, %% and the simple backslash escapes. The
+ * format is reused while arguments remain, like in coreutils. Anything else
+ * (flags, width, other conversions, bad numbers) falls back to the real
+ * printf.
+ */
+static int builtin_printf(const struct command *cmd, struct out_buffer *out) {
+  if (cmd->arg_count == 0)
+    return BUILTIN_FALLBACK;
+  const char *format = cmd->args[0];
+  uint32_t next_arg = 1;
+  do {
+    uint32_t pass_start = next_arg;
+    for (const char *pos = format; *pos != 0; ++pos) {
+      if (*pos == '\\') {
+        int c = printf_escape(pos[1]);
+        if (c == -1)
+          return BUILTIN_FALLBACK;
+        out_buffer_char(out, c);
+        ++pos;
+        continue;
+      }
+      if (*pos != '%') {
+        out_buffer_char(out, *pos);
+        continue;
+      }
+      ++pos;
+      if (*pos == '%') {
+        out_buffer_char(out, '%');
+        continue;
+      }
+      const char *arg = "";
+      if (next_arg < cmd->arg_count)
+        arg = cmd->args[next_arg];
+      switch (*pos) {
+      case 's':
+        out_buffer_str(out, arg);
+        break;
+      case 'c':
+        if (*arg != 0)
+          out_buffer_char(out, *arg);
+        break;
+      case 'd':
+      case 'i': {
+        char *end;
+        errno = 0;
+        long long value = *arg == 0 ? 0 : strtoll(arg, &end, 10);
+        if (*arg != 0 && (*end != 0 || errno != 0))
+          return BUILTIN_FALLBACK;
+        char number[32];
+        int len = snprintf(number, sizeof(number), "%lld", value);
+        out_buffer_append(out, number, len);
+        break;
+      }
+      default:
+        return BUILTIN_FALLBACK;
+      }
+      if (next_arg < cmd->arg_count)
+        ++next_arg;
+    }
+    /* A format without conversions makes coreutils warn about the rest. */
+    if (next_arg == pass_start && next_arg < cmd->arg_count)
+      return BUILTIN_FALLBACK;
+  } while (next_arg < cmd->arg_count);
+  return 0;
+}
+
+#endif
+
+typedef int (*builtin_f)(const struct command *cmd, struct out_buffer *out);
+
+struct builtin {
+  const char *name;
+  builtin_f run;
+};
+
+static const struct builtin builtins[] = {
+    {"cd", builtin_cd},
+    {"exit", builtin_exit},
+    {"hash", builtin_hash},
+#if SHELL_USE_BUILTINS
+    {"true", builtin_true},
+    {"false", builtin_false},
+    {"echo", builtin_echo},
+    {"pwd", builtin_pwd},
+    {"printf", builtin_printf},
+#endif
+};
+
+static const struct builtin *builtin_find(const char *name) {
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+    if (!strcmp(builtins[i].name, name))
+      return &builtins[i];
+  }
+  return NULL;
+}
+
+static int write_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t rc = write(fd, data, size);
+    if (rc == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += rc;
+    size -= rc;
+  }
+  return 0;
+}
+
+/** Open the output redirect of a command line. */
+static int open_redirect(const struct command_line *line) {
+  int flags = O_CREAT | O_WRONLY;
+  if (line->out_type == OUTPUT_TYPE_FILE_NEW)
+    flags |= O_TRUNC;
+  else
+    flags |= O_APPEND;
+  return open(line->out_file, flags | O_CLOEXEC, 0644);
+}
+
+/**
+ * Run a builtin and write its output to @a out_fd.
+ * @retval Exit status of the builtin or BUILTIN_FALLBACK, then nothing was
+ *   written.
+ */
+static int builtin_run(const struct builtin *b, const struct command *cmd,
+                       int out_fd) {
+  struct out_buffer out = {NULL, 0, 0};
+  int rc = b->run(cmd, &out);
+  if (rc != BUILTIN_FALLBACK && out.size > 0 &&
+      write_all(out_fd, out.data, out.size) != 0)
+    rc = 1;
+  free(out.data);
+  return rc;
+}
+
+/**
+ * Run a builtin right in the shell process, honouring the output redirect
+ * when it ends the command line.
+ */
+static int builtin_run_here(const struct builtin *b,
+                            const struct command *cmd,
+                            const struct command_line *line,
+                            bool is_last_pipeline) {
+  int out_fd = STDOUT_FILENO;
+  if (is_last_pipeline && line->out_type != OUTPUT_TYPE_STDOUT) {
+    out_fd = open_redirect(line);
+    if (out_fd == -1)
+      return 1;
+  }
+  int rc = builtin_run(b, cmd, out_fd);
+  if (out_fd != STDOUT_FILENO)
+    close(out_fd);
+  return rc;
+}
+
+/**
+ * Run a builtin pipeline stage in a forked child. The child never execs
+ * unless the builtin falls back, so it closes the pipe ends it does not use
+ * itself. Arguments are the same as for spawn_command().
+ * @param close_fd One more descriptor for the child to close, or -1.
+ */
+static int fork_builtin(const struct builtin *b, const struct command *cmd,
+                        int in_fd, int out_fd, int close_fd,
+                        const struct command_line *line, bool is_last,
+                        pid_t *pid) {
+  fflush(stdout);
+  *pid = fork();
+  if (*pid == -1)
+    return errno;
+  if (*pid != 0)
+    return 0;
+  is_subshell = true;
+  if (sigchld_fd != -1)
+    close(sigchld_fd);
+  if (close_fd != -1)
+    close(close_fd);
+  if (in_fd != -1) {
+    if (dup2(in_fd, STDIN_FILENO) == -1)
+      _exit(1);
+    close(in_fd);
+  }
+  if (out_fd == -1 && is_last && line->out_type != OUTPUT_TYPE_STDOUT)
+    out_fd = open_redirect(line);
+  if (out_fd != -1) {
+    if (dup2(out_fd, STDOUT_FILENO) == -1)
+      _exit(1);
+    close(out_fd);
+  }
+  sigset_t empty_mask;
+  sigemptyset(&empty_mask);
+  sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+  int rc = builtin_run(b, cmd, STDOUT_FILENO);
+  if (rc != BUILTIN_FALLBACK)
+    _exit(rc);
+  char **argv = command_argv(cmd);
+  if (argv != NULL)
+    execvp(cmd->exe, argv);
+  _exit(1);
+}
+
+/**
+ * Capacity for the pipes between pipeline stages set by -P, 0 keeps the
+ * default 64 KiB. Bigger pipes mean fewer context switches in pipelines
+ * moving a lot of data.
+ */
+static int pipe_size = 0;
+/**
+ * Set by -S. The output redirect of a pipeline's last stage is done by the
+ * shell: the stage writes into a pipe and the shell moves the data into the
+ * file with splice(), with no copies through user space. Only for >, because
+ * splice() refuses files opened with O_APPEND, and >> without it would let
+ * concurrent appenders overwrite each other.
+ */
+static bool use_splice = false;
+
+static int pipeline_pipe(int fd[2]) {
+  if (pipe2(fd, O_CLOEXEC) == -1)
+    return -1;
+  /* Not fatal, the size can be above /proc/sys/fs/pipe-max-size. */
+  if (pipe_size > 0)
+    fcntl(fd[0], F_SETPIPE_SZ, pipe_size);
+  return 0;
+}
 
-  for (int i = 0; (i < number_commands) && (iterator != NULL); i++) {
-    if (iterator->type != EXPR_TYPE_COMMAND) {
-      iterator = iterator->next;
+/** Move everything from the pipe @a in_fd to @a out_fd until EOF. */
+static void splice_pump(int in_fd, int out_fd) {
+  size_t chunk = pipe_size > 0 ? (size_t)pipe_size : 64 * 1024;
+  while (true) {
+    ssize_t rc = splice(in_fd, NULL, out_fd, NULL, chunk,
+                        SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (rc > 0)
       continue;
+    if (rc == 0)
+      return;
+    if (errno == EINTR)
+      continue;
+    break;
+  }
+  /* The target does not support splice, copy through user space. */
+  char buf[64 * 1024];
+  ssize_t rc;
+  while ((rc = read(in_fd, buf, sizeof(buf))) != 0) {
+    if (rc == -1) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    if (write_all(out_fd, buf, rc) != 0)
+      return;
+  }
+}
+
+/**
+ * Run one pipeline, the exprs [begin, end), and wait for it.
+ * @param line Command line the pipeline belongs to.
+ * @param is_last_pipeline True if the pipeline ends the command line, then
+ *   the line's output redirect applies to it.
+ * @retval Exit status of the last stage.
+ */
+static int execute_pipeline(const struct expr *begin, const struct expr *end,
+                            const struct command_line *line,
+                            bool is_last_pipeline) {
+  int number_commands = count_pipeline_commands(begin, end);
+  if (number_commands == 1) {
+    const struct command *cmd = &begin->cmd;
+    const struct builtin *b = builtin_find(cmd->exe);
+    if (b != NULL) {
+      int rc = builtin_run_here(b, cmd, line, is_last_pipeline);
+      if (rc != BUILTIN_FALLBACK)
+        return rc;
     }
-    if (!strcmp(iterator->cmd.exe, "cd")) {
-      result = execute_cd(iterator);
-      return result;
-    } else if (!strcmp(iterator->cmd.exe, "exit") && (number_commands == 1)) {
-      int arg = 0;
-      if (iterator->cmd.arg_count != 0) {
-        arg = atoi(*iterator->cmd.args);
+  }
+  pid_t *pids = calloc(number_commands, sizeof(pid_t));
+  if (pids == NULL)
+    shell_exit(1);
+  int pid_count = 0;
+  int prev_pipe_read = -1;
+  /* The redirect file and the pipe to it when the shell pumps the data. */
+  int pump_file = -1;
+  int pump_read = -1;
+  /* Status of the last stage when it does not need a process. */
+  int last_status = 0;
+  bool is_last_spawned = false;
+
+  for (const struct expr *iterator = begin; iterator != end;
+       iterator = iterator->next) {
+    if (iterator->type != EXPR_TYPE_COMMAND)
+      continue;
+    const struct command *cmd = &iterator->cmd;
+    bool is_last = iterator->next == end;
+    int fd[2] = {-1, -1};
+    if (!is_last && pipeline_pipe(fd) == -1)
+      shell_exit(1);
+    bool is_builtin_stage =
+        !strcmp(cmd->exe, "exit") || !strcmp(cmd->exe, "cd");
+    if (is_last && is_last_pipeline && use_splice && !is_builtin_stage &&
+        line->out_type == OUTPUT_TYPE_FILE_NEW) {
+      /* If anything fails, the stage opens the file itself as usual. */
+      pump_file = open(line->out_file, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC,
+                       0644);
+      if (pump_file != -1 && pipeline_pipe(fd) == -1) {
+        close(pump_file);
+        pump_file = -1;
       }
-      exit(arg);
+    }
+    if (is_builtin_stage) {
+      /*
+       * Inside a pipeline these builtins only affect their own stage and
+       * read and write nothing, so no process is needed: closing their pipe
+       * ends gives the neighbours the same EOF/EPIPE a child would.
+       */
+      last_status = !strcmp(cmd->exe, "exit") ? command_exit_code(cmd) : 0;
+      is_last_spawned = false;
     } else {
-      if (i < number_commands - 1) {
-        if (pipe(fd) == -1) {
-          exit(1);
-        }
+      pid_t pid;
+      const struct builtin *b = builtin_find(cmd->exe);
+      int rc;
+      if (b != NULL) {
+        rc = fork_builtin(b, cmd, prev_pipe_read, fd[1], fd[0], line,
+                          is_last && is_last_pipeline, &pid);
+      } else {
+        rc = spawn_command(cmd, prev_pipe_read, fd[1], line,
+                           is_last && is_last_pipeline, &pid);
       }
-      pid_t pid = fork();
-      if (pid == -1) {
-        exit(1);
-      } else if (pid == 0) {
-        if (i > 0) {
-          if (dup2(prev_pipe_read, STDIN_FILENO) == -1) {
-            _exit(1);
-          }
-          close(prev_pipe_read);
-        }
-        if (i < (number_commands - 1)) {
-          if (dup2(fd[1], STDOUT_FILENO) == -1) {
-            _exit(1);
-          }
-          close(fd[1]);
-        }
-
-        if (i == (number_commands - 1)) {
-          int outfile_fd = -1;
-          if (line->out_type == OUTPUT_TYPE_FILE_NEW) {
-            outfile_fd =
-                open(line->out_file, O_TRUNC | O_CREAT | O_WRONLY, 0644);
-          } else if (line->out_type == OUTPUT_TYPE_FILE_APPEND) {
-            outfile_fd =
-                open(line->out_file, O_APPEND | O_CREAT | O_WRONLY, 0644);
-          }
-
-          if (outfile_fd != -1) {
-            if (dup2(outfile_fd, STDOUT_FILENO) == -1) {
-              _exit(1);
-            }
-            close(outfile_fd);
-          }
-        }
-
-        if (i < number_commands - 1) {
-          close(fd[0]);
-        }
-
-        if (!strcmp(iterator->cmd.exe, "exit")) {
-          int arg = 0;
-          if (iterator->cmd.arg_count != 0) {
-            arg = atoi(*iterator->cmd.args);
-          }
-          _exit(arg);
-        }
-
-        char **args = calloc(iterator->cmd.arg_count + 2, sizeof(char *));
-        if (!args) {
-          perror("calloc args failed");
-          _exit(1);
-        }
-        args[0] = iterator->cmd.exe;
-        memcpy(args + 1, iterator->cmd.args,
-               sizeof(char *) * iterator->cmd.arg_count);
-        args[iterator->cmd.arg_count + 1] = NULL;
-
-        execvp(iterator->cmd.exe, args);
-        free(args);
-        _exit(1);
+      if (rc == 0) {
+        pids[pid_count++] = pid;
+        is_last_spawned = true;
       } else {
-        if (!strcmp(iterator->cmd.exe, "exit")) {
-          exit_command = true;
-          if (iterator->cmd.arg_count != 0) {
-            exit_code = atoi(*iterator->cmd.args);
-          }
-        }
-        if (i > 0) {
-          close(prev_pipe_read);
-        }
-        if (i < (number_commands - 1)) {
-          close(fd[1]);
-          prev_pipe_read = fd[0];
-        }
+        /* Same status as a failed exec in a forked child. */
+        last_status = 1;
+        is_last_spawned = false;
       }
-      iterator = iterator->next;
+    }
+    if (prev_pipe_read != -1)
+      close(prev_pipe_read);
+    if (!is_last) {
+      close(fd[1]);
+      prev_pipe_read = fd[0];
+    } else if (pump_file != -1) {
+      close(fd[1]);
+      pump_read = fd[0];
     }
   }
-  if (number_commands > 1) {
-    close(prev_pipe_read);
+  if (pump_read != -1) {
+    splice_pump(pump_read, pump_file);
+    close(pump_read);
+    close(pump_file);
   }
+  int result = last_status;
+  for (int i = 0; i < pid_count; ++i) {
+    int status;
+    if (waitpid(pids[i], &status, 0) == -1)
+      continue;
+    if (i == pid_count - 1 && is_last_spawned)
+      result = wait_status_code(status);
+  }
+  free(pids);
+  return result;
+}
+
+/**
+ * Run the pipelines of a command line joined by && and || with
+ * short-circuit evaluation: a pipeline after && runs only if the status so
+ * far is 0, after || only if it is not 0. A skipped pipeline keeps the
+ * status, so `false && a || b` runs b.
+ */
+static int execute_logical(const struct command_line *line) {
+  int result = 0;
+  bool should_run = true;
+  const struct expr *begin = line->head;
+  while (begin != NULL) {
+    const struct expr *end = begin;
+    while (end != NULL && end->type != EXPR_TYPE_AND &&
+           end->type != EXPR_TYPE_OR)
+      end = end->next;
+    if (should_run)
+      result = execute_pipeline(begin, end, line, end == NULL);
+    if (end == NULL)
+      break;
+    if (end->type == EXPR_TYPE_AND)
+      should_run = result == 0;
+    else
+      should_run = result != 0;
+    begin = end->next;
+  }
+  return result;
+}
+
+/**
+ * Start a background command line in a forked subshell and register it in
+ * the job table. The subshell runs the whole && / || chain, so the shell
+ * itself returns to reading commands immediately.
+ */
+static int execute_background(const struct command_line *line) {
+  if (!job_table_reserve())
+    return 1;
+  /* Do not let the child flush a copy of the pending output. */
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1)
+    return 1;
+  if (pid == 0) {
+    is_subshell = true;
+    if (sigchld_fd != -1)
+      close(sigchld_fd);
+    sigchld_fd = -1;
+    /* Like a non-interactive shell, do not let jobs eat the script input. */
+    int null_fd = open("/dev/null", O_RDONLY);
+    if (null_fd != -1) {
+      dup2(null_fd, STDIN_FILENO);
+      close(null_fd);
+    }
+    _exit(execute_logical(line));
+  }
+  job_table_add(pid);
+  return 0;
+}
+
+/** Up to this many lines run at once with -j. */
+static int jobs_limit = 1;
+
+/** A command line run by a forked subshell in parallel mode. */
+struct parallel_job {
+  struct parallel_job *next;
+  pid_t pid;
+  /** Read end of the job's stdout, -1 after EOF. */
+  int out_fd;
+  /** Output not written to the shell's stdout yet. */
+  struct out_buffer out;
+  bool is_exited;
   int status;
-  while ((wait(&status)) > 0) {
-    if (WIFEXITED(status)) {
-      result = WEXITSTATUS(status);
+};
+
+/**
+ * Lines run in parallel, in input order. Only the head may write to the
+ * real stdout, its output is streamed as it comes. The others buffer their
+ * output until all the lines before them are finished, like xargs -P with
+ * ordered output.
+ */
+static struct {
+  struct parallel_job *head;
+  struct parallel_job *tail;
+  /** Jobs not exited yet. Finished ones waiting for their turn do not count. */
+  int running;
+  /** Status of the last job popped from the queue. */
+  int last_status;
+} parallel = {NULL, NULL, 0, 0};
+
+/**
+ * A line can run in parallel with its neighbours if it does not change the
+ * shell state and does not write files the next lines might read.
+ */
+static bool line_is_independent(const struct command_line *line) {
+  if (line->is_background || line->out_type != OUTPUT_TYPE_STDOUT)
+    return false;
+  for (const struct expr *e = line->head; e != NULL; e = e->next) {
+    if (e->type == EXPR_TYPE_COMMAND &&
+        (!strcmp(e->cmd.exe, "cd") || !strcmp(e->cmd.exe, "exit") ||
+         !strcmp(e->cmd.exe, "hash")))
+      return false;
+  }
+  return true;
+}
+
+/** Write out what is ready and pop the finished jobs from the head. */
+static void parallel_flush(void) {
+  struct parallel_job *job;
+  while ((job = parallel.head) != NULL) {
+    if (job->out.size > 0) {
+      write_all(STDOUT_FILENO, job->out.data, job->out.size);
+      job->out.size = 0;
     }
+    if (job->out_fd != -1 || !job->is_exited)
+      return;
+    parallel.head = job->next;
+    if (parallel.head == NULL)
+      parallel.tail = NULL;
+    parallel.last_status = job->status;
+    free(job->out.data);
+    free(job);
   }
-  if (exit_command) {
-    return exit_code;
+}
+
+/**
+ * Collect the exited parallel jobs without blocking.
+ * @retval true Some job has exited.
+ */
+static bool parallel_reap(void) {
+  bool is_reaped = false;
+  for (struct parallel_job *job = parallel.head; job != NULL;
+       job = job->next) {
+    int status;
+    if (job->is_exited || waitpid(job->pid, &status, WNOHANG) <= 0)
+      continue;
+    job->is_exited = true;
+    job->status = wait_status_code(status);
+    parallel.running--;
+    is_reaped = true;
   }
-  return result;
+  return is_reaped;
 }
 
-int main(void) {
+/**
+ * Wait for any progress of the parallel jobs: output to collect or a child
+ * to exit. The exits are checked before polling too, because the SIGCHLD of
+ * a job might have been consumed already by the background job reaping.
+ */
+static void parallel_step(void) {
+  if (parallel_reap()) {
+    parallel_flush();
+    return;
+  }
+  int count = 0;
+  for (struct parallel_job *job = parallel.head; job != NULL; job = job->next)
+    count += job->out_fd != -1;
+  struct pollfd *fds = calloc(count + 1, sizeof(*fds));
+  if (fds == NULL)
+    shell_exit(1);
+  int i = 0;
+  for (struct parallel_job *job = parallel.head; job != NULL;
+       job = job->next) {
+    if (job->out_fd != -1) {
+      fds[i].fd = job->out_fd;
+      fds[i++].events = POLLIN;
+    }
+  }
+  fds[count].fd = sigchld_fd;
+  fds[count].events = POLLIN;
+  /* Without a signalfd exits are noticed by polling. */
+  int timeout = sigchld_fd == -1 ? 10 : -1;
+  if (poll(fds, count + 1, timeout) > 0) {
+    i = 0;
+    for (struct parallel_job *job = parallel.head; job != NULL;
+         job = job->next) {
+      if (job->out_fd == -1)
+        continue;
+      if (fds[i++].revents == 0)
+        continue;
+      char buf[64 * 1024];
+      ssize_t rc = read(job->out_fd, buf, sizeof(buf));
+      if (rc > 0) {
+        out_buffer_append(&job->out, buf, rc);
+      } else if (rc == 0 || errno != EINTR) {
+        close(job->out_fd);
+        job->out_fd = -1;
+      }
+    }
+    if (fds[count].revents != 0)
+      job_table_reap();
+  }
+  free(fds);
+  parallel_reap();
+  parallel_flush();
+}
+
+/**
+ * Wait for all the parallel jobs and write their output.
+ * @retval Status of the last of them.
+ */
+static int parallel_wait_all(void) {
+  while (parallel.head != NULL)
+    parallel_step();
+  return parallel.last_status;
+}
+
+/**
+ * Start a line in a forked subshell with its stdout going to a pipe read
+ * by the shell. Blocks while jobs_limit jobs are running.
+ */
+static void parallel_submit(const struct command_line *line) {
+  while (parallel.running >= jobs_limit)
+    parallel_step();
+  struct parallel_job *job = calloc(1, sizeof(*job));
+  int fd[2];
+  if (job == NULL || pipe2(fd, O_CLOEXEC) == -1) {
+    free(job);
+    parallel_wait_all();
+    parallel.last_status = execute_logical(line);
+    return;
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1) {
+    close(fd[0]);
+    close(fd[1]);
+    free(job);
+    parallel_wait_all();
+    parallel.last_status = execute_logical(line);
+    return;
+  }
+  if (pid == 0) {
+    is_subshell = true;
+    if (sigchld_fd != -1)
+      close(sigchld_fd);
+    sigchld_fd = -1;
+    if (dup2(fd[1], STDOUT_FILENO) == -1)
+      _exit(1);
+    close(fd[0]);
+    close(fd[1]);
+    /* Several jobs can't share the script input. */
+    int null_fd = open("/dev/null", O_RDONLY);
+    if (null_fd != -1) {
+      dup2(null_fd, STDIN_FILENO);
+      close(null_fd);
+    }
+    _exit(execute_logical(line));
+  }
+  close(fd[1]);
+  job->pid = pid;
+  job->out_fd = fd[0];
+  if (parallel.tail == NULL)
+    parallel.head = job;
+  else
+    parallel.tail->next = job;
+  parallel.tail = job;
+  parallel.running++;
+}
+
+static int execute_command_line(const struct command_line *line) {
+  assert(line != NULL);
+  if (jobs_limit > 1) {
+    if (line_is_independent(line)) {
+      parallel_submit(line);
+      return 0;
+    }
+    /* Other lines are barriers: everything before them must be done. */
+    parallel_wait_all();
+  }
+  if (line->is_background)
+    return execute_background(line);
+  return execute_logical(line);
+}
+
+/**
+ * Usage: mybash [-P pipe_size] [-S] [-j jobs]
+ * The script is read from stdin. -P sets the capacity of pipeline pipes in
+ * bytes, -S makes the shell splice the last stage's output into the
+ * redirect file. -j runs up to that many independent lines at once, with
+ * their output kept in input order.
+ */
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "P:Sj:")) != -1) {
+    switch (opt) {
+    case 'P':
+      pipe_size = atoi(optarg);
+      break;
+    case 'S':
+      use_splice = true;
+      break;
+    case 'j':
+      jobs_limit = atoi(optarg);
+      if (jobs_limit < 1)
+        jobs_limit = 1;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-P pipe_size] [-S] [-j jobs]\n", argv[0]);
+      return 1;
+    }
+  }
   const size_t buf_size = 1024;
   char buf[buf_size];
   int rc;
   struct parser *p = parser_new();
   int result = 0;
-  while ((rc = read(STDIN_FILENO, buf, buf_size)) > 0) {
+  bool is_last_line_parallel = false;
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) == 0)
+    sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  /* A negative fd is ignored by poll(), jobs are reaped after each line. */
+  struct pollfd fds[2] = {
+      {.fd = STDIN_FILENO, .events = POLLIN},
+      {.fd = sigchld_fd, .events = POLLIN},
+  };
+  while (true) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (fds[1].revents != 0)
+      job_table_reap();
+    if (fds[0].revents == 0)
+      continue;
+    if ((rc = read(STDIN_FILENO, buf, buf_size)) <= 0)
+      break;
     parser_feed(p, buf, rc);
     struct command_line *line = NULL;
     while (true) {
@@ -177,10 +1323,19 @@ int main(void) {
         printf("Error: %d\n", (int)err);
         continue;
       }
+      is_last_line_parallel = jobs_limit > 1 && line_is_independent(line);
       result = execute_command_line(line);
       command_line_delete(line);
+      job_table_reap();
     }
   }
+  int parallel_result = parallel_wait_all();
+  if (is_last_line_parallel)
+    result = parallel_result;
   parser_delete(p);
+  free(job_table.jobs);
+  path_cache_clear();
+  if (sigchld_fd != -1)
+    close(sigchld_fd);
   return result;
 }
@@ -278,6 +278,309 @@ static void test_timed_join(void) {
 #endif
 }
 
+struct order_arg {
+  int *order;
+  int *count;
+  int id;
+};
+
+static void *task_record_order_f(void *arg) {
+  struct order_arg *a = (struct order_arg *)arg;
+  int pos = __atomic_fetch_add(a->count, 1, __ATOMIC_RELAXED);
+  a->order[pos] = a->id;
+  return arg;
+}
+
+static void test_priority(void) {
+  unit_test_start();
+
+  struct thread_pool *p;
+  struct thread_task *blocker;
+  struct thread_task *tasks[5];
+  struct order_arg args[5];
+  int order[5];
+  int count = 0;
+  int block = 0;
+  void *result;
+  unit_fail_if(thread_pool_new(1, &p) != 0);
+  unit_check(thread_task_new_ex(&blocker, task_wait_for_f, &block,
+                                TPOOL_PRIORITY_COUNT, 0) ==
+                 TPOOL_ERR_INVALID_ARGUMENT,
+             "unknown priority is forbidden");
+  /*
+   * Occupy the only worker so all the next tasks are queued together.
+   */
+  unit_fail_if(thread_task_new(&blocker, task_wait_for_f, &block) != 0);
+  unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+  while (!thread_task_is_running(blocker))
+    usleep(100);
+
+  const enum thread_task_priority prios[5] = {
+      TPOOL_PRIORITY_LOW, TPOOL_PRIORITY_NORMAL, TPOOL_PRIORITY_NORMAL,
+      TPOOL_PRIORITY_NORMAL, TPOOL_PRIORITY_HIGH};
+  const double deadlines[5] = {0, 0, 10, 1, 0};
+  for (int i = 0; i < 5; ++i) {
+    args[i].order = order;
+    args[i].count = &count;
+    args[i].id = i;
+    unit_fail_if(thread_task_new_ex(&tasks[i], task_record_order_f, &args[i],
+                                    prios[i], deadlines[i]) != 0);
+    unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+  }
+  __atomic_store_n(&block, 1, __ATOMIC_RELAXED);
+  unit_fail_if(thread_task_join(blocker, &result) != 0);
+  unit_fail_if(thread_task_delete(blocker) != 0);
+  for (int i = 0; i < 5; ++i) {
+    unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+    unit_fail_if(thread_task_delete(tasks[i]) != 0);
+  }
+  unit_check(order[0] == 4, "high priority goes first");
+  unit_check(order[1] == 3 && order[2] == 2, "earliest deadline first");
+  unit_check(order[3] == 1, "then normal priority without a deadline");
+  unit_check(order[4] == 0, "low priority goes last");
+
+  struct thread_pool_histogram hist;
+  unit_fail_if(thread_pool_wait_histogram(p, TPOOL_PRIORITY_NORMAL, &hist) !=
+               0);
+  unit_check(hist.count == 4, "normal class wait histogram");
+  unit_check(thread_pool_histogram_percentile(&hist, 100) == hist.max_ns,
+             "p100 is the max wait");
+  unit_check(thread_pool_histogram_percentile(&hist, 50) <= hist.max_ns,
+             "p50 is not above the max wait");
+  unit_fail_if(thread_pool_wait_histogram(p, TPOOL_PRIORITY_HIGH, &hist) != 0);
+  unit_check(hist.count == 1, "high class wait histogram");
+  unit_fail_if(thread_pool_delete(p) != 0);
+
+  unit_test_finish();
+}
+
+static void test_placement(void) {
+  unit_test_start();
+
+  struct thread_pool *p;
+  struct thread_task *t;
+  int cpu = 0;
+  int bad_cpu = -1;
+  int arg = 0;
+  int block = 0;
+  void *result;
+  unit_fail_if(thread_pool_new(2, &p) != 0);
+  unit_check(thread_pool_set_worker_cpus(p, 2, &cpu, 1) ==
+                 TPOOL_ERR_INVALID_ARGUMENT,
+             "worker index is checked");
+  unit_check(thread_pool_set_worker_cpus(p, 0, &bad_cpu, 1) ==
+                 TPOOL_ERR_INVALID_ARGUMENT,
+             "cpu number is checked");
+  unit_check(thread_pool_worker_node(p, 1) == -1, "not pinned has no node");
+  unit_check(thread_pool_set_worker_cpus(p, 0, &cpu, 1) == 0, "pin worker");
+  unit_check(thread_pool_worker_node(p, 0) >= -1, "node is found or unknown");
+  /*
+   * A task placed on a busy worker is stolen by the idle one.
+   */
+  struct thread_task *blocker;
+  unit_fail_if(thread_task_new(&blocker, task_wait_for_f, &block) != 0);
+  unit_fail_if(thread_task_set_worker(blocker, 0) != 0);
+  unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+  while (!thread_task_is_running(blocker))
+    usleep(100);
+  unit_fail_if(thread_task_new(&t, task_incr_f, &arg) != 0);
+  unit_fail_if(thread_task_set_worker(t, 0) != 0);
+  unit_fail_if(thread_pool_push_task(p, t) != 0);
+  unit_check(thread_task_set_worker(t, 1) == TPOOL_ERR_TASK_IN_POOL ||
+                 thread_task_is_finished(t),
+             "can't move a queued task");
+  unit_check(thread_task_join(t, &result) == 0 && arg == 1,
+             "placed task is stolen while its worker is busy");
+  /*
+   * Node hint of a node without workers falls back to the global queue.
+   */
+  unit_fail_if(thread_task_set_node(t, 1000) != 0);
+  unit_fail_if(thread_pool_push_task(p, t) != 0);
+  unit_check(thread_task_join(t, &result) == 0 && arg == 2,
+             "unknown node hint works");
+  unit_fail_if(thread_task_delete(t) != 0);
+  __atomic_store_n(&block, 1, __ATOMIC_RELAXED);
+  unit_fail_if(thread_task_join(blocker, &result) != 0);
+  unit_fail_if(thread_task_delete(blocker) != 0);
+  unit_fail_if(thread_pool_delete(p) != 0);
+
+  unit_test_finish();
+}
+
+static void range_mark_f(size_t begin, size_t end, void *arg) {
+  int *marks = (int *)arg;
+  for (size_t i = begin; i < end; ++i)
+    __atomic_add_fetch(&marks[i], 1, __ATOMIC_RELAXED);
+}
+
+struct test_range {
+  size_t begin;
+  size_t end;
+  uint64_t sum;
+};
+
+static void *range_sum_f(size_t begin, size_t end, void *arg) {
+  (void)arg;
+  struct test_range *r = malloc(sizeof(*r));
+  r->begin = begin;
+  r->end = end;
+  r->sum = 0;
+  for (size_t i = begin; i < end; ++i)
+    r->sum += i;
+  return r;
+}
+
+static void *range_join_f(void *left, void *right, void *arg) {
+  int *misordered = (int *)arg;
+  struct test_range *l = (struct test_range *)left;
+  struct test_range *r = (struct test_range *)right;
+  if (l->end != r->begin)
+    __atomic_store_n(misordered, 1, __ATOMIC_RELAXED);
+  l->end = r->end;
+  l->sum += r->sum;
+  free(r);
+  return l;
+}
+
+static void test_parallel(void) {
+  unit_test_start();
+
+  struct thread_pool *p;
+  unit_fail_if(thread_pool_new(4, &p) != 0);
+  const size_t count = 100000;
+  int *marks = calloc(count, sizeof(*marks));
+  unit_check(thread_pool_parallel_for(p, 10, 5, 1, range_mark_f, marks) ==
+                 TPOOL_ERR_INVALID_ARGUMENT,
+             "reversed range is forbidden");
+  unit_check(thread_pool_parallel_for(p, 0, count, 100, range_mark_f,
+                                      marks) == 0,
+             "parallel for");
+  bool all_once = true;
+  for (size_t i = 0; i < count; ++i)
+    all_once = all_once && marks[i] == 1;
+  unit_check(all_once, "each item is processed exactly once");
+  free(marks);
+
+  int misordered = 0;
+  void *result;
+  unit_check(thread_pool_parallel_reduce(p, 0, count, 64, range_sum_f,
+                                         range_join_f, &misordered,
+                                         &result) == 0,
+             "parallel reduce");
+  struct test_range *r = (struct test_range *)result;
+  unit_check(r->begin == 0 && r->end == count, "whole range is reduced");
+  unit_check(r->sum == (uint64_t)count * (count - 1) / 2, "sum is correct");
+  unit_check(misordered == 0, "partial results are joined in order");
+  free(r);
+
+  unit_fail_if(thread_pool_parallel_reduce(p, 7, 7, 1, range_sum_f,
+                                           range_join_f, &misordered,
+                                           &result) != 0);
+  r = (struct test_range *)result;
+  unit_check(r->begin == 7 && r->end == 7 && r->sum == 0,
+             "empty range gives the function's result for it");
+  free(r);
+  unit_check(thread_pool_delete(p) == 0, "no tasks are left in the pool");
+
+  unit_test_finish();
+}
+
+static void test_elastic(void) {
+  unit_test_start();
+
+  struct thread_pool *p;
+  struct thread_task *tasks[4];
+  struct thread_pool_counts counts;
+  int arg = 0;
+  void *result;
+  unit_fail_if(thread_pool_new(4, &p) != 0);
+  unit_check(thread_pool_set_min_threads(p, 5) == TPOOL_ERR_INVALID_ARGUMENT,
+             "min can't be above max");
+  unit_check(thread_pool_set_growth(p, 0, 0) == TPOOL_ERR_INVALID_ARGUMENT,
+             "growth queue depth is at least 1");
+  unit_check(thread_pool_set_min_threads(p, 1) == 0, "set min threads");
+  unit_check(thread_pool_thread_count(p) == 1, "min threads are warm");
+  unit_fail_if(thread_pool_set_idle_timeout(p, 0.05) != 0);
+  /*
+   * A burst makes the pool grow to max.
+   */
+  for (int i = 0; i < 4; ++i) {
+    unit_fail_if(thread_task_new(&tasks[i], task_wait_for_f, &arg) != 0);
+    unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+  }
+  unit_check(thread_pool_thread_count(p) == 4, "grew on burst");
+  __atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+  for (int i = 0; i < 4; ++i)
+    unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+  /*
+   * Then the idle threads go away down to the min count.
+   */
+  for (int i = 0; i < 100 && thread_pool_thread_count(p) > 1; ++i)
+    usleep(10000);
+  unit_fail_if(thread_pool_get_counts(p, &counts) != 0);
+  unit_check(counts.thread_count == 1, "shrank to min after idle timeout");
+  unit_check(counts.started_total == 4 && counts.exited_total == 3,
+             "started and exited totals");
+  unit_check(counts.task_count == 0 && counts.active_count == 0,
+             "nothing is queued or running");
+  /*
+   * The reaped slots are reused.
+   */
+  arg = 0;
+  for (int i = 0; i < 4; ++i)
+    unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+  unit_check(thread_pool_thread_count(p) == 4, "grew again");
+  __atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+  for (int i = 0; i < 4; ++i) {
+    unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+    unit_fail_if(thread_task_delete(tasks[i]) != 0);
+  }
+  unit_fail_if(thread_pool_delete(p) != 0);
+
+  unit_test_finish();
+}
+
+static void test_stats(void) {
+  unit_test_start();
+
+  struct thread_pool *p;
+  struct thread_task *t;
+  struct thread_pool_stats stats;
+  int arg = 0;
+  void *result;
+  unit_fail_if(thread_pool_new(2, &p) != 0);
+  unit_fail_if(thread_pool_get_stats(p, &stats) != 0);
+  unit_check(stats.task_count == 0 && stats.queue_depth == 0,
+             "no tasks in a new pool");
+  unit_fail_if(thread_task_new(&t, task_incr_f, &arg) != 0);
+  for (int i = 0; i < 10; ++i) {
+    unit_fail_if(thread_pool_push_task(p, t) != 0);
+    unit_fail_if(thread_task_join(t, &result) != 0);
+  }
+  unit_fail_if(thread_task_delete(t) != 0);
+  unit_fail_if(thread_pool_get_stats(p, &stats) != 0);
+  unit_check(stats.task_count == 10, "executed tasks are counted");
+  unit_check(stats.wait_hist.count == 10 && stats.run_hist.count == 10,
+             "wait and run times are counted");
+  unit_check(thread_pool_histogram_percentile(&stats.run_hist, 99) <=
+                 stats.run_hist.max_ns,
+             "p99 run time is not above the max");
+
+  uint64_t per_worker = 0;
+  for (int i = 0; i < 2; ++i) {
+    struct thread_pool_stats ws;
+    unit_fail_if(thread_pool_get_worker_stats(p, i, &ws) != 0);
+    per_worker += ws.task_count;
+  }
+  unit_check(per_worker == stats.task_count, "workers sum up to the total");
+  unit_check(thread_pool_get_worker_stats(p, 2, &stats) ==
+                 TPOOL_ERR_INVALID_ARGUMENT,
+             "worker index is checked");
+  unit_fail_if(thread_pool_delete(p) != 0);
+
+  unit_test_finish();
+}
+
 static void test_detach_stress(void) {
 #if NEED_DETACH
   unit_test_start();
@@ -338,6 +641,23 @@ static void test_detach_long(void) {
 #endif
 }
 
+static void test_alignment(void) {
+  unit_test_start();
+
+  /* The pool has per-thread counters on own cache lines. */
+  struct thread_pool *pools[8];
+  bool ok = true;
+  for (int i = 0; i < 8; ++i) {
+    unit_fail_if(thread_pool_new(i + 1, &pools[i]) != 0);
+    ok = ok && (uintptr_t)pools[i] % 64 == 0;
+  }
+  unit_check(ok, "pools are cache line aligned");
+  for (int i = 0; i < 8; ++i)
+    unit_fail_if(thread_pool_delete(pools[i]) != 0);
+
+  unit_test_finish();
+}
+
 int main(int argc, char **argv) {
   if (doCmdMaxPoints(argc, argv)) {
     int result = 15;
@@ -357,6 +677,12 @@ int main(int argc, char **argv) {
   test_thread_pool_delete();
   test_thread_pool_max_tasks();
   test_timed_join();
+  test_priority();
+  test_placement();
+  test_parallel();
+  test_elastic();
+  test_stats();
+  test_alignment();
   test_detach_stress();
   test_detach_long();
 
@@ -1,9 +1,13 @@
+#define _GNU_SOURCE
 #include "thread_pool.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -18,66 +22,463 @@ struct thread_task {
   pthread_cond_t finished_condition;
 
   struct thread_pool *pool;
+  /** Queue links, valid while the task is queued. */
   struct thread_task *next;
+  struct thread_task *prev;
+  struct task_queue *queue;
+  /** Worker whose own queue holds the task, NULL for the global one. */
+  struct thread_worker *owner;
+
+  enum thread_task_priority priority;
+  /** Relative deadline in nanoseconds. 0 means no deadline. */
+  uint64_t deadline_ns;
+  /** Absolute deadline of the current push. */
+  uint64_t deadline_at_ns;
+  uint64_t push_time_ns;
+  /** Placement hints. -1 means no preference. */
+  int worker_hint;
+  int node_hint;
 
   enum status status_task;
+  bool is_joined;
   bool detach;
 };
 
+/** FIFO list of tasks. */
+struct task_queue {
+  struct thread_task *head;
+  struct thread_task *tail;
+};
+
+/** Tasks of one priority class. */
+struct task_class {
+  /** Tasks with a deadline, sorted by the absolute deadline. */
+  struct task_queue deadline_queue;
+  /** Tasks without a deadline in push order. */
+  struct task_queue queue;
+};
+
+/**
+ * Counters of one thread. Only that thread updates them, and they get
+ * own cache lines so the updates don't slow down other threads.
+ */
+struct worker_stats {
+  uint64_t task_count;
+  uint64_t steal_count;
+  uint64_t park_ns;
+  struct thread_pool_histogram wait_hist;
+  struct thread_pool_histogram run_hist;
+} __attribute__((aligned(64)));
+
+/**
+ * Worker slot. Exists for the whole pool life even when its thread is
+ * not started yet, so it can be configured and receive placed tasks.
+ */
+struct thread_worker {
+  struct thread_pool *pool;
+  pthread_t thread;
+  int id;
+  /** NUMA node of the pinned CPUs, -1 when unknown. */
+  int node;
+  cpu_set_t cpus;
+  bool has_cpus;
+  bool is_started;
+  /** The thread has exited on idle timeout and needs a join. */
+  bool is_exited;
+  /** Sleeps on its condition and nobody has signaled it yet. */
+  bool is_waiting;
+  pthread_cond_t wakeup_condition;
+
+  /** Tasks placed on this worker. Other workers can steal them. */
+  struct task_class classes[TPOOL_PRIORITY_COUNT];
+  int task_count;
+
+  struct worker_stats stats;
+};
+
 struct thread_pool {
-  pthread_t *threads;
+  struct thread_worker *workers;
+  /** Block holding the pool and the workers, not aligned. */
+  void *memory;
 
   int max_thread_count;
+  int min_thread_count;
   int current_thread_count;
-  int create_thread_count;
   int active_thread_count;
+  uint64_t started_total;
+  uint64_t exited_total;
 
-  struct thread_task *queue_head;
-  struct thread_task *queue_tail;
+  /** Sizing policy. */
+  uint64_t idle_timeout_ns;
+  int grow_queue_depth;
+  uint64_t grow_wait_ns;
+
+  /** Tasks without a placement hint. */
+  struct task_class classes[TPOOL_PRIORITY_COUNT];
+  struct thread_pool_histogram wait_hist[TPOOL_PRIORITY_COUNT];
+  /** All queued tasks, both global and placed on workers. */
   int task_count;
 
   pthread_mutex_t mutex;
-  pthread_cond_t available_task_condition;
   pthread_cond_t no_task_condition;
 
   bool stop;
+
+  /** Counters of tasks run by threads not from this pool. */
+  pthread_mutex_t external_stats_mutex;
+  struct worker_stats external_stats;
 };
 
+/** Worker of the pool running in this thread, if any. */
+static __thread struct thread_worker *current_worker;
+
+static int thread_pool_start_worker(struct thread_pool *pool,
+                                    struct thread_worker *worker);
+
+static uint64_t tpool_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Change a pool counter. Must be called under the pool mutex, the store is
+ * atomic so as the counter can be loaded without the mutex.
+ */
+static inline void count_add(int *counter, int value) {
+  __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static inline int count_load(const int *counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/**
+ * Add to a counter which only the calling thread changes. Readers can
+ * load it concurrently, and no locked instruction is needed.
+ */
+static inline void stat_add(uint64_t *counter, uint64_t value) {
+  __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stat_load(const uint64_t *counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static int histogram_bucket(uint64_t value) {
+  if (value < TPOOL_HISTOGRAM_SUB_BUCKETS) {
+    return (int)value;
+  }
+  int msb = 63 - __builtin_clzll(value);
+  int shift = msb - TPOOL_HISTOGRAM_SUB_BITS;
+  int sub = (int)(value >> shift) & (TPOOL_HISTOGRAM_SUB_BUCKETS - 1);
+  return (shift + 1) * TPOOL_HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+static uint64_t histogram_bucket_upper(int bucket) {
+  if (bucket < TPOOL_HISTOGRAM_SUB_BUCKETS) {
+    return bucket;
+  }
+  int shift = bucket / TPOOL_HISTOGRAM_SUB_BUCKETS - 1;
+  uint64_t sub = bucket % TPOOL_HISTOGRAM_SUB_BUCKETS;
+  uint64_t low = (TPOOL_HISTOGRAM_SUB_BUCKETS + sub) << shift;
+  return low + (1ULL << shift) - 1;
+}
+
+/** Single writer update, see stat_add(). */
+static void histogram_add(struct thread_pool_histogram *hist,
+                          uint64_t value) {
+  stat_add(&hist->count, 1);
+  stat_add(&hist->total_ns, value);
+  if (value > hist->max_ns) {
+    __atomic_store_n(&hist->max_ns, value, __ATOMIC_RELAXED);
+  }
+  stat_add(&hist->buckets[histogram_bucket(value)], 1);
+}
+
+static void histogram_merge(struct thread_pool_histogram *dst,
+                            const struct thread_pool_histogram *src) {
+  dst->count += stat_load(&src->count);
+  dst->total_ns += stat_load(&src->total_ns);
+  uint64_t max_ns = stat_load(&src->max_ns);
+  if (max_ns > dst->max_ns) {
+    dst->max_ns = max_ns;
+  }
+  for (int i = 0; i < TPOOL_HISTOGRAM_BUCKETS; i++) {
+    dst->buckets[i] += stat_load(&src->buckets[i]);
+  }
+}
+
+static void task_queue_push(struct task_queue *queue,
+                            struct thread_task *task) {
+  task->next = NULL;
+  task->prev = queue->tail;
+  if (queue->head == NULL) {
+    queue->head = task;
+  } else {
+    queue->tail->next = task;
+  }
+  queue->tail = task;
+  task->queue = queue;
+}
+
+/** Insert keeping the deadline order, FIFO among equal deadlines. */
+static void task_queue_insert_by_deadline(struct task_queue *queue,
+                                          struct thread_task *task) {
+  if (queue->head == NULL ||
+      queue->tail->deadline_at_ns <= task->deadline_at_ns) {
+    task_queue_push(queue, task);
+    return;
+  }
+  struct thread_task *pos = queue->head;
+  while (pos->deadline_at_ns <= task->deadline_at_ns) {
+    pos = pos->next;
+  }
+  task->next = pos;
+  task->prev = pos->prev;
+  if (pos->prev == NULL) {
+    queue->head = task;
+  } else {
+    pos->prev->next = task;
+  }
+  pos->prev = task;
+  task->queue = queue;
+}
+
+static void task_queue_remove(struct task_queue *queue,
+                              struct thread_task *task) {
+  if (task->prev == NULL) {
+    queue->head = task->next;
+  } else {
+    task->prev->next = task->next;
+  }
+  if (task->next == NULL) {
+    queue->tail = task->prev;
+  } else {
+    task->next->prev = task->prev;
+  }
+  task->next = NULL;
+  task->prev = NULL;
+  task->queue = NULL;
+}
+
+static struct thread_task *task_queue_pop(struct task_queue *queue) {
+  struct thread_task *task = queue->head;
+  if (task != NULL) {
+    task_queue_remove(queue, task);
+  }
+  return task;
+}
+
+static void task_class_push(struct task_class *cls, struct thread_task *task) {
+  if (task->deadline_ns > 0) {
+    task->deadline_at_ns = task->push_time_ns + task->deadline_ns;
+    task_queue_insert_by_deadline(&cls->deadline_queue, task);
+  } else {
+    task_queue_push(&cls->queue, task);
+  }
+}
+
+static struct thread_task *task_class_pop(struct task_class *cls) {
+  struct thread_task *task = task_queue_pop(&cls->deadline_queue);
+  if (task == NULL) {
+    task = task_queue_pop(&cls->queue);
+  }
+  return task;
+}
+
+static struct thread_task *worker_pop_task(struct thread_worker *worker,
+                                           int priority) {
+  if (worker->task_count == 0) {
+    return NULL;
+  }
+  struct thread_task *task = task_class_pop(&worker->classes[priority]);
+  if (task != NULL) {
+    worker->task_count--;
+  }
+  return task;
+}
+
+/** Steal a task of the given priority, the local node goes first. */
+static struct thread_task *worker_steal_task(struct thread_worker *worker,
+                                             int priority) {
+  struct thread_pool *pool = worker->pool;
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 1; i < pool->max_thread_count; i++) {
+      struct thread_worker *victim =
+          &pool->workers[(worker->id + i) % pool->max_thread_count];
+      bool is_local = worker->node >= 0 && victim->node == worker->node;
+      if (is_local != (pass == 0)) {
+        continue;
+      }
+      struct thread_task *task = worker_pop_task(victim, priority);
+      if (task != NULL) {
+        stat_add(&worker->stats.steal_count, 1);
+        return task;
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Take the next task to run. A higher priority class always wins, and
+ * inside a class the worker's own queue goes first, then the global
+ * one, then stealing. Must be called under the pool mutex.
+ */
+static struct thread_task *thread_pool_pop_task(struct thread_worker *worker) {
+  struct thread_pool *pool = worker->pool;
+  for (int i = 0; i < TPOOL_PRIORITY_COUNT; i++) {
+    struct thread_task *task = worker_pop_task(worker, i);
+    if (task == NULL) {
+      task = task_class_pop(&pool->classes[i]);
+    }
+    if (task == NULL) {
+      task = worker_steal_task(worker, i);
+    }
+    if (task != NULL) {
+      uint64_t wait_ns = tpool_now_ns() - task->push_time_ns;
+      histogram_add(&pool->wait_hist[i], wait_ns);
+      histogram_add(&worker->stats.wait_hist, wait_ns);
+      count_add(&pool->task_count, -1);
+      return task;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Wake up a sleeping worker: the preferred one, or one on its node, or
+ * any. Must be called under the pool mutex.
+ */
+static void thread_pool_wake_worker(struct thread_pool *pool,
+                                    struct thread_worker *preferred) {
+  struct thread_worker *chosen = NULL;
+  if (preferred != NULL && preferred->is_waiting) {
+    chosen = preferred;
+  }
+  int node = preferred != NULL ? preferred->node : -1;
+  for (int i = 0; i < pool->max_thread_count && chosen == NULL; i++) {
+    struct thread_worker *worker = &pool->workers[i];
+    if (!worker->is_waiting) {
+      continue;
+    }
+    if (node < 0 || worker->node == node) {
+      chosen = worker;
+    }
+  }
+  for (int i = 0; i < pool->max_thread_count && chosen == NULL; i++) {
+    if (pool->workers[i].is_waiting) {
+      chosen = &pool->workers[i];
+    }
+  }
+  if (chosen != NULL) {
+    chosen->is_waiting = false;
+    pthread_cond_signal(&chosen->wakeup_condition);
+  }
+}
+
+/**
+ * Start one more thread if the max is not reached, preferably in the
+ * given slot. Must be called under the pool mutex.
+ * @retval 0 Started or the max is reached.
+ * @retval -1 The thread could not be started.
+ */
+static int thread_pool_grow(struct thread_pool *pool,
+                            struct thread_worker *preferred) {
+  if (pool->current_thread_count >= pool->max_thread_count) {
+    return 0;
+  }
+  struct thread_worker *worker = preferred;
+  for (int i = 0; i < pool->max_thread_count &&
+                  (worker == NULL || worker->is_started);
+       i++) {
+    worker = &pool->workers[i];
+  }
+  if (!worker->is_started) {
+    return thread_pool_start_worker(pool, worker);
+  }
+  return 0;
+}
+
 void *start_thread(void *arg) {
-  struct thread_pool *pool = (struct thread_pool *)arg;
+  struct thread_worker *worker = (struct thread_worker *)arg;
+  struct thread_pool *pool = worker->pool;
+  current_worker = worker;
   while (true) {
     pthread_mutex_lock(&pool->mutex);
 
-    while ((pool->stop == false) && (pool->queue_head == NULL)) {
-      pthread_cond_wait(&pool->available_task_condition, &pool->mutex);
+    while ((pool->stop == false) && (pool->task_count == 0)) {
+      worker->is_waiting = true;
+      uint64_t park_start = tpool_now_ns();
+      if (pool->idle_timeout_ns == 0 ||
+          pool->current_thread_count <= pool->min_thread_count) {
+        pthread_cond_wait(&worker->wakeup_condition, &pool->mutex);
+        stat_add(&worker->stats.park_ns, tpool_now_ns() - park_start);
+        continue;
+      }
+      uint64_t deadline = park_start + pool->idle_timeout_ns;
+      struct timespec ts = {.tv_sec = deadline / 1000000000,
+                            .tv_nsec = deadline % 1000000000};
+      int rc =
+          pthread_cond_timedwait(&worker->wakeup_condition, &pool->mutex, &ts);
+      stat_add(&worker->stats.park_ns, tpool_now_ns() - park_start);
+      if (rc == ETIMEDOUT && pool->stop == false && pool->task_count == 0 &&
+          pool->current_thread_count > pool->min_thread_count) {
+        /* The slot stays, the next start joins this thread. */
+        worker->is_waiting = false;
+        worker->is_started = false;
+        worker->is_exited = true;
+        count_add(&pool->current_thread_count, -1);
+        pool->exited_total++;
+        pthread_mutex_unlock(&pool->mutex);
+        return NULL;
+      }
     }
+    worker->is_waiting = false;
 
-    if (pool->stop == true && (pool->queue_head == NULL)) {
-      pool->current_thread_count--;
+    if (pool->stop == true && (pool->task_count == 0)) {
+      count_add(&pool->current_thread_count, -1);
       pthread_mutex_unlock(&pool->mutex);
       pthread_exit(NULL);
     }
 
-    struct thread_task *current = pool->queue_head;
+    struct thread_task *current = thread_pool_pop_task(worker);
     if (current == NULL) {
       pthread_mutex_unlock(&pool->mutex);
       continue;
     }
-
-    pool->queue_head = current->next;
-    if (pool->queue_head == NULL) {
-      pool->queue_tail = NULL;
+    count_add(&pool->active_thread_count, 1);
+    /* The queue is not drained fast enough, add a thread. */
+    if (pool->grow_wait_ns > 0 &&
+        tpool_now_ns() - current->push_time_ns > pool->grow_wait_ns &&
+        pool->task_count >
+            pool->current_thread_count - pool->active_thread_count) {
+      thread_pool_grow(pool, NULL);
     }
-    pool->task_count--;
-    pool->active_thread_count++;
     pthread_mutex_unlock(&pool->mutex);
     pthread_mutex_lock(&current->mutex);
     current->status_task = RUNNING;
     pthread_mutex_unlock(&current->mutex);
     void *result = NULL;
     if (pool->stop == false) {
+      uint64_t run_start = tpool_now_ns();
       result = current->function(current->arg);
+      histogram_add(&worker->stats.run_hist, tpool_now_ns() - run_start);
+      stat_add(&worker->stats.task_count, 1);
+    }
+    /*
+     * The worker must be idle again before the task is seen finished.
+     * Otherwise a re-push right after join could start a new thread
+     * while this one is about to be free.
+     */
+    pthread_mutex_lock(&pool->mutex);
+    count_add(&pool->active_thread_count, -1);
+    if (pool->task_count == 0 && pool->active_thread_count == 0) {
+      pthread_cond_signal(&pool->no_task_condition);
     }
+    pthread_mutex_unlock(&pool->mutex);
+
     pthread_mutex_lock(&current->mutex);
     current->result = result;
     bool detached = current->detach;
@@ -89,42 +490,100 @@ void *start_thread(void *arg) {
       pthread_cond_destroy(&current->finished_condition);
       free(current);
     }
-    pthread_mutex_lock(&pool->mutex);
-    pool->active_thread_count--;
-    if (pool->task_count == 0 && pool->active_thread_count == 0) {
-      pthread_cond_signal(&pool->no_task_condition);
-    }
-
-    pthread_mutex_unlock(&pool->mutex);
   }
   return NULL;
 };
 
+/** Must be called under the pool mutex. */
+static int thread_pool_start_worker(struct thread_pool *pool,
+                                    struct thread_worker *worker) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (worker->has_cpus) {
+    pthread_attr_setaffinity_np(&attr, sizeof(worker->cpus), &worker->cpus);
+  }
+  if (worker->is_exited) {
+    /* It has unlocked the mutex for the last time already. */
+    pthread_join(worker->thread, NULL);
+    worker->is_exited = false;
+  }
+  int rc = pthread_create(&worker->thread, &attr, start_thread, worker);
+  pthread_attr_destroy(&attr);
+  if (rc != 0) {
+    return -1;
+  }
+  worker->is_started = true;
+  count_add(&pool->current_thread_count, 1);
+  pool->started_total++;
+  return 0;
+}
+
+/** Find the NUMA node of a CPU by its node link in sysfs. */
+static int cpu_node(int cpu) {
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    return -1;
+  }
+  int node = -1;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (sscanf(entry->d_name, "node%d", &node) == 1) {
+      break;
+    }
+    node = -1;
+  }
+  closedir(dir);
+  return node;
+}
+
 int thread_pool_new(int max_thread_count, struct thread_pool **pool) {
   if (max_thread_count <= 0 || max_thread_count > TPOOL_MAX_THREADS) {
     return TPOOL_ERR_INVALID_ARGUMENT;
   }
-  struct thread_pool *new_pool = calloc(1, sizeof(struct thread_pool));
-  if (new_pool == NULL) {
-    return -1;
-  }
-  new_pool->threads = calloc(max_thread_count, sizeof(pthread_t));
-  if (new_pool->threads == NULL) {
-    free(new_pool);
+  /*
+   * The pool and the workers are cache line aligned because of their
+   * counters, so they share one block with the workers right after the
+   * pool. Not posix_memalign() so as heap checkers like heap_help see the
+   * block.
+   */
+  const size_t align = __alignof__(struct thread_worker);
+  _Static_assert(sizeof(struct thread_pool) %
+                         __alignof__(struct thread_worker) == 0,
+                 "workers after the pool stay aligned");
+  void *memory = calloc(1, align + sizeof(struct thread_pool) +
+                               max_thread_count * sizeof(struct thread_worker));
+  if (memory == NULL) {
     return -1;
   }
+  uintptr_t addr = (uintptr_t)memory;
+  struct thread_pool *new_pool =
+      (struct thread_pool *)((addr + align - 1) / align * align);
+  new_pool->memory = memory;
+  new_pool->workers = (struct thread_worker *)(new_pool + 1);
   new_pool->max_thread_count = max_thread_count;
   new_pool->current_thread_count = 0;
   new_pool->active_thread_count = 0;
-  new_pool->create_thread_count = 0;
-  new_pool->queue_head = NULL;
-  new_pool->queue_tail = NULL;
   new_pool->task_count = 0;
+  new_pool->grow_queue_depth = 1;
   new_pool->stop = false;
+  /* Monotonic clock for idle timeouts. */
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  for (int i = 0; i < max_thread_count; i++) {
+    struct thread_worker *worker = &new_pool->workers[i];
+    worker->pool = new_pool;
+    worker->id = i;
+    worker->node = -1;
+    pthread_cond_init(&worker->wakeup_condition, &attr);
+  }
+  pthread_condattr_destroy(&attr);
 
   pthread_mutex_init(&new_pool->mutex, NULL);
-  pthread_cond_init(&new_pool->available_task_condition, NULL);
   pthread_cond_init(&new_pool->no_task_condition, NULL);
+  pthread_mutex_init(&new_pool->external_stats_mutex, NULL);
   *pool = new_pool;
   return 0;
 }
@@ -139,6 +598,188 @@ int thread_pool_thread_count(const struct thread_pool *pool) {
   return count;
 }
 
+int thread_pool_set_idle_timeout(struct thread_pool *pool, double timeout) {
+  if (pool == NULL) {
+    return TPOOL_ERR_INVALID_ARGUMENT;
+  }
+  pthread_mutex_lock(&pool->mutex);
+  pool->idle_timeout_ns = timeout > 0 ? (uint64_t)(timeout * 1e9) : 0;
+  /* Let the sleeping threads start counting the timeout. */
+  for (int i = 0; i < pool->max_thread_count; i++) {
+    pthread_cond_signal(&pool->workers[i].wakeup_condition);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return 0;
+}
+
+int thread_pool_set_min_threads(struct thread_pool *pool,
+                                int min_thread_count) {
+  if (pool == NULL || min_thread_count < 0 ||
+      min_thread_count > pool->max_thread_count) {
+    return TPOOL_ERR_INVALID_ARGUMENT;
+  }
+  pthread_mutex_lock(&pool->mutex);
+  pool->min_thread_count = min_thread_count;
+  while (pool->current_thread_count < pool->min_thread_count) {
+    int count = pool->current_thread_count;
+    thread_pool_grow(pool, NULL);
+    if (count == pool->current_thread_count) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return 0;
+}
+
+int thread_pool_set_growth(struct thread_pool *pool, int queue_depth,
+                           double max_wait) {
+  if (pool == NULL || queue_depth < 1) {
+    return TPOOL_ERR_INVALID_ARGUMENT;
+  }
+  pthread_mutex_lock(&pool->mutex);
+  pool->grow_queue_depth = queue_depth;
+  pool->grow_wait_ns = max_wait > 0 ? (uint64_t)(max_wait * 1e9) : 0;
+  pthread_mutex_unlock(&pool->mutex);
+  return 0;
+}
+
+int thread_pool_get_counts(const struct thread_pool *pool,
+                           struct thread_pool_counts *counts) {
+  if (pool == NULL || counts == NULL) {
+    return TPOOL_ERR_INVALID_ARGUMENT;
+  }
+  pthread_mutex_lock((pthread_mutex_t *)&pool->mutex);
+  counts->thread_count = pool->current_thread_count;
+  counts->active_count = pool->active_thread_count;
+  counts->task_count = pool->task_count;
+  counts->started_total = pool->started_total;
+  counts->exited_total = pool->exited_total;
+  pthread_mutex_unlock((pthread_mutex_t *)&pool->mutex);
+  return 0;
+}
+
+static void worker_stats_merge(struct thread_pool_stats *dst,
+                               const struct worker_stats *src) {
+  dst->task_count += stat_load(&src->task_count);
+  dst->steal_count += stat_load(&src->steal_count);
+  dst->park_ns += stat_load(&src->park_ns);
+  histogram_merge(&dst->wait_hist, &src->wait_hist);
+  histogram_merge(&dst->run_hist, &src->run_hist);
+}
+
+int thread_pool_get_stats(const struct thread_pool *pool,
+                          struct thread_pool_stats *stats) {
+  if (pool == NULL || stats == NULL) {
+    return TPOOL_ERR_INVALID_ARGUMENT;
+  }
+  memset(stats, 0, sizeof(*stats));
+  for (int i = 0; i < pool->max_thread_count; i++) {
+    worker_stats_merge(stats, &pool->workers[i].stats);
+  }
+  worker_stats_merge(stats, &pool->external_stats);
+  pthread_mutex_lock((pthread_mutex_t *)&pool->mutex);
+  stats->queue_depth = pool->task_count;
+  pthread_mutex_unlock((pthread_mutex_t *)&pool->mutex);
+  return 0;
+}
+
+int thread_pool_get_worker_stats(const struct thread_pool *pool, int worker,
+                                 struct thread_pool_stats *stats) {
+  if (pool == NULL || stats == NULL || worker < 0 ||
+      worker >= pool->max_thread_count) {
+    return TPOOL_ERR_INVALID_ARGUMENT;
+  }
+  memset(stats, 0, sizeof(*stats));
+  const struct thread_worker *w = &pool->workers[worker];
+  worker_stats_merge(stats, &w->stats);
+  pthread_mutex_lock((pthread_mutex_t *)&pool->mutex);
+  stats->queue_depth = w->task_count;
+  pthread_mutex_unlock((pthread_mutex_t *)&pool->mutex);
+  return 0;
+}
+
+int thread_pool_set_worker_cpus(struct thread_pool *pool, int worker,
+                                const int *cpus, int cpu_count) {
+  if (pool == NULL || worker < 0 || worker >= pool->max_thread_count ||
+      cpu_count < 0 || (cpu_count > 0 && cpus == NULL)) {
+    return TPOOL_ERR_INVALID_ARGUMENT;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int i = 0; i < cpu_count; i++) {
+    if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE) {
+      return TPOOL_ERR_INVALID_ARGUMENT;
+    }
+    CPU_SET(cpus[i], &set);
+  }
+  int node = cpu_count > 0 ? cpu_node(cpus[0]) : -1;
+
+  pthread_mutex_lock(&pool->mutex);
+  struct thread_worker *w = &pool->workers[worker];
+  w->cpus = set;
+  w->has_cpus = cpu_count > 0;
+  w->node = node;
+  if (w->is_started) {
+    if (!w->has_cpus) {
+      for (int i = 0; i < CPU_SETSIZE; i++) {
+        CPU_SET(i, &set);
+      }
+    }
+    pthread_setaffinity_np(w->thread, sizeof(set), &set);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return 0;
+}
+
+int thread_pool_worker_node(const struct thread_pool *pool, int worker) {
+  if (pool == NULL || worker < 0 || worker >= pool->max_thread_count) {
+    return -1;
+  }
+  pthread_mutex_lock((pthread_mutex_t *)&pool->mutex);
+  int node = pool->workers[worker].node;
+  pthread_mutex_unlock((pthread_mutex_t *)&pool->mutex);
+  return node;
+}
+
+int thread_pool_wait_histogram(const struct thread_pool *pool,
+                               enum thread_task_priority priority,
+                               struct thread_pool_histogram *hist) {
+  if (pool == NULL || hist == NULL || (int)priority < 0 ||
+      priority >= TPOOL_PRIORITY_COUNT) {
+    return TPOOL_ERR_INVALID_ARGUMENT;
+  }
+  pthread_mutex_lock((pthread_mutex_t *)&pool->mutex);
+  *hist = pool->wait_hist[priority];
+  pthread_mutex_unlock((pthread_mutex_t *)&pool->mutex);
+  return 0;
+}
+
+uint64_t
+thread_pool_histogram_percentile(const struct thread_pool_histogram *hist,
+                                 double percentile) {
+  if (hist == NULL || hist->count == 0) {
+    return 0;
+  }
+  if (percentile < 0) {
+    percentile = 0;
+  } else if (percentile > 100) {
+    percentile = 100;
+  }
+  uint64_t rank = (uint64_t)(percentile / 100 * hist->count + 0.5);
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < TPOOL_HISTOGRAM_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= rank) {
+      uint64_t upper = histogram_bucket_upper(i);
+      return upper < hist->max_ns ? upper : hist->max_ns;
+    }
+  }
+  return hist->max_ns;
+}
+
 int thread_pool_delete(struct thread_pool *pool) {
   if (pool == NULL) {
     return TPOOL_ERR_INVALID_ARGUMENT;
@@ -151,81 +792,180 @@ int thread_pool_delete(struct thread_pool *pool) {
   }
 
   pool->stop = true;
-  pthread_cond_broadcast(&pool->available_task_condition);
+  /* After the stop no thread exits on idle, so the flags are final. */
+  bool need_join[TPOOL_MAX_THREADS];
+  for (int i = 0; i < pool->max_thread_count; i++) {
+    struct thread_worker *worker = &pool->workers[i];
+    need_join[i] = worker->is_started || worker->is_exited;
+    pthread_cond_broadcast(&worker->wakeup_condition);
+  }
   pthread_mutex_unlock(&pool->mutex);
 
-  for (int i = 0; i < pool->create_thread_count; i++) {
-    if (pool->threads[i]) {
-      pthread_join(pool->threads[i], NULL);
+  for (int i = 0; i < pool->max_thread_count; i++) {
+    struct thread_worker *worker = &pool->workers[i];
+    if (need_join[i]) {
+      pthread_join(worker->thread, NULL);
     }
+    pthread_cond_destroy(&worker->wakeup_condition);
   }
 
-  struct thread_task *task = pool->queue_head;
-  while (task != NULL) {
-    struct thread_task *next = task->next;
-    pthread_mutex_destroy(&task->mutex);
-    pthread_cond_destroy(&task->finished_condition);
-    free(task);
-    task = next;
-  }
-
-  pool->queue_tail = NULL;
-  pool->task_count = 0;
-
   pthread_mutex_destroy(&pool->mutex);
-  pthread_cond_destroy(&pool->available_task_condition);
   pthread_cond_destroy(&pool->no_task_condition);
-  free(pool->threads);
-  free(pool);
+  pthread_mutex_destroy(&pool->external_stats_mutex);
+  free(pool->memory);
 
   return 0;
 }
 
+/** Pick a worker for a task with a placement hint. NULL if none. */
+static struct thread_worker *thread_pool_place_task(struct thread_pool *pool,
+                                                    struct thread_task *task) {
+  if (task->worker_hint >= 0) {
+    if (task->worker_hint < pool->max_thread_count) {
+      return &pool->workers[task->worker_hint];
+    }
+    return NULL;
+  }
+  if (task->node_hint < 0) {
+    return NULL;
+  }
+  /* Least loaded worker of the node, a started one is preferred. */
+  struct thread_worker *best = NULL;
+  for (int i = 0; i < pool->max_thread_count; i++) {
+    struct thread_worker *worker = &pool->workers[i];
+    if (worker->node != task->node_hint) {
+      continue;
+    }
+    if (best == NULL || (worker->is_started && !best->is_started) ||
+        (worker->is_started == best->is_started &&
+         worker->task_count < best->task_count)) {
+      best = worker;
+    }
+  }
+  return best;
+}
+
 int thread_pool_push_task(struct thread_pool *pool, struct thread_task *task) {
-  if (pool == NULL || task == NULL || pool->stop == true) {
+  if (pool == NULL || task == NULL) {
+    return TPOOL_ERR_INVALID_ARGUMENT;
+  }
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->stop == true) {
+    pthread_mutex_unlock(&pool->mutex);
     return TPOOL_ERR_INVALID_ARGUMENT;
   }
   if (pool->task_count >= TPOOL_MAX_TASKS) {
+    pthread_mutex_unlock(&pool->mutex);
     return TPOOL_ERR_TOO_MANY_TASKS;
   }
+  pthread_mutex_lock(&task->mutex);
   if (task->status_task != NEW && task->status_task != FINISHED) {
+    pthread_mutex_unlock(&task->mutex);
+    pthread_mutex_unlock(&pool->mutex);
     return TPOOL_ERR_TASK_IN_POOL;
   }
-  pthread_mutex_lock(&pool->mutex);
+  enum status old_status = task->status_task;
   task->status_task = IN_QUEUED;
+  task->is_joined = false;
   task->pool = pool;
-  task->next = NULL;
-  if (pool->queue_head == NULL) {
-    pool->queue_head = task;
-    pool->queue_tail = task;
+  pthread_mutex_unlock(&task->mutex);
+
+  task->push_time_ns = tpool_now_ns();
+  struct thread_worker *target = thread_pool_place_task(pool, task);
+  task->owner = target;
+  if (target != NULL) {
+    task_class_push(&target->classes[task->priority], task);
+    target->task_count++;
   } else {
-    pool->queue_tail->next = task;
-    pool->queue_tail = task;
-  }
-  pool->task_count++;
-  if ((pool->current_thread_count < pool->max_thread_count) &&
-      (pool->active_thread_count == pool->current_thread_count)) {
-    if (pool->create_thread_count < pool->max_thread_count) {
-      if (pthread_create(&pool->threads[pool->create_thread_count], NULL,
-                         start_thread, pool) == 0) {
-        pool->current_thread_count++;
-        pool->create_thread_count++;
-      } else {
-        pool->task_count--;
-        thread_task_delete(task);
-        pthread_mutex_unlock(&pool->mutex);
-        return 0;
-      }
+    task_class_push(&pool->classes[task->priority], task);
+  }
+  count_add(&pool->task_count, 1);
+  int idle_thread_count =
+      pool->current_thread_count - pool->active_thread_count;
+  if ((pool->task_count - idle_thread_count >= pool->grow_queue_depth ||
+       pool->current_thread_count == 0) &&
+      thread_pool_grow(pool, target) != 0 &&
+      pool->current_thread_count == 0) {
+    /* Nobody would ever run the task. */
+    task_queue_remove(task->queue, task);
+    if (target != NULL) {
+      target->task_count--;
     }
+    count_add(&pool->task_count, -1);
+    pthread_mutex_lock(&task->mutex);
+    task->status_task = old_status;
+    pthread_mutex_unlock(&task->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+    return -1;
   }
-  pthread_cond_signal(&pool->available_task_condition);
+  thread_pool_wake_worker(pool, target);
   pthread_mutex_unlock(&pool->mutex);
   return 0;
 }
 
+/**
+ * Take a still queued task out of its pool so the calling thread can
+ * run it instead of a worker.
+ * @retval true The task is taken.
+ * @retval false A worker has already taken the task.
+ */
+static bool thread_pool_take_task(struct thread_task *task) {
+  struct thread_pool *pool = task->pool;
+  pthread_mutex_lock(&pool->mutex);
+  if (task->queue == NULL) {
+    pthread_mutex_unlock(&pool->mutex);
+    return false;
+  }
+  task_queue_remove(task->queue, task);
+  histogram_add(&pool->wait_hist[task->priority],
+                tpool_now_ns() - task->push_time_ns);
+  if (task->owner != NULL) {
+    task->owner->task_count--;
+  }
+  count_add(&pool->task_count, -1);
+  pthread_mutex_unlock(&pool->mutex);
+  return true;
+}
+
+/** Run a taken task in the calling thread and finish it. */
+static void thread_task_run_here(struct thread_task *task) {
+  struct thread_pool *pool = task->pool;
+  pthread_mutex_lock(&task->mutex);
+  task->status_task = RUNNING;
+  pthread_mutex_unlock(&task->mutex);
+  uint64_t run_start = tpool_now_ns();
+  void *result = task->function(task->arg);
+  uint64_t run_end = tpool_now_ns();
+  if (current_worker != NULL && current_worker->pool == pool) {
+    struct worker_stats *stats = &current_worker->stats;
+    histogram_add(&stats->wait_hist, run_start - task->push_time_ns);
+    histogram_add(&stats->run_hist, run_end - run_start);
+    stat_add(&stats->task_count, 1);
+  } else {
+    pthread_mutex_lock(&pool->external_stats_mutex);
+    struct worker_stats *stats = &pool->external_stats;
+    histogram_add(&stats->wait_hist, run_start - task->push_time_ns);
+    histogram_add(&stats->run_hist, run_end - run_start);
+    stat_add(&stats->task_count, 1);
+    pthread_mutex_unlock(&pool->external_stats_mutex);
+  }
+  pthread_mutex_lock(&task->mutex);
+  task->result = result;
+  task->status_task = FINISHED;
+  pthread_cond_broadcast(&task->finished_condition);
+  pthread_mutex_unlock(&task->mutex);
+}
+
 int thread_task_new(struct thread_task **task, thread_task_f function,
                     void *arg) {
-  if (function == NULL || task == NULL) {
+  return thread_task_new_ex(task, function, arg, TPOOL_PRIORITY_NORMAL, 0);
+}
+
+int thread_task_new_ex(struct thread_task **task, thread_task_f function,
+                       void *arg, enum thread_task_priority priority,
+                       double deadline) {
+  if (function == NULL || task == NULL || (int)priority < 0 ||
+      priority >= TPOOL_PRIORITY_COUNT) {
     return TPOOL_ERR_INVALID_ARGUMENT;
   }
   struct thread_task *new_task = calloc(1, sizeof(struct thread_task));
@@ -238,24 +978,64 @@ int thread_task_new(struct thread_task **task, thread_task_f function,
   new_task->result = NULL;
   new_task->pool = NULL;
   new_task->next = NULL;
+  new_task->priority = priority;
+  new_task->deadline_ns = deadline > 0 ? (uint64_t)(deadline * 1e9) : 0;
+  new_task->worker_hint = -1;
+  new_task->node_hint = -1;
   pthread_mutex_init(&new_task->mutex, NULL);
   pthread_cond_init(&new_task->finished_condition, NULL);
   *task = new_task;
   return 0;
 }
 
+int thread_task_set_worker(struct thread_task *task, int worker) {
+  if (task == NULL) {
+    return TPOOL_ERR_INVALID_ARGUMENT;
+  }
+  pthread_mutex_lock(&task->mutex);
+  if (task->status_task == IN_QUEUED || task->status_task == RUNNING) {
+    pthread_mutex_unlock(&task->mutex);
+    return TPOOL_ERR_TASK_IN_POOL;
+  }
+  task->worker_hint = worker < 0 ? -1 : worker;
+  task->node_hint = -1;
+  pthread_mutex_unlock(&task->mutex);
+  return 0;
+}
+
+int thread_task_set_node(struct thread_task *task, int node) {
+  if (task == NULL) {
+    return TPOOL_ERR_INVALID_ARGUMENT;
+  }
+  pthread_mutex_lock(&task->mutex);
+  if (task->status_task == IN_QUEUED || task->status_task == RUNNING) {
+    pthread_mutex_unlock(&task->mutex);
+    return TPOOL_ERR_TASK_IN_POOL;
+  }
+  task->node_hint = node < 0 ? -1 : node;
+  task->worker_hint = -1;
+  pthread_mutex_unlock(&task->mutex);
+  return 0;
+}
+
 bool thread_task_is_finished(const struct thread_task *task) {
   if (task == NULL) {
     return false;
   }
-  return task->status_task == FINISHED;
+  pthread_mutex_lock((pthread_mutex_t *)&task->mutex);
+  bool is_finished = task->status_task == FINISHED;
+  pthread_mutex_unlock((pthread_mutex_t *)&task->mutex);
+  return is_finished;
 }
 
 bool thread_task_is_running(const struct thread_task *task) {
   if (task == NULL) {
     return false;
   }
-  return task->status_task == RUNNING;
+  pthread_mutex_lock((pthread_mutex_t *)&task->mutex);
+  bool is_running = task->status_task == RUNNING;
+  pthread_mutex_unlock((pthread_mutex_t *)&task->mutex);
+  return is_running;
 }
 
 int thread_task_join(struct thread_task *task, void **result) {
@@ -268,20 +1048,12 @@ int thread_task_join(struct thread_task *task, void **result) {
     return TPOOL_ERR_TASK_NOT_PUSHED;
   }
 
-  if (task->status_task == FINISHED) {
-    *result = task->result;
-    pthread_mutex_unlock(&task->mutex);
-    return 0;
-  }
-
   while (task->status_task != FINISHED) {
     pthread_cond_wait(&task->finished_condition, &task->mutex);
   }
+  task->is_joined = true;
+  *result = task->result;
   pthread_mutex_unlock(&task->mutex);
-
-  if (result != NULL) {
-    *result = task->result;
-  }
   return 0;
 }
 
@@ -292,17 +1064,14 @@ int thread_task_timed_join(struct thread_task *task, double timeout,
   if (task == NULL || result == NULL) {
     return TPOOL_ERR_INVALID_ARGUMENT;
   }
-
+  pthread_mutex_lock(&task->mutex);
   if (task->status_task == NEW || task->pool == NULL) {
+    pthread_mutex_unlock(&task->mutex);
     return TPOOL_ERR_TASK_NOT_PUSHED;
   }
 
-  if (task->status_task == FINISHED) {
-    *result = task->result;
-    return 0;
-  }
-
-  if (timeout <= 0) {
+  if (task->status_task != FINISHED && timeout <= 0) {
+    pthread_mutex_unlock(&task->mutex);
     return TPOOL_ERR_TIMEOUT;
   }
 
@@ -314,17 +1083,17 @@ int thread_task_timed_join(struct thread_task *task, double timeout,
     ts.tv_sec += ts.tv_nsec / 1e9;
     ts.tv_nsec %= 1000000000;
   }
-  pthread_mutex_lock(&task->mutex);
 
   int wait = 0;
   while (task->status_task != FINISHED && wait != ETIMEDOUT) {
     wait = pthread_cond_timedwait(&task->finished_condition, &task->mutex, &ts);
   }
 
-  if (wait == ETIMEDOUT) {
+  if (task->status_task != FINISHED) {
     pthread_mutex_unlock(&task->mutex);
     return TPOOL_ERR_TIMEOUT;
   }
+  task->is_joined = true;
   *result = task->result;
   pthread_mutex_unlock(&task->mutex);
   return 0;
@@ -339,13 +1108,17 @@ int thread_task_delete(struct thread_task *task) {
   pthread_mutex_lock(&task->mutex);
   enum status status = task->status_task;
   bool is_detached = task->detach;
-  if (status == IN_QUEUED || status == RUNNING) {
+  /* A finished task still belongs to the pool until it is joined. */
+  if (status == IN_QUEUED || status == RUNNING ||
+      (status == FINISHED && task->is_joined == false)) {
     pthread_mutex_unlock(&task->mutex);
     return TPOOL_ERR_TASK_IN_POOL;
   }
   if (is_detached == true && status == FINISHED) {
+    pthread_mutex_unlock(&task->mutex);
     return TPOOL_ERR_INVALID_ARGUMENT;
   }
+  pthread_mutex_unlock(&task->mutex);
   pthread_mutex_destroy(&task->mutex);
   pthread_cond_destroy(&task->finished_condition);
   free(task);
@@ -360,4 +1133,234 @@ int thread_task_detach(struct thread_task *task) {
   return TPOOL_ERR_NOT_IMPLEMENTED;
 }
 
-#endif
\ No newline at end of file
+#endif
+
+struct parallel_chunk;
+
+struct parallel_job {
+  struct thread_pool *pool;
+  size_t grain;
+  thread_range_f for_function;
+  thread_range_reduce_f reduce_function;
+  thread_reduce_join_f join;
+  void *arg;
+
+  pthread_mutex_t mutex;
+  /** Split-off chunks which no thread has started yet. */
+  struct parallel_chunk *pending;
+};
+
+struct parallel_chunk {
+  struct parallel_job *job;
+  size_t begin;
+  size_t end;
+  struct thread_task *task;
+
+  struct parallel_chunk *pending_next;
+  struct parallel_chunk *pending_prev;
+  bool is_pending;
+  /** Next chunk split off by the same owner, a more right one. */
+  struct parallel_chunk *next_child;
+};
+
+static void *parallel_run_range(struct parallel_job *job, size_t begin,
+                                size_t end);
+
+/**
+ * Whether a split-off chunk would be picked up right away. Checked on every
+ * grain, so the counters are read without the pool mutex. A stale answer
+ * only makes a split happen a bit earlier or later.
+ */
+static bool thread_pool_is_hungry(struct thread_pool *pool) {
+  int current_thread_count = count_load(&pool->current_thread_count);
+  return count_load(&pool->task_count) == 0 &&
+         (count_load(&pool->active_thread_count) < current_thread_count ||
+          current_thread_count < pool->max_thread_count);
+}
+
+static void parallel_unpend(struct parallel_chunk *chunk) {
+  struct parallel_job *job = chunk->job;
+  pthread_mutex_lock(&job->mutex);
+  if (chunk->is_pending) {
+    if (chunk->pending_prev == NULL) {
+      job->pending = chunk->pending_next;
+    } else {
+      chunk->pending_prev->pending_next = chunk->pending_next;
+    }
+    if (chunk->pending_next != NULL) {
+      chunk->pending_next->pending_prev = chunk->pending_prev;
+    }
+    chunk->is_pending = false;
+  }
+  pthread_mutex_unlock(&job->mutex);
+}
+
+static void *parallel_chunk_f(void *arg) {
+  struct parallel_chunk *chunk = (struct parallel_chunk *)arg;
+  parallel_unpend(chunk);
+  return parallel_run_range(chunk->job, chunk->begin, chunk->end);
+}
+
+static struct parallel_chunk *parallel_spawn(struct parallel_job *job,
+                                             size_t begin, size_t end) {
+  struct parallel_chunk *chunk = calloc(1, sizeof(*chunk));
+  if (chunk == NULL) {
+    return NULL;
+  }
+  if (thread_task_new(&chunk->task, parallel_chunk_f, chunk) != 0) {
+    free(chunk);
+    return NULL;
+  }
+  chunk->job = job;
+  chunk->begin = begin;
+  chunk->end = end;
+  pthread_mutex_lock(&job->mutex);
+  chunk->pending_next = job->pending;
+  if (job->pending != NULL) {
+    job->pending->pending_prev = chunk;
+  }
+  job->pending = chunk;
+  chunk->is_pending = true;
+  pthread_mutex_unlock(&job->mutex);
+  if (thread_pool_push_task(job->pool, chunk->task) != 0) {
+    parallel_unpend(chunk);
+    thread_task_delete(chunk->task);
+    free(chunk);
+    return NULL;
+  }
+  return chunk;
+}
+
+/**
+ * Take any pending chunk of the job which is still queued in the pool.
+ * A chunk in the pending list has not started yet, so its owner can't
+ * free it while the job mutex is held.
+ */
+static struct parallel_chunk *parallel_take_pending(struct parallel_job *job) {
+  pthread_mutex_lock(&job->mutex);
+  struct parallel_chunk *chunk = job->pending;
+  while (chunk != NULL && !thread_pool_take_task(chunk->task)) {
+    chunk = chunk->pending_next;
+  }
+  pthread_mutex_unlock(&job->mutex);
+  if (chunk != NULL) {
+    parallel_unpend(chunk);
+  }
+  return chunk;
+}
+
+/** Wait for a split-off chunk, doing queued work of the job meanwhile. */
+static void *parallel_wait(struct parallel_chunk *chunk) {
+  struct parallel_job *job = chunk->job;
+  if (thread_pool_take_task(chunk->task)) {
+    thread_task_run_here(chunk->task);
+  }
+  while (!thread_task_is_finished(chunk->task)) {
+    struct parallel_chunk *other = parallel_take_pending(job);
+    if (other == NULL) {
+      break;
+    }
+    thread_task_run_here(other->task);
+  }
+  void *result;
+  thread_task_join(chunk->task, &result);
+  thread_task_delete(chunk->task);
+  free(chunk);
+  return result;
+}
+
+static void *parallel_process(struct parallel_job *job, size_t begin,
+                              size_t end) {
+  if (job->for_function != NULL) {
+    job->for_function(begin, end, job->arg);
+    return NULL;
+  }
+  return job->reduce_function(begin, end, job->arg);
+}
+
+static void *parallel_join(struct parallel_job *job, void *left,
+                           void *right) {
+  if (job->join == NULL) {
+    return NULL;
+  }
+  return job->join(left, right, job->arg);
+}
+
+static void *parallel_run_range(struct parallel_job *job, size_t begin,
+                                size_t end) {
+  struct parallel_chunk *children = NULL;
+  void *result = NULL;
+  bool has_result = false;
+  while (end - begin > job->grain) {
+    if (thread_pool_is_hungry(job->pool)) {
+      size_t middle = begin + (end - begin) / 2;
+      struct parallel_chunk *child = parallel_spawn(job, middle, end);
+      if (child != NULL) {
+        child->next_child = children;
+        children = child;
+        end = middle;
+        continue;
+      }
+    }
+    void *part = parallel_process(job, begin, begin + job->grain);
+    result = has_result ? parallel_join(job, result, part) : part;
+    has_result = true;
+    begin += job->grain;
+  }
+  if (begin < end || !has_result) {
+    void *part = parallel_process(job, begin, end);
+    result = has_result ? parallel_join(job, result, part) : part;
+  }
+  /* The last split-off chunk is the closest one to the processed part. */
+  while (children != NULL) {
+    struct parallel_chunk *child = children;
+    children = child->next_child;
+    result = parallel_join(job, result, parallel_wait(child));
+  }
+  return result;
+}
+
+static int thread_pool_parallel_run(struct parallel_job *job, size_t begin,
+                                    size_t end, void **result) {
+  if (job->grain == 0) {
+    job->grain = 1;
+  }
+  pthread_mutex_init(&job->mutex, NULL);
+  void *res = parallel_run_range(job, begin, end);
+  pthread_mutex_destroy(&job->mutex);
+  if (result != NULL) {
+    *result = res;
+  }
+  return 0;
+}
+
+int thread_pool_parallel_for(struct thread_pool *pool, size_t begin,
+                             size_t end, size_t grain, thread_range_f function,
+                             void *arg) {
+  if (pool == NULL || function == NULL || begin > end) {
+    return TPOOL_ERR_INVALID_ARGUMENT;
+  }
+  if (begin == end) {
+    return 0;
+  }
+  struct parallel_job job = {
+      .pool = pool, .grain = grain, .for_function = function, .arg = arg};
+  return thread_pool_parallel_run(&job, begin, end, NULL);
+}
+
+int thread_pool_parallel_reduce(struct thread_pool *pool, size_t begin,
+                                size_t end, size_t grain,
+                                thread_range_reduce_f function,
+                                thread_reduce_join_f join, void *arg,
+                                void **result) {
+  if (pool == NULL || function == NULL || join == NULL || result == NULL ||
+      begin > end) {
+    return TPOOL_ERR_INVALID_ARGUMENT;
+  }
+  struct parallel_job job = {.pool = pool,
+                             .grain = grain,
+                             .reduce_function = function,
+                             .join = join,
+                             .arg = arg};
+  return thread_pool_parallel_run(&job, begin, end, result);
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 /**
@@ -24,11 +25,80 @@ struct thread_task;
 
 typedef void *(*thread_task_f)(void *);
 
+/** Function processing a range [begin, end) of a parallel loop. */
+typedef void (*thread_range_f)(size_t begin, size_t end, void *arg);
+
+/** Function reducing a range [begin, end) into a partial result. */
+typedef void *(*thread_range_reduce_f)(size_t begin, size_t end, void *arg);
+
+/** Function joining partial results of two adjacent ranges. */
+typedef void *(*thread_reduce_join_f)(void *left, void *right, void *arg);
+
 enum {
   TPOOL_MAX_THREADS = 20,
   TPOOL_MAX_TASKS = 1000,
 };
 
+/**
+ * Priority classes of tasks. A worker always picks a task of the
+ * highest non-empty class, so latency-sensitive work does not wait
+ * behind bulk batch work.
+ */
+enum thread_task_priority {
+  TPOOL_PRIORITY_HIGH,
+  TPOOL_PRIORITY_NORMAL,
+  TPOOL_PRIORITY_LOW,
+  TPOOL_PRIORITY_COUNT,
+};
+
+enum {
+  /**
+   * Histograms are log-linear like HDR ones: 8 linear sub-buckets per
+   * each power of 2 nanoseconds, which gives a 12.5% precision of any
+   * value.
+   */
+  TPOOL_HISTOGRAM_SUB_BITS = 3,
+  TPOOL_HISTOGRAM_SUB_BUCKETS = 1 << TPOOL_HISTOGRAM_SUB_BITS,
+  TPOOL_HISTOGRAM_BUCKETS = 64 * TPOOL_HISTOGRAM_SUB_BUCKETS,
+};
+
+/** Histogram of durations in nanoseconds. */
+struct thread_pool_histogram {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[TPOOL_HISTOGRAM_BUCKETS];
+};
+
+/** Live sizing counters of a pool. */
+struct thread_pool_counts {
+  /** Started threads, busy and idle. */
+  int thread_count;
+  /** Threads running a task now. */
+  int active_count;
+  /** Queued tasks not taken by any thread yet. */
+  int task_count;
+  /** Threads started and exited during the pool life. */
+  uint64_t started_total;
+  uint64_t exited_total;
+};
+
+/** Counters of a pool or of one of its workers. */
+struct thread_pool_stats {
+  /** Queued tasks not taken by any thread yet. */
+  int queue_depth;
+  /** Executed tasks. */
+  uint64_t task_count;
+  /** Tasks taken from queues of other workers. */
+  uint64_t steal_count;
+  /** Time spent sleeping without tasks. */
+  uint64_t park_ns;
+  /** Time from push to start of the tasks. */
+  struct thread_pool_histogram wait_hist;
+  /** Time from start to finish of the tasks. */
+  struct thread_pool_histogram run_hist;
+};
+
 enum thread_poool_errcode {
   TPOOL_ERR_INVALID_ARGUMENT = 1,
   TPOOL_ERR_TOO_MANY_TASKS,
@@ -80,9 +150,195 @@ int thread_pool_delete(struct thread_pool *pool);
  * @retval != Error code.
  *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
  *       already.
+ *     - -1 - the pool has no threads and none could be started.
  */
 int thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 
+/**
+ * Let a thread exit after it has had no tasks for @a timeout seconds,
+ * while the pool has more than the minimal number of threads. It is
+ * started again when the load comes back. Disabled by default.
+ * @param pool Thread pool.
+ * @param timeout Idle timeout in seconds. 0 or less disables reaping.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no pool.
+ */
+int thread_pool_set_idle_timeout(struct thread_pool *pool, double timeout);
+
+/**
+ * Set how many threads are kept warm. They are started right away and
+ * never reaped by the idle timeout.
+ * @param pool Thread pool.
+ * @param min_thread_count Minimal thread count, up to the max one.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the count is negative or too big.
+ */
+int thread_pool_set_min_threads(struct thread_pool *pool, int min_thread_count);
+
+/**
+ * Configure when a new thread is started. By default it is when a
+ * pushed task would find no idle thread.
+ * @param pool Thread pool.
+ * @param queue_depth A push starts a thread when the number of queued
+ *   tasks exceeds the number of idle threads by at least this much.
+ * @param max_wait A thread starts one more thread when it takes a task
+ *   which has been queued longer than this many seconds and there are
+ *   more queued tasks than idle threads. 0 or less disables that.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - queue_depth is less than 1.
+ */
+int thread_pool_set_growth(struct thread_pool *pool, int queue_depth,
+                           double max_wait);
+
+/**
+ * Get live sizing counters of the pool.
+ * @param pool Thread pool.
+ * @param[out] counts Pointer to store the counters.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no pool or no output.
+ */
+int thread_pool_get_counts(const struct thread_pool *pool,
+                           struct thread_pool_counts *counts);
+
+/**
+ * Get counters of the whole pool. Each worker keeps own counters which
+ * only it updates, and they are summed up here, so the counting is
+ * cheap enough to be always on. Tasks run by non-worker threads, like
+ * a caller of thread_pool_parallel_for(), are counted too.
+ * @param pool Thread pool.
+ * @param[out] stats Pointer to store the counters.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no pool or no output.
+ */
+int thread_pool_get_stats(const struct thread_pool *pool,
+                          struct thread_pool_stats *stats);
+
+/**
+ * Like thread_pool_get_stats() but for one worker. The queue depth is
+ * the number of tasks placed on this worker.
+ * @param pool Thread pool.
+ * @param worker Worker index.
+ * @param[out] stats Pointer to store the counters.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - bad worker index or no output.
+ */
+int thread_pool_get_worker_stats(const struct thread_pool *pool, int worker,
+                                 struct thread_pool_stats *stats);
+
+/**
+ * Pin a worker of the pool to a set of CPUs. The worker keeps the
+ * pinning after it is started, and it is applied right away when the
+ * worker already runs. The NUMA node of the first CPU becomes the node
+ * of the worker, which is used for task placement and stealing.
+ * @param pool Thread pool.
+ * @param worker Worker index in range [0, max_thread_count).
+ * @param cpus Array of CPU numbers.
+ * @param cpu_count Size of @a cpus. 0 drops the pinning.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - bad worker index or CPU number.
+ */
+int thread_pool_set_worker_cpus(struct thread_pool *pool, int worker,
+                                const int *cpus, int cpu_count);
+
+/**
+ * Get the NUMA node of a worker.
+ * @param pool Thread pool.
+ * @param worker Worker index.
+ *
+ * @retval >= 0 Node number.
+ * @retval -1 The worker is not pinned or the node is unknown.
+ */
+int thread_pool_worker_node(const struct thread_pool *pool, int worker);
+
+/**
+ * Get a histogram of how long tasks of the given priority class
+ * waited in the queue before a worker or a joining thread took them.
+ * @param pool Thread pool to get the histogram of.
+ * @param priority Priority class.
+ * @param[out] hist Pointer to store the histogram copy.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - unknown priority class.
+ */
+int thread_pool_wait_histogram(const struct thread_pool *pool,
+                               enum thread_task_priority priority,
+                               struct thread_pool_histogram *hist);
+
+/**
+ * Estimate a percentile of values stored in a histogram.
+ * @param hist Histogram.
+ * @param percentile Percentile in range [0, 100].
+ *
+ * @retval Upper bound of the bucket containing the percentile, in
+ *   nanoseconds. 0 if the histogram is empty.
+ */
+uint64_t
+thread_pool_histogram_percentile(const struct thread_pool_histogram *hist,
+                                 double percentile);
+
+/**
+ * Run @a function on all of [begin, end) split into chunks and wait
+ * until it is done. The calling thread processes the range itself and
+ * splits off halves of the remainder into tasks only while the pool
+ * has idle workers (lazy binary splitting). When done it pulls back the
+ * split-off chunks which no worker has taken yet, so it does not sleep
+ * while there is work left.
+ * @param pool Thread pool to run in.
+ * @param begin Range start.
+ * @param end Range end, not included.
+ * @param grain Minimal number of items processed by one call of
+ *   @a function. 0 means 1.
+ * @param function Function to process a chunk of the range.
+ * @param arg Argument for @a function.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - begin > end or no function.
+ */
+int thread_pool_parallel_for(struct thread_pool *pool, size_t begin,
+                             size_t end, size_t grain, thread_range_f function,
+                             void *arg);
+
+/**
+ * Like thread_pool_parallel_for() but each chunk returns a partial
+ * result, and the partial results of adjacent chunks are joined left to
+ * right, so @a join only has to be associative. For an empty range
+ * @a function is called once with begin == end to produce the result.
+ * @param pool Thread pool to run in.
+ * @param begin Range start.
+ * @param end Range end, not included.
+ * @param grain Minimal number of items processed by one call of
+ *   @a function. 0 means 1.
+ * @param function Function to reduce a chunk of the range.
+ * @param join Function to join two partial results.
+ * @param arg Argument for @a function and @a join.
+ * @param[out] result Pointer to store the final result.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - begin > end or no function.
+ */
+int thread_pool_parallel_reduce(struct thread_pool *pool, size_t begin,
+                                size_t end, size_t grain,
+                                thread_range_reduce_f function,
+                                thread_reduce_join_f join, void *arg,
+                                void **result);
+
 /** Thread pool task API. */
 
 /**
@@ -96,6 +352,53 @@ int thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 int thread_task_new(struct thread_task **task, thread_task_f function,
                     void *arg);
 
+/**
+ * Like thread_task_new() but with a scheduling class and a deadline.
+ * Tasks of a higher priority class are always picked up first. Within
+ * a class the tasks having a deadline are picked up in the earliest
+ * deadline first order before the tasks without a deadline, which are
+ * picked up in FIFO order.
+ * @param[out] task Pointer to store result task object.
+ * @param function Function to run by this task.
+ * @param arg Argument for @a function.
+ * @param priority Priority class of the task.
+ * @param deadline Deadline in seconds counted from each push of the
+ *   task. 0 or less means no deadline.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - unknown priority class.
+ */
+int thread_task_new_ex(struct thread_task **task, thread_task_f function,
+                       void *arg, enum thread_task_priority priority,
+                       double deadline);
+
+/**
+ * Ask the pool to run @a task on the given worker. The task is put
+ * into the worker's own queue. When that worker is busy, idle workers
+ * steal from it, first the ones on the same NUMA node. The hint is
+ * kept across re-pushes.
+ * @param task Task to place.
+ * @param worker Worker index, or -1 to drop the hint.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is in a pool now.
+ */
+int thread_task_set_worker(struct thread_task *task, int worker);
+
+/**
+ * Like thread_task_set_worker() but let the pool choose the least
+ * loaded worker on the given NUMA node.
+ * @param task Task to place.
+ * @param node Node number, or -1 to drop the hint.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is in a pool now.
+ */
+int thread_task_set_node(struct thread_task *task, int node);
+
 /**
  * Check if @a task is finished and its result can be obtained.
  * @param task Task to check.
@@ -0,0 +1,148 @@
+/*
+ * Backend benchmark: broadcast throughput of the chat server with the epoll
+ * and the io_uring backends. The server runs in its own thread, the main
+ * thread drives the clients. Every client sends -m lines, every line is
+ * delivered to all the other clients. The result is delivered lines per
+ * second.
+ *
+ * Usage: ./backend_bench [-c clients] [-m msgs_per_client] [-s size]
+ *     [-b epoll|io_uring]
+ * Without -b both backends are measured one after another.
+ */
+#include "../chat.h"
+#include "../chat_client.h"
+#include "../chat_server.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct server_ctx {
+  struct chat_server *server;
+  bool is_stopped;
+};
+
+static void *server_f(void *arg) {
+  struct server_ctx *ctx = arg;
+  while (!__atomic_load_n(&ctx->is_stopped, __ATOMIC_ACQUIRE))
+    chat_server_update(ctx->server, 0.05);
+  return NULL;
+}
+
+static int run(enum chat_server_backend backend, const char *name,
+               int client_count, int msg_count, int msg_size) {
+  struct server_ctx ctx = {chat_server_new(), false};
+  if (chat_server_set_backend(ctx.server, backend) != 0 ||
+      chat_server_listen(ctx.server, 0) != 0) {
+    printf("%-9s unavailable\n", name);
+    chat_server_delete(ctx.server);
+    return -1;
+  }
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  getsockname(chat_server_get_socket(ctx.server), (struct sockaddr *)&addr,
+              &len);
+  char addr_str[32];
+  snprintf(addr_str, sizeof(addr_str), "localhost:%u",
+           ntohs(((struct sockaddr_in *)&addr)->sin_port));
+  pthread_t thread;
+  pthread_create(&thread, NULL, server_f, &ctx);
+
+  struct chat_client **clients = calloc(client_count, sizeof(*clients));
+  for (int i = 0; i < client_count; ++i) {
+    clients[i] = chat_client_new("bench");
+    if (chat_client_connect(clients[i], addr_str) != 0) {
+      printf("connect failed\n");
+      exit(1);
+    }
+  }
+  /* Make sure every client is registered before anything is broadcast. */
+  usleep(200 * 1000);
+
+  char *line = malloc(msg_size + 1);
+  memset(line, 'x', msg_size - 1);
+  line[msg_size - 1] = '\n';
+  long expected = (long)client_count * (client_count - 1) * msg_count;
+  long received = 0;
+  double start = now_sec();
+  for (int m = 0; m < msg_count; ++m) {
+    for (int i = 0; i < client_count; ++i)
+      chat_client_feed(clients[i], line, msg_size);
+    for (int i = 0; i < client_count; ++i)
+      chat_client_update(clients[i], 0);
+  }
+  while (received < expected) {
+    for (int i = 0; i < client_count; ++i) {
+      chat_client_update(clients[i], 0.001);
+      struct chat_message *msg;
+      while ((msg = chat_client_pop_next(clients[i])) != NULL) {
+        chat_message_delete(msg);
+        ++received;
+      }
+    }
+    if (now_sec() - start > 60) {
+      printf("%-9s timed out at %ld/%ld\n", name, received, expected);
+      break;
+    }
+  }
+  double elapsed = now_sec() - start;
+  printf("%-9s %d clients x %d msgs: %.3f s, %.0f deliveries/s\n", name,
+         client_count, msg_count, elapsed, received / elapsed);
+
+  __atomic_store_n(&ctx.is_stopped, true, __ATOMIC_RELEASE);
+  pthread_join(thread, NULL);
+  for (int i = 0; i < client_count; ++i)
+    chat_client_delete(clients[i]);
+  free(clients);
+  free(line);
+  chat_server_delete(ctx.server);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int client_count = 16;
+  int msg_count = 2000;
+  int msg_size = 64;
+  const char *backend = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:m:s:b:")) != -1) {
+    switch (opt) {
+    case 'c':
+      client_count = atoi(optarg);
+      break;
+    case 'm':
+      msg_count = atoi(optarg);
+      break;
+    case 's':
+      msg_size = atoi(optarg);
+      break;
+    case 'b':
+      backend = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-c clients] [-m msgs] [-s size] "
+              "[-b epoll|io_uring]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (client_count < 2 || msg_count < 1 || msg_size < 2) {
+    fprintf(stderr, "need at least 2 clients, 1 message of 2 bytes\n");
+    return 1;
+  }
+  if (backend == NULL || strcmp(backend, "epoll") == 0)
+    run(CHAT_SERVER_BACKEND_EPOLL, "epoll", client_count, msg_count,
+        msg_size);
+  if (backend == NULL || strcmp(backend, "io_uring") == 0)
+    run(CHAT_SERVER_BACKEND_IO_URING, "io_uring", client_count, msg_count,
+        msg_size);
+  return 0;
+}
@@ -0,0 +1,333 @@
+/*
+ * Load and latency benchmark: clients connected over loopback send lines at
+ * a fixed total rate, round-robin, and each line carries the time it was due
+ * to be sent. Every other client takes the time the line reaches it, so the
+ * result is the end-to-end fan-out latency through the server, p50/p99/p999,
+ * along with the achieved throughput. The due times follow the schedule, not
+ * the actual sends, so a stall of the server shows up in the latency instead
+ * of just slowing the load down.
+ *
+ * The server runs in a thread of the benchmark, or it is an external one like
+ * ./server given with -a. All the clients are driven by the main thread.
+ *
+ * Usage: ./load_bench [-c clients] [-r msgs_per_sec] [-d seconds] [-s size]
+ *     [-p text|binary] [-b epoll|io_uring] [-t threads] [-a host:port]
+ */
+/* For ppoll(). */
+#define _GNU_SOURCE
+
+#include "../chat.h"
+#include "../chat_client.h"
+#include "../chat_server.h"
+
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+  /* Digits of the due time at the start of a line. */
+  TIME_LEN = 20,
+};
+
+/*
+ * chat_client_update() with 0 still waits a bit for the data to come, a
+ * timeout under a millisecond is rounded down to no waiting at all.
+ */
+static const double NO_WAIT = 1e-6;
+
+static void out_of_memory(void) {
+  fprintf(stderr, "out of memory\n");
+  exit(1);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct server_ctx {
+  struct chat_server *server;
+  bool is_stopped;
+};
+
+/** Serve and throw the popped messages away, so they don't pile up. */
+static void *server_f(void *arg) {
+  struct server_ctx *ctx = arg;
+  struct chat_message *msgs[64];
+  while (!__atomic_load_n(&ctx->is_stopped, __ATOMIC_ACQUIRE)) {
+    chat_server_update(ctx->server, 0.05);
+    size_t count;
+    while ((count = chat_server_pop_batch(ctx->server, msgs, 64)) > 0) {
+      for (size_t i = 0; i < count; ++i) {
+        chat_message_delete(msgs[i]);
+      }
+    }
+  }
+  return NULL;
+}
+
+/** Latencies of all the deliveries in nanoseconds. */
+struct samples {
+  uint64_t *data;
+  size_t count;
+  size_t capacity;
+};
+
+static void samples_add(struct samples *s, uint64_t value) {
+  if (s->count == s->capacity) {
+    s->capacity = s->capacity == 0 ? 1024 : s->capacity * 2;
+    s->data = realloc(s->data, s->capacity * sizeof(*s->data));
+    if (s->data == NULL) {
+      out_of_memory();
+    }
+  }
+  s->data[s->count++] = value;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t va = *(const uint64_t *)a;
+  uint64_t vb = *(const uint64_t *)b;
+  return va < vb ? -1 : va > vb;
+}
+
+/** Value below which @a p of the sorted samples are, in microseconds. */
+static double percentile_us(const struct samples *s, double p) {
+  size_t i = (size_t)(p * s->count);
+  if (i >= s->count) {
+    i = s->count - 1;
+  }
+  return s->data[i] / 1e3;
+}
+
+/** Pop everything the client has got and take its latency. */
+static void receive(struct chat_client *c, struct samples *s) {
+  chat_client_update(c, NO_WAIT);
+  struct chat_message *msg;
+  uint64_t now = now_ns();
+  while ((msg = chat_client_pop_next(c)) != NULL) {
+    uint64_t due = strtoull(msg->data, NULL, 10);
+    samples_add(s, now > due ? now - due : 0);
+    chat_message_delete(msg);
+  }
+}
+
+struct options {
+  int client_count;
+  double rate;
+  double duration;
+  int msg_size;
+  enum chat_protocol protocol;
+  const char *backend;
+  int threads;
+  const char *addr;
+};
+
+static int run(const struct options *opts) {
+  struct server_ctx ctx = {NULL, false};
+  pthread_t thread;
+  char addr_str[64];
+  const char *addr = opts->addr;
+  if (addr == NULL) {
+    ctx.server = chat_server_new();
+    if (ctx.server == NULL) {
+      out_of_memory();
+    }
+    enum chat_server_backend backend = CHAT_SERVER_BACKEND_EPOLL;
+    if (opts->backend != NULL && strcmp(opts->backend, "io_uring") == 0) {
+      backend = CHAT_SERVER_BACKEND_IO_URING;
+    }
+    if (chat_server_set_backend(ctx.server, backend) != 0 ||
+        chat_server_set_shard_count(ctx.server, opts->threads) != 0 ||
+        chat_server_listen(ctx.server, 0) != 0) {
+      printf("server unavailable\n");
+      chat_server_delete(ctx.server);
+      return -1;
+    }
+    struct sockaddr_storage sa;
+    socklen_t len = sizeof(sa);
+    getsockname(chat_server_get_socket(ctx.server), (struct sockaddr *)&sa,
+                &len);
+    snprintf(addr_str, sizeof(addr_str), "localhost:%u",
+             ntohs(((struct sockaddr_in *)&sa)->sin_port));
+    addr = addr_str;
+    if (pthread_create(&thread, NULL, server_f, &ctx) != 0) {
+      printf("server thread failed\n");
+      chat_server_delete(ctx.server);
+      return -1;
+    }
+  }
+
+  int client_count = opts->client_count;
+  struct chat_client **clients = calloc(client_count, sizeof(*clients));
+  struct pollfd *pfds = calloc(client_count, sizeof(*pfds));
+  if (clients == NULL || pfds == NULL) {
+    out_of_memory();
+  }
+  for (int i = 0; i < client_count; ++i) {
+    clients[i] = chat_client_new("bench");
+    if (clients[i] == NULL) {
+      out_of_memory();
+    }
+    chat_client_set_protocol(clients[i], opts->protocol);
+    if (chat_client_connect(clients[i], addr) != 0) {
+      printf("connect failed\n");
+      exit(1);
+    }
+  }
+  /* Make sure every client is registered before anything is broadcast. */
+  usleep(200 * 1000);
+
+  char *line = malloc(opts->msg_size);
+  if (line == NULL) {
+    out_of_memory();
+  }
+  memset(line, 'x', opts->msg_size - 1);
+  line[opts->msg_size - 1] = '\n';
+  uint64_t total = (uint64_t)(opts->rate * opts->duration);
+  uint64_t expected = total * (client_count - 1);
+  double interval_ns = 1e9 / opts->rate;
+  struct samples samples = {NULL, 0, 0};
+  uint64_t sent = 0;
+  uint64_t start = now_ns();
+  uint64_t last_sent = start;
+  /* Deliveries still missing a while after the last send are lost. */
+  uint64_t deadline = start + (uint64_t)(opts->duration * 1e9) + 5000000000;
+  while (samples.count < expected) {
+    uint64_t now = now_ns();
+    if (now > deadline) {
+      break;
+    }
+    while (sent < total) {
+      uint64_t due = start + (uint64_t)(sent * interval_ns);
+      if (due > now) {
+        break;
+      }
+      struct chat_client *c = clients[sent % client_count];
+      char stamp[TIME_LEN + 1];
+      snprintf(stamp, sizeof(stamp), "%0*" PRIu64, TIME_LEN, due);
+      memcpy(line, stamp, TIME_LEN);
+      chat_client_feed(c, line, opts->msg_size);
+      chat_client_update(c, NO_WAIT);
+      ++sent;
+      last_sent = now_ns();
+    }
+    for (int i = 0; i < client_count; ++i) {
+      pfds[i].fd = chat_client_get_descriptor(clients[i]);
+      pfds[i].events =
+          chat_events_to_poll_events(chat_client_get_events(clients[i]));
+      pfds[i].revents = 0;
+    }
+    /* Wait for the deliveries until the next line is due. */
+    uint64_t wait_ns = 100000000;
+    if (sent < total) {
+      uint64_t due = start + (uint64_t)(sent * interval_ns);
+      now = now_ns();
+      wait_ns = due > now ? due - now : 0;
+    }
+    struct timespec ts = {wait_ns / 1000000000, wait_ns % 1000000000};
+    if (ppoll(pfds, client_count, &ts, NULL) <= 0) {
+      continue;
+    }
+    for (int i = 0; i < client_count; ++i) {
+      if (pfds[i].revents != 0) {
+        receive(clients[i], &samples);
+      }
+    }
+  }
+  double send_sec = (last_sent - start) / 1e9;
+  double total_sec = (now_ns() - start) / 1e9;
+
+  const char *name = opts->addr;
+  if (name == NULL) {
+    name = opts->backend != NULL ? opts->backend : "epoll";
+  }
+  printf("%s: %d clients, %.0f msgs/s of %d bytes for %.1f s\n", name,
+         client_count, opts->rate, opts->msg_size, opts->duration);
+  printf("sent %" PRIu64 " msgs, %.0f msgs/s\n", sent,
+         send_sec > 0 ? sent / send_sec : 0);
+  printf("delivered %zu/%" PRIu64 ", %.0f deliveries/s\n", samples.count,
+         expected, samples.count / total_sec);
+  if (samples.count > 0) {
+    qsort(samples.data, samples.count, sizeof(*samples.data), compare_u64);
+    printf("latency us: p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+           percentile_us(&samples, 0.5), percentile_us(&samples, 0.99),
+           percentile_us(&samples, 0.999),
+           samples.data[samples.count - 1] / 1e3);
+  }
+
+  if (ctx.server != NULL) {
+    __atomic_store_n(&ctx.is_stopped, true, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+  }
+  for (int i = 0; i < client_count; ++i) {
+    chat_client_delete(clients[i]);
+  }
+  free(clients);
+  free(pfds);
+  free(line);
+  free(samples.data);
+  chat_server_delete(ctx.server);
+  return samples.count == expected ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+  struct options opts = {
+      .client_count = 16,
+      .rate = 10000,
+      .duration = 5,
+      .msg_size = 64,
+      .protocol = CHAT_PROTOCOL_TEXT,
+      .backend = NULL,
+      .threads = 1,
+      .addr = NULL,
+  };
+  int opt;
+  while ((opt = getopt(argc, argv, "c:r:d:s:p:b:t:a:")) != -1) {
+    switch (opt) {
+    case 'c':
+      opts.client_count = atoi(optarg);
+      break;
+    case 'r':
+      opts.rate = atof(optarg);
+      break;
+    case 'd':
+      opts.duration = atof(optarg);
+      break;
+    case 's':
+      opts.msg_size = atoi(optarg);
+      break;
+    case 'p':
+      if (strcmp(optarg, "binary") == 0) {
+        opts.protocol = CHAT_PROTOCOL_BINARY;
+      }
+      break;
+    case 'b':
+      opts.backend = optarg;
+      break;
+    case 't':
+      opts.threads = atoi(optarg);
+      break;
+    case 'a':
+      opts.addr = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-c clients] [-r msgs_per_sec] [-d seconds] "
+              "[-s size] [-p text|binary] [-b epoll|io_uring] [-t threads] "
+              "[-a host:port]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (opts.client_count < 2 || opts.rate <= 0 || opts.duration <= 0 ||
+      opts.msg_size < TIME_LEN + 2 || opts.threads < 1) {
+    fprintf(stderr, "need at least 2 clients, a positive rate and duration, "
+            "1 thread and %d bytes per message\n", TIME_LEN + 2);
+    return 1;
+  }
+  return run(&opts) == 0 ? 0 : 1;
+}
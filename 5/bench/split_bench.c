@@ -0,0 +1,150 @@
+/*
+ * Line splitting benchmark: a large pipelined input is fed into a ring in
+ * chunks like the server receives it, and all the complete lines are taken
+ * out after every chunk. Compares the former way - a search per line, a copy
+ * of the raw line, trimming with memmove() and strlen() - with the batched
+ * vectorized split which trims by offsets and copies each line once.
+ *
+ * Usage: ./split_bench [-s input_mb] [-l avg_line_len] [-c chunk_size]
+ */
+#include "../chat_ring.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Random lines of 1..2*avg bytes, some with spaces around them. */
+static char *make_input(size_t size, int avg_len) {
+  char *data = malloc(size);
+  size_t pos = 0;
+  srand(1);
+  while (pos < size) {
+    size_t len = 1 + rand() % (2 * avg_len);
+    if (len > size - pos)
+      len = size - pos;
+    for (size_t i = 0; i < len; ++i)
+      data[pos + i] = 'a' + (pos + i) % 26;
+    if (len > 4 && rand() % 4 == 0) {
+      data[pos] = ' ';
+      data[pos + len - 2] = '\t';
+    }
+    data[pos + len - 1] = '\n';
+    pos += len;
+  }
+  return data;
+}
+
+static void trim(char *str) {
+  char *start = str;
+  while (isspace(*start))
+    start++;
+  if (start != str)
+    memmove(str, start, strlen(start) + 1);
+  char *end = str + strlen(str) - 1;
+  while (end >= str && isspace(*end))
+    end--;
+  *(end + 1) = '\0';
+}
+
+static size_t extract_by_find(struct chat_ring *ring, size_t *scanned) {
+  size_t lines = 0;
+  ptrdiff_t pos;
+  while ((pos = chat_ring_find(ring, *scanned, '\n')) >= 0) {
+    char *msg = malloc(pos + 1);
+    chat_ring_peek(ring, msg, pos);
+    msg[pos] = '\0';
+    chat_ring_consume(ring, pos + 1);
+    *scanned = 0;
+    trim(msg);
+    lines += strlen(msg) > 0;
+    free(msg);
+  }
+  *scanned = chat_ring_size(ring);
+  return lines;
+}
+
+static size_t extract_by_split(struct chat_ring *ring, size_t *scanned) {
+  struct chat_span spans[CHAT_RING_SPLIT_BATCH];
+  size_t lines = 0;
+  size_t count;
+  do {
+    size_t end;
+    count = chat_ring_split_lines(ring, *scanned, spans,
+                                  CHAT_RING_SPLIT_BATCH, &end);
+    for (size_t i = 0; i < count; ++i) {
+      if (spans[i].size == 0)
+        continue;
+      char *msg = malloc(spans[i].size + 1);
+      chat_ring_copy(ring, spans[i].start, msg, spans[i].size);
+      msg[spans[i].size] = '\0';
+      ++lines;
+      free(msg);
+    }
+    chat_ring_consume(ring, end);
+    *scanned = 0;
+  } while (count == CHAT_RING_SPLIT_BATCH);
+  *scanned = chat_ring_size(ring);
+  return lines;
+}
+
+static void run(const char *name,
+                size_t (*extract)(struct chat_ring *, size_t *),
+                const char *input, size_t size, size_t chunk) {
+  struct chat_ring ring;
+  chat_ring_create(&ring);
+  size_t scanned = 0;
+  size_t lines = 0;
+  double start = now_sec();
+  for (size_t pos = 0; pos < size; pos += chunk) {
+    size_t len = chunk < size - pos ? chunk : size - pos;
+    chat_ring_append(&ring, input + pos, len);
+    lines += extract(&ring, &scanned);
+  }
+  double elapsed = now_sec() - start;
+  printf("%-6s %zu lines: %.3f s, %.0f MB/s, %.1f M lines/s\n", name, lines,
+         elapsed, size / elapsed / (1 << 20), lines / elapsed / 1e6);
+  chat_ring_destroy(&ring);
+}
+
+int main(int argc, char **argv) {
+  size_t size_mb = 256;
+  int avg_len = 64;
+  size_t chunk = 64 * 1024;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:l:c:")) != -1) {
+    switch (opt) {
+    case 's':
+      size_mb = atoi(optarg);
+      break;
+    case 'l':
+      avg_len = atoi(optarg);
+      break;
+    case 'c':
+      chunk = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-s input_mb] [-l avg_line_len] "
+              "[-c chunk_size]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (size_mb < 1 || avg_len < 1 || chunk < 1) {
+    fprintf(stderr, "all the sizes must be positive\n");
+    return 1;
+  }
+  size_t size = size_mb << 20;
+  char *input = make_input(size, avg_len);
+  run("find", extract_by_find, input, size, chunk);
+  run("split", extract_by_split, input, size, chunk);
+  free(input);
+  return 0;
+}
@@ -2,6 +2,17 @@
 
 #include <poll.h>
 #include <stdlib.h>
+#include <string.h>
+
+struct chat_message *chat_message_new(char *data, size_t size) {
+  struct chat_message *msg = calloc(1, sizeof(*msg));
+  if (msg == NULL) {
+    return NULL;
+  }
+  msg->data = data;
+  msg->size = size;
+  return msg;
+}
 
 void chat_message_delete(struct chat_message *msg) {
   if (msg) {
@@ -13,6 +24,32 @@ void chat_message_delete(struct chat_message *msg) {
   }
 }
 
+size_t chat_varint_encode(uint64_t value, char *out) {
+  size_t size = 0;
+  while (value >= 0x80) {
+    out[size++] = (char)(value | 0x80);
+    value >>= 7;
+  }
+  out[size++] = (char)value;
+  return size;
+}
+
+int chat_varint_decode(const char *data, size_t size, uint64_t *value) {
+  uint64_t result = 0;
+  for (size_t i = 0; i < CHAT_VARINT_MAX; ++i) {
+    if (i == size) {
+      return 0;
+    }
+    uint8_t byte = (uint8_t)data[i];
+    result |= (uint64_t)(byte & 0x7f) << (7 * i);
+    if ((byte & 0x80) == 0) {
+      *value = result;
+      return (int)i + 1;
+    }
+  }
+  return -1;
+}
+
 int chat_events_to_poll_events(int mask) {
   int res = 0;
   if ((mask & CHAT_EVENT_INPUT) != 0)
@@ -21,3 +58,80 @@ int chat_events_to_poll_events(int mask) {
     res |= POLLOUT;
   return res;
 }
+
+void chat_msg_queue_create(struct chat_msg_queue *queue) {
+  queue->items = NULL;
+  queue->head = 0;
+  queue->count = 0;
+  queue->capacity = 0;
+}
+
+void chat_msg_queue_destroy(struct chat_msg_queue *queue) {
+  struct chat_message *msg;
+  while ((msg = chat_msg_queue_pop(queue)) != NULL) {
+    chat_message_delete(msg);
+  }
+  free(queue->items);
+  chat_msg_queue_create(queue);
+}
+
+bool chat_msg_queue_push(struct chat_msg_queue *queue,
+                         struct chat_message *msg) {
+  if (queue->count == queue->capacity) {
+    size_t new_capacity = queue->capacity == 0 ? 8 : queue->capacity * 2;
+    if (new_capacity < queue->capacity) {
+      return false;
+    }
+    struct chat_message **new_items =
+        malloc(new_capacity * sizeof(*new_items));
+    if (new_items == NULL) {
+      return false;
+    }
+    /* Unwrap into the new array, so the oldest message is at 0 again. */
+    size_t first = queue->capacity - queue->head;
+    if (first > queue->count) {
+      first = queue->count;
+    }
+    if (queue->count > 0) {
+      memcpy(new_items, queue->items + queue->head, first * sizeof(*new_items));
+      memcpy(new_items + first, queue->items,
+             (queue->count - first) * sizeof(*new_items));
+    }
+    free(queue->items);
+    queue->items = new_items;
+    queue->head = 0;
+    queue->capacity = new_capacity;
+  }
+  queue->items[(queue->head + queue->count) & (queue->capacity - 1)] = msg;
+  queue->count++;
+  return true;
+}
+
+struct chat_message *chat_msg_queue_pop(struct chat_msg_queue *queue) {
+  if (queue->count == 0) {
+    return NULL;
+  }
+  struct chat_message *msg = queue->items[queue->head];
+  queue->head = (queue->head + 1) & (queue->capacity - 1);
+  queue->count--;
+  return msg;
+}
+
+size_t chat_msg_queue_pop_batch(struct chat_msg_queue *queue,
+                                struct chat_message **msgs, size_t count) {
+  if (count > queue->count) {
+    count = queue->count;
+  }
+  /* At most two contiguous spans: up to the array's end and from its start. */
+  size_t first = queue->capacity - queue->head;
+  if (first > count) {
+    first = count;
+  }
+  if (count > 0) {
+    memcpy(msgs, queue->items + queue->head, first * sizeof(*msgs));
+    memcpy(msgs + first, queue->items, (count - first) * sizeof(*msgs));
+    queue->head = (queue->head + count) & (queue->capacity - 1);
+    queue->count -= count;
+  }
+  return count;
+}
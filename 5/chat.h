@@ -1,6 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 /**
  * Here you should specify which features do you want to implement via macros:
@@ -16,7 +18,7 @@
  * used by tests.
  */
 #define NEED_AUTHOR 0
-#define NEED_SERVER_FEED 0
+#define NEED_SERVER_FEED 1
 
 enum chat_errcode {
   CHAT_ERR_INVALID_ARGUMENT = 1,
@@ -34,6 +36,46 @@ enum chat_events {
   CHAT_EVENT_OUTPUT = 2,
 };
 
+/**
+ * Wire protocols. Text is lines ending with '\n'. Binary is frames of a varint
+ * payload length followed by the payload. A client asks for binary by starting
+ * the connection with CHAT_BINARY_HELLO, and the server answers the same right
+ * where its output switches from text lines to frames. No text line starts
+ * with 0, so the hello can't be mistaken for one. The server drops frames
+ * which are not a valid text line, with a '\n' or starting with 0.
+ */
+enum chat_protocol {
+  CHAT_PROTOCOL_TEXT,
+  CHAT_PROTOCOL_BINARY,
+};
+
+#define CHAT_BINARY_HELLO "\0CB1"
+
+enum {
+  CHAT_BINARY_HELLO_SIZE = 4,
+  /* Longest varint, enough for any 64 bit value. */
+  CHAT_VARINT_MAX = 10,
+  /* Bigger frames are a protocol error. */
+  CHAT_FRAME_MAX = 1 << 30,
+};
+
+/**
+ * Encode @a value as a LEB128 varint into @a out, which must have at least
+ * CHAT_VARINT_MAX bytes.
+ *
+ * @return Number of bytes written.
+ */
+size_t chat_varint_encode(uint64_t value, char *out);
+
+/**
+ * Decode a varint from the first @a size bytes of @a data.
+ *
+ * @retval >0 Number of bytes the varint took, the value is in @a value.
+ * @retval 0 Incomplete, more bytes are needed.
+ * @retval -1 Not a valid varint.
+ */
+int chat_varint_decode(const char *data, size_t size, uint64_t *value);
+
 struct chat_message {
 #if NEED_AUTHOR
   /** Author's name. */
@@ -46,8 +88,54 @@ struct chat_message {
   /* PUT HERE OTHER MEMBERS */
 };
 
+/**
+ * Create a message owning @a data, a 0-terminated heap string of @a size
+ * bytes. On failure @a data is not freed.
+ */
+struct chat_message *chat_message_new(char *data, size_t size);
+
 /** Free message's memory. */
 void chat_message_delete(struct chat_message *msg);
 
+/**
+ * FIFO of messages. A ring of pointers with a power of two capacity, so that
+ * push and pop are O(1) and popping hands the message itself to the caller.
+ */
+struct chat_msg_queue {
+  struct chat_message **items;
+  size_t head;
+  size_t count;
+  size_t capacity;
+};
+
+/** Initialize an empty queue. Doesn't allocate. */
+void chat_msg_queue_create(struct chat_msg_queue *queue);
+
+/** Delete all the queued messages and free the queue's memory. */
+void chat_msg_queue_destroy(struct chat_msg_queue *queue);
+
+/**
+ * Append a message, the queue takes the ownership.
+ * @retval false Out of memory, the message is not queued.
+ */
+bool chat_msg_queue_push(struct chat_msg_queue *queue,
+                         struct chat_message *msg);
+
+/** Take the oldest message out of the queue, NULL if it is empty. */
+struct chat_message *chat_msg_queue_pop(struct chat_msg_queue *queue);
+
+/**
+ * Take up to @a count oldest messages out of the queue into @a msgs.
+ * @return Number of the messages taken.
+ */
+size_t chat_msg_queue_pop_batch(struct chat_msg_queue *queue,
+                                struct chat_message **msgs, size_t count);
+
+/** The message @a i positions after the oldest one, without popping it. */
+static inline struct chat_message *
+chat_msg_queue_at(const struct chat_msg_queue *queue, size_t i) {
+  return queue->items[(queue->head + i) & (queue->capacity - 1)];
+}
+
 /** Convert chat_events mask to events suitable for poll(). */
 int chat_events_to_poll_events(int mask);
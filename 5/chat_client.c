@@ -1,36 +1,11 @@
 #include "chat_client.h"
 #include "chat.h"
+#include "chat_ring.h"
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 
-void trim_client_message(char *str) {
-  if (str == NULL) {
-    return;
-  }
-  char *start = str;
-  while (isspace(*start)) {
-    start++;
-  }
-  if (start != str) {
-    memmove(str, start, strlen(start) + 1);
-  }
-  char *end = str + strlen(str) - 1;
-  while (end >= str && isspace(*end)) {
-    end--;
-  }
-  *(end + 1) = '\0';
-}
-
-bool is_empty_client_message(const char *str) {
-  while (*str) {
-    if (!isspace(*str)) {
-      return false;
-    }
-    str++;
-  }
-  return true;
-}
-
 static bool update_client_events(struct client_data *c_data,
                                  uint32_t new_events) {
   new_events |= EPOLLET | EPOLLRDHUP;
@@ -57,30 +32,14 @@ struct chat_client *chat_client_new(const char *name) {
   client->epoll_fd = -1;
   client->c_data = NULL;
   client->is_closed = false;
-  client->msg_capacity = 8;
-  client->msg_size = 0;
-  client->in_msg = malloc(client->msg_capacity * sizeof(struct chat_message));
-  if (client->in_msg == NULL) {
-    free(client);
-    return NULL;
-  }
-  client->out_capacity = 1024;
-  client->out_size = 0;
-  client->out_buffer = malloc(client->out_capacity);
-  if (client->out_buffer == NULL) {
-    free(client->in_msg);
-    free(client);
-    return NULL;
-  }
-  client->partial_capacity = 1024;
-  client->partial_size = 0;
-  client->partial_buffer = malloc(client->partial_capacity);
-  if (client->partial_buffer == NULL) {
-    free(client->out_buffer);
-    free(client->in_msg);
-    free(client);
-    return NULL;
-  }
+  chat_msg_queue_create(&client->in_msg);
+  chat_ring_create(&client->out);
+  chat_ring_create(&client->in);
+  client->in_scanned = 0;
+  client->protocol = CHAT_PROTOCOL_TEXT;
+  client->is_binary_in = false;
+  chat_ring_create(&client->feed);
+  client->feed_scanned = 0;
   return client;
 }
 
@@ -99,15 +58,25 @@ void chat_client_delete(struct chat_client *client) {
     close(client->socket);
   }
   free(client->c_data);
-  for (size_t i = 0; i < client->msg_size; i++) {
-    free(client->in_msg[i].data);
-  }
-  free(client->in_msg);
-  free(client->out_buffer);
-  free(client->partial_buffer);
+  chat_msg_queue_destroy(&client->in_msg);
+  chat_ring_destroy(&client->out);
+  chat_ring_destroy(&client->in);
+  chat_ring_destroy(&client->feed);
   free(client);
 }
 
+int chat_client_set_protocol(struct chat_client *client,
+                             enum chat_protocol protocol) {
+  if (client->socket != -1) {
+    return CHAT_ERR_ALREADY_STARTED;
+  }
+  if (protocol != CHAT_PROTOCOL_TEXT && protocol != CHAT_PROTOCOL_BINARY) {
+    return CHAT_ERR_INVALID_ARGUMENT;
+  }
+  client->protocol = protocol;
+  return 0;
+}
+
 int chat_client_connect(struct chat_client *client, const char *addr) {
   if (client == NULL || client->socket != -1) {
     return CHAT_ERR_ALREADY_STARTED;
@@ -141,6 +110,9 @@ int chat_client_connect(struct chat_client *client, const char *addr) {
       sock = -1;
       continue;
     }
+    /* A line is sent as soon as it is complete, Nagle would hold it. */
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
     if (connect(sock, rp->ai_addr, rp->ai_addrlen) == -1) {
       if (errno != EINPROGRESS) {
         close(sock);
@@ -181,126 +153,225 @@ int chat_client_connect(struct chat_client *client, const char *addr) {
     client->epoll_fd = -1;
     return CHAT_ERR_SYS;
   }
+  /* The hello goes first, before anything fed. */
+  if (client->protocol == CHAT_PROTOCOL_BINARY &&
+      !chat_ring_append(&client->out, CHAT_BINARY_HELLO,
+                        CHAT_BINARY_HELLO_SIZE)) {
+    client->is_closed = true;
+    return CHAT_ERR_SYS;
+  }
   return 0;
 }
 
 struct chat_message *chat_client_pop_next(struct chat_client *client) {
-  if (client == NULL || client->msg_size == 0) {
+  if (client == NULL) {
     return NULL;
   }
-  struct chat_message msg = client->in_msg[0];
-  memmove(client->in_msg, client->in_msg + 1,
-          (client->msg_size - 1) * sizeof(*client->in_msg));
-  client->msg_size--;
-  struct chat_message *result = malloc(sizeof(struct chat_message));
-  if (result == NULL) {
-    return NULL;
+  return chat_msg_queue_pop(&client->in_msg);
+}
+
+size_t chat_client_pop_batch(struct chat_client *client,
+                             struct chat_message **msgs, size_t count) {
+  if (client == NULL) {
+    return 0;
   }
-  result->data = strdup(msg.data);
-  result->size = msg.size;
-  free(msg.data);
-  return result;
+  return chat_msg_queue_pop_batch(&client->in_msg, msgs, count);
 }
 
-static void get_client_in_data(struct chat_client *client) {
-  char buffer[1024];
-  ssize_t received;
-  while (true) {
-    received = recv(client->socket, buffer, sizeof(buffer), 0);
-    if (received > 0) {
-      if (client->partial_size > SIZE_MAX - received) {
+static bool push_client_message(struct chat_client *client, char *msg,
+                                size_t size) {
+  struct chat_message *new_msg = chat_message_new(msg, size);
+  if (new_msg == NULL) {
+    free(msg);
+    return false;
+  }
+  if (!chat_msg_queue_push(&client->in_msg, new_msg)) {
+    chat_message_delete(new_msg);
+    return false;
+  }
+  return true;
+}
+
+/** The input starts with a 0 byte, which no text line does. */
+static bool is_at_hello(const struct chat_client *client) {
+  char first;
+  if (client->protocol != CHAT_PROTOCOL_BINARY ||
+      chat_ring_size(&client->in) == 0) {
+    return false;
+  }
+  chat_ring_peek(&client->in, &first, 1);
+  return first == '\0';
+}
+
+/**
+ * Extract the text lines. A binary client stops at the server's hello, the
+ * frames after it may contain anything, so until the hello it takes the lines
+ * one by one.
+ */
+static void extract_client_lines(struct chat_client *client) {
+  struct chat_span spans[CHAT_RING_SPLIT_BATCH];
+  size_t max = client->protocol == CHAT_PROTOCOL_BINARY ? 1
+                                                        : CHAT_RING_SPLIT_BATCH;
+  size_t count;
+  do {
+    if (is_at_hello(client)) {
+      return;
+    }
+    size_t end;
+    count = chat_ring_split_lines(&client->in, client->in_scanned, spans, max,
+                                  &end);
+    for (size_t i = 0; i < count; ++i) {
+      size_t msg_len = spans[i].size;
+      if (msg_len == 0 ||
+          chat_ring_at(&client->in, spans[i].start) == '\0') {
+        continue;
+      }
+      char *msg = malloc(msg_len + 1);
+      if (msg == NULL) {
         client->is_closed = true;
         return;
       }
-      size_t new_size = client->partial_size + received;
-      if (new_size + 1 > client->partial_capacity) {
-        size_t new_capacity = client->partial_capacity * 2;
-        if (new_capacity == 0)
-          new_capacity = 1024;
-        if (new_capacity < new_size + 1) {
-          new_capacity = new_size + 1;
-          if (new_capacity < client->partial_capacity) {
-            client->is_closed = true;
-            return;
-          }
-        }
-        char *new_buffer = realloc(client->partial_buffer, new_capacity);
-        if (new_buffer == NULL) {
-          client->is_closed = true;
-          return;
-        }
-        client->partial_buffer = new_buffer;
-        client->partial_capacity = new_capacity;
+      chat_ring_copy(&client->in, spans[i].start, msg, msg_len);
+      msg[msg_len] = '\0';
+      if (!push_client_message(client, msg, msg_len)) {
+        client->is_closed = true;
+        return;
       }
-      memcpy(client->partial_buffer + client->partial_size, buffer, received);
-      client->partial_size = new_size;
-      client->partial_buffer[client->partial_size] = '\0';
-      char *start = client->partial_buffer;
-      char *end;
-      while ((end = memchr(start, '\n',
-                           client->partial_size -
-                               (start - client->partial_buffer)))) {
-        size_t msg_len = end - start;
-        char *msg = malloc(msg_len + 1);
-        if (msg == NULL) {
-          client->is_closed = true;
-          break;
-        }
-        memcpy(msg, start, msg_len);
-        msg[msg_len] = '\0';
-        trim_client_message(msg);
-        if (!is_empty_client_message(msg)) {
-          if (client->msg_size == client->msg_capacity) {
-            client->msg_capacity *= 2;
-            struct chat_message *new_in_msg =
-                realloc(client->in_msg,
-                        client->msg_capacity * sizeof(struct chat_message));
-            if (new_in_msg == NULL) {
-              client->is_closed = true;
-              free(msg);
-              break;
-            }
-            client->in_msg = new_in_msg;
-          }
-          client->in_msg[client->msg_size].data = msg;
-          client->in_msg[client->msg_size].size = strlen(msg);
-          client->msg_size++;
-        } else {
-          free(msg);
-        }
-        start = end + 1;
+    }
+    chat_ring_consume(&client->in, end);
+    client->in_scanned = 0;
+  } while (count == max);
+  client->in_scanned = chat_ring_size(&client->in);
+}
+
+static void extract_client_frames(struct chat_client *client) {
+  while (true) {
+    size_t size = chat_ring_size(&client->in);
+    char header[CHAT_VARINT_MAX];
+    size_t header_size = size < sizeof(header) ? size : sizeof(header);
+    chat_ring_peek(&client->in, header, header_size);
+    uint64_t len;
+    int rc = chat_varint_decode(header, header_size, &len);
+    if (rc == 0) {
+      return;
+    }
+    if (rc < 0 || len > CHAT_FRAME_MAX) {
+      client->is_closed = true;
+      return;
+    }
+    if (size < rc + len) {
+      return;
+    }
+    chat_ring_consume(&client->in, rc);
+    char *msg = malloc(len + 1);
+    if (msg == NULL) {
+      client->is_closed = true;
+      return;
+    }
+    chat_ring_peek(&client->in, msg, len);
+    msg[len] = '\0';
+    chat_ring_consume(&client->in, len);
+    if (!push_client_message(client, msg, len)) {
+      client->is_closed = true;
+      return;
+    }
+  }
+}
+
+static void extract_client_messages(struct chat_client *client) {
+  if (!client->is_binary_in) {
+    extract_client_lines(client);
+    if (client->is_closed || !is_at_hello(client) ||
+        chat_ring_size(&client->in) < CHAT_BINARY_HELLO_SIZE) {
+      return;
+    }
+    char hello[CHAT_BINARY_HELLO_SIZE];
+    chat_ring_peek(&client->in, hello, sizeof(hello));
+    if (memcmp(hello, CHAT_BINARY_HELLO, sizeof(hello)) != 0) {
+      client->is_closed = true;
+      return;
+    }
+    chat_ring_consume(&client->in, sizeof(hello));
+    client->is_binary_in = true;
+  }
+  extract_client_frames(client);
+}
+
+/** Frame the complete lines fed to a binary client into its output. */
+static bool frame_fed_lines(struct chat_client *client) {
+  struct chat_span spans[CHAT_RING_SPLIT_BATCH];
+  size_t count;
+  do {
+    size_t end;
+    count = chat_ring_split_lines(&client->feed, client->feed_scanned, spans,
+                                  CHAT_RING_SPLIT_BATCH, &end);
+    for (size_t i = 0; i < count; ++i) {
+      size_t len = spans[i].size;
+      if (len == 0 || chat_ring_at(&client->feed, spans[i].start) == '\0') {
+        continue;
       }
-      size_t remaining =
-          client->partial_size - (start - client->partial_buffer);
-      if (remaining > 0 && start != client->partial_buffer) {
-        memmove(client->partial_buffer, start, remaining);
-      } else if (remaining == 0) {
-        client->partial_buffer[0] = '\0';
+      char header[CHAT_VARINT_MAX];
+      size_t header_size = chat_varint_encode(len, header);
+      if (!chat_ring_reserve(&client->out, header_size + len) ||
+          !chat_ring_append(&client->out, header, header_size)) {
+        return false;
       }
-      client->partial_size = remaining;
-      client->partial_buffer[client->partial_size] = '\0';
-    } else if (received == 0) {
+      /* Copy the line straight from the feed into the reserved space. */
+      struct iovec iov[2];
+      int iov_count = chat_ring_free_iov(&client->out, iov);
+      size_t done = 0;
+      for (int j = 0; j < iov_count && done < len; ++j) {
+        size_t part = iov[j].iov_len < len - done ? iov[j].iov_len : len - done;
+        chat_ring_copy(&client->feed, spans[i].start + done, iov[j].iov_base,
+                       part);
+        done += part;
+      }
+      chat_ring_produce(&client->out, len);
+    }
+    chat_ring_consume(&client->feed, end);
+    client->feed_scanned = 0;
+  } while (count == CHAT_RING_SPLIT_BATCH);
+  client->feed_scanned = chat_ring_size(&client->feed);
+  return true;
+}
+
+static void get_client_in_data(struct chat_client *client) {
+  while (true) {
+    if (!chat_ring_reserve(&client->in, 1024)) {
       client->is_closed = true;
       return;
-    } else if (received == -1) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        break;
-      } else {
-        client->is_closed = true;
+    }
+    struct iovec iov[2];
+    int iov_count = chat_ring_free_iov(&client->in, iov);
+    ssize_t received = readv(client->socket, iov, iov_count);
+    if (received > 0) {
+      chat_ring_produce(&client->in, received);
+      extract_client_messages(client);
+      if (client->is_closed) {
         return;
       }
+    } else if (received == 0) {
+      client->is_closed = true;
+      return;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else if (errno != EINTR) {
+      client->is_closed = true;
+      return;
     }
   }
 }
 
 static void send_data(struct chat_client *client) {
-  while (client->out_size > 0) {
-    ssize_t sent_bytes = send(client->socket, client->out_buffer,
-                              client->out_size, MSG_NOSIGNAL);
+  while (chat_ring_size(&client->out) > 0) {
+    struct msghdr msg;
+    struct iovec iov[2];
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = chat_ring_data_iov(&client->out, iov);
+    ssize_t sent_bytes = sendmsg(client->socket, &msg, MSG_NOSIGNAL);
     if (sent_bytes > 0) {
-      memmove(client->out_buffer, client->out_buffer + sent_bytes,
-              client->out_size - sent_bytes);
-      client->out_size -= sent_bytes;
+      chat_ring_consume(&client->out, sent_bytes);
     } else if (sent_bytes == -1) {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
         break;
@@ -330,8 +401,13 @@ int chat_client_update(struct chat_client *client, double timeout) {
   }
   struct epoll_event events[1];
   int number = epoll_wait(client->epoll_fd, events, 1, epoll_timeout);
-  if (number == 0) {
-    if (client->out_size > 0) {
+  if (number == -1 && errno != EINTR) {
+    client->is_closed = true;
+    return CHAT_ERR_SYS;
+  }
+  /* Interrupted by a signal is like timed out, the output is flushed too. */
+  if (number <= 0) {
+    if (chat_ring_size(&client->out) > 0) {
       send_data(client);
       if (client->is_closed) {
         return CHAT_ERR_SYS;
@@ -339,13 +415,6 @@ int chat_client_update(struct chat_client *client, double timeout) {
     }
     return CHAT_ERR_TIMEOUT;
   }
-  if (number == -1) {
-    if (errno == EINTR) {
-      return CHAT_ERR_TIMEOUT;
-    }
-    client->is_closed = true;
-    return CHAT_ERR_SYS;
-  }
   struct client_data *c_data = (struct client_data *)events[0].data.ptr;
   if (c_data->fd != client->socket) {
     return CHAT_ERR_SYS;
@@ -378,7 +447,7 @@ int chat_client_get_events(const struct chat_client *client) {
     return 0;
   }
   int events = CHAT_EVENT_INPUT;
-  if (client->out_size > 0) {
+  if (chat_ring_size(&client->out) > 0) {
     events |= CHAT_EVENT_OUTPUT;
   }
   return events;
@@ -396,21 +465,17 @@ int chat_client_feed(struct chat_client *client, const char *msg,
   if (msg_size == 0) {
     return 0;
   }
-  if (client->out_size + msg_size + 1 < client->out_size) {
-    client->is_closed = true;
-    return CHAT_ERR_SYS;
-  }
-  if (client->out_size + msg_size + 1 > client->out_capacity) {
-    size_t new_capacity = (client->out_size + msg_size + 1) * 2;
-    char *new = realloc(client->out_buffer, new_capacity);
-    if (new == NULL) {
+  if (client->protocol == CHAT_PROTOCOL_BINARY) {
+    if (!chat_ring_append(&client->feed, msg, msg_size) ||
+        !frame_fed_lines(client)) {
       client->is_closed = true;
       return CHAT_ERR_SYS;
     }
-    client->out_buffer = new;
-    client->out_capacity = new_capacity;
+    return 0;
+  }
+  if (!chat_ring_append(&client->out, msg, msg_size)) {
+    client->is_closed = true;
+    return CHAT_ERR_SYS;
   }
-  memcpy(client->out_buffer + client->out_size, msg, msg_size);
-  client->out_size += msg_size;
   return 0;
 }
@@ -1,5 +1,8 @@
 #pragma once
 
+#include "chat.h"
+#include "chat_ring.h"
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -23,17 +26,20 @@ struct chat_client {
   int epoll_fd;
   struct client_data *c_data;
 
-  struct chat_message *in_msg;
-  size_t msg_size;
-  size_t msg_capacity;
+  struct chat_msg_queue in_msg;
+
+  struct chat_ring out;
 
-  char *out_buffer;
-  size_t out_size;
-  size_t out_capacity;
+  struct chat_ring in;
+  /* Prefix of the input already known to have no newline. */
+  size_t in_scanned;
 
-  char *partial_buffer;
-  size_t partial_size;
-  size_t partial_capacity;
+  enum chat_protocol protocol;
+  /* The server's hello came, the rest of the input is frames. */
+  bool is_binary_in;
+  /* Binary protocol: fed bytes not yet making a complete line to frame. */
+  struct chat_ring feed;
+  size_t feed_scanned;
 
   bool is_closed;
 };
@@ -47,6 +53,23 @@ struct chat_client *chat_client_new(const char *name);
 /** Free all client's resources. */
 void chat_client_delete(struct chat_client *client);
 
+/**
+ * Choose the wire protocol, see enum chat_protocol. Text is the default.
+ * The binary one frames every fed line with its length, so the server
+ * forwards it without scanning, and the messages aren't trimmed on the way
+ * back. Has to be called before chat_client_connect().
+ *
+ * @param client Chat client.
+ * @param protocol Protocol to use.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is already connected.
+ *     - CHAT_ERR_INVALID_ARGUMENT - unknown protocol.
+ */
+int chat_client_set_protocol(struct chat_client *client,
+                             enum chat_protocol protocol);
+
 /**
  * Try to connect to the given address.
  *
@@ -73,6 +96,19 @@ int chat_client_connect(struct chat_client *client, const char *addr);
  */
 struct chat_message *chat_client_pop_next(struct chat_client *client);
 
+/**
+ * Pop up to @a count next pending chat messages at once. Each of them has
+ * to be freed using chat_message_delete().
+ *
+ * @param client Chat client.
+ * @param msgs Array to store the messages to.
+ * @param count Size of @a msgs.
+ *
+ * @return Number of the messages popped, 0 when there are none yet.
+ */
+size_t chat_client_pop_batch(struct chat_client *client,
+                             struct chat_message **msgs, size_t count);
+
 /**
  * Wait for any update for the given timeout and do this update.
  *
@@ -0,0 +1,425 @@
+#include "chat_log.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum {
+  /* Bytes sent with one sendfile() call at most. */
+  CHAT_LOG_SEND_CHUNK = 1 << 20,
+};
+
+/** File name of a segment, PATH_MAX bytes. */
+static void segment_path(const struct chat_log *log, uint64_t first_seq,
+                         char *path) {
+  snprintf(path, PATH_MAX, "%s/%020" PRIu64 ".log", log->dir, first_seq);
+}
+
+static int segment_open(const struct chat_log *log, uint64_t first_seq,
+                        int flags) {
+  char path[PATH_MAX];
+  segment_path(log, first_seq, path);
+  return open(path, flags | O_CLOEXEC, 0644);
+}
+
+static struct chat_log_segment *segment_push(struct chat_log *log,
+                                             uint64_t first_seq) {
+  if (log->segment_count == log->segment_capacity) {
+    size_t new_capacity =
+        log->segment_capacity == 0 ? 8 : log->segment_capacity * 2;
+    struct chat_log_segment *new_segments =
+        realloc(log->segments, new_capacity * sizeof(*new_segments));
+    if (new_segments == NULL) {
+      return NULL;
+    }
+    log->segments = new_segments;
+    log->segment_capacity = new_capacity;
+  }
+  struct chat_log_segment *seg = &log->segments[log->segment_count++];
+  seg->first_seq = first_seq;
+  seg->line_count = 0;
+  seg->size = 0;
+  seg->mtime = time(NULL);
+  return seg;
+}
+
+/** Index of the last segment starting at or before @a seq, 0 if none. */
+static size_t segment_find(const struct chat_log *log, uint64_t seq) {
+  size_t lo = 0;
+  size_t hi = log->segment_count;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (log->segments[mid].first_seq <= seq) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static size_t count_lines(const char *data, size_t size) {
+  size_t count = 0;
+  const char *end = data + size;
+  const char *pos = data;
+  while ((pos = memchr(pos, '\n', end - pos)) != NULL) {
+    ++count;
+    ++pos;
+  }
+  return count;
+}
+
+/**
+ * Count the lines of a found segment file. The last segment loses an
+ * unfinished line at its end.
+ */
+static bool segment_load(struct chat_log *log, struct chat_log_segment *seg,
+                         bool is_last) {
+  int fd = segment_open(log, seg->first_seq, is_last ? O_RDWR : O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+  seg->size = st.st_size;
+  seg->mtime = st.st_mtime;
+  if (seg->size > 0) {
+    char *data = mmap(NULL, seg->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    seg->line_count = count_lines(data, seg->size);
+    size_t complete = seg->size;
+    while (complete > 0 && data[complete - 1] != '\n') {
+      --complete;
+    }
+    munmap(data, seg->size);
+    if (is_last && complete != seg->size) {
+      if (ftruncate(fd, complete) != 0) {
+        close(fd);
+        return false;
+      }
+      seg->size = complete;
+    }
+  }
+  close(fd);
+  return true;
+}
+
+static int compare_segments(const void *a, const void *b) {
+  uint64_t sa = ((const struct chat_log_segment *)a)->first_seq;
+  uint64_t sb = ((const struct chat_log_segment *)b)->first_seq;
+  return sa < sb ? -1 : sa > sb;
+}
+
+/** Find the segment files of the directory. */
+static bool log_scan(struct chat_log *log) {
+  DIR *dir = opendir(log->dir);
+  if (dir == NULL) {
+    return false;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    uint64_t first_seq;
+    char tail;
+    if (strlen(entry->d_name) != 24 ||
+        sscanf(entry->d_name, "%20" SCNu64 ".lo%c", &first_seq, &tail) != 2 ||
+        tail != 'g') {
+      continue;
+    }
+    if (segment_push(log, first_seq) == NULL) {
+      closedir(dir);
+      return false;
+    }
+  }
+  closedir(dir);
+  if (log->segment_count == 0) {
+    return true;
+  }
+  qsort(log->segments, log->segment_count, sizeof(*log->segments),
+        compare_segments);
+  for (size_t i = 0; i < log->segment_count; ++i) {
+    struct chat_log_segment *seg = &log->segments[i];
+    if (!segment_load(log, seg, i + 1 == log->segment_count)) {
+      return false;
+    }
+    log->total_size += seg->size;
+  }
+  return true;
+}
+
+/** Start a new segment for the next line. */
+static bool log_roll(struct chat_log *log) {
+  int fd = segment_open(log, log->next_seq, O_WRONLY | O_CREAT | O_APPEND);
+  if (fd < 0) {
+    return false;
+  }
+  if (segment_push(log, log->next_seq) == NULL) {
+    close(fd);
+    return false;
+  }
+  if (log->fd >= 0) {
+    close(log->fd);
+  }
+  log->fd = fd;
+  return true;
+}
+
+/** Delete the oldest closed segments over the size or the age limit. */
+static void log_compact(struct chat_log *log) {
+  time_t now = time(NULL);
+  size_t count = 0;
+  uint64_t total_size = log->total_size;
+  while (count + 1 < log->segment_count) {
+    const struct chat_log_segment *seg = &log->segments[count];
+    bool is_too_big = log->max_bytes != 0 && total_size > log->max_bytes;
+    bool is_too_old =
+        log->max_age > 0 && difftime(now, seg->mtime) > log->max_age;
+    if (!is_too_big && !is_too_old) {
+      break;
+    }
+    char path[PATH_MAX];
+    segment_path(log, seg->first_seq, path);
+    unlink(path);
+    total_size -= seg->size;
+    ++count;
+  }
+  if (count == 0) {
+    return;
+  }
+  memmove(log->segments, log->segments + count,
+          (log->segment_count - count) * sizeof(*log->segments));
+  log->segment_count -= count;
+  log->total_size = total_size;
+}
+
+struct chat_log *chat_log_open(const char *dir, size_t segment_size,
+                               uint64_t max_bytes, double max_age) {
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    return NULL;
+  }
+  struct chat_log *log = calloc(1, sizeof(*log));
+  if (log == NULL) {
+    return NULL;
+  }
+  log->fd = -1;
+  log->segment_size = segment_size;
+  log->max_bytes = max_bytes;
+  log->max_age = max_age;
+  log->dir = strdup(dir);
+  if (log->dir == NULL || !log_scan(log)) {
+    chat_log_close(log);
+    return NULL;
+  }
+  if (log->segment_count == 0) {
+    if (!log_roll(log)) {
+      chat_log_close(log);
+      return NULL;
+    }
+    return log;
+  }
+  const struct chat_log_segment *last = &log->segments[log->segment_count - 1];
+  log->next_seq = last->first_seq + last->line_count;
+  log->fd = segment_open(log, last->first_seq, O_WRONLY | O_APPEND);
+  if (log->fd < 0) {
+    chat_log_close(log);
+    return NULL;
+  }
+  log_compact(log);
+  return log;
+}
+
+void chat_log_close(struct chat_log *log) {
+  if (log == NULL) {
+    return;
+  }
+  if (log->fd >= 0) {
+    close(log->fd);
+  }
+  free(log->segments);
+  free(log->dir);
+  free(log);
+}
+
+bool chat_log_append(struct chat_log *log, const char *data, size_t size) {
+  struct chat_log_segment *seg = &log->segments[log->segment_count - 1];
+  if (seg->size >= log->segment_size && seg->line_count > 0) {
+    if (!log_roll(log)) {
+      return false;
+    }
+    log_compact(log);
+    seg = &log->segments[log->segment_count - 1];
+  }
+  size_t done = 0;
+  while (done < size) {
+    ssize_t rc = write(log->fd, data + done, size - done);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      /* Don't leave half a line, it would shift the sequence numbers. */
+      int err = errno;
+      if (ftruncate(log->fd, seg->size) != 0) {
+        err = errno;
+      }
+      errno = err;
+      return false;
+    }
+    done += rc;
+  }
+  size_t line_count = count_lines(data, size);
+  seg->size += size;
+  seg->line_count += line_count;
+  seg->mtime = time(NULL);
+  log->next_seq += line_count;
+  log->total_size += size;
+  return true;
+}
+
+bool chat_log_seek(struct chat_log *log, uint64_t seq,
+                   struct chat_log_cursor *cursor) {
+  const struct chat_log_segment *seg = &log->segments[segment_find(log, seq)];
+  cursor->log = log;
+  cursor->segment_seq = seg->first_seq;
+  cursor->offset = 0;
+  cursor->fd = segment_open(log, seg->first_seq, O_RDONLY);
+  if (cursor->fd < 0) {
+    return false;
+  }
+  if (seq <= seg->first_seq || seg->size == 0) {
+    return true;
+  }
+  if (seq >= seg->first_seq + seg->line_count) {
+    cursor->offset = seg->size;
+    return true;
+  }
+  char *data = mmap(NULL, seg->size, PROT_READ, MAP_PRIVATE, cursor->fd, 0);
+  if (data == MAP_FAILED) {
+    chat_log_cursor_close(cursor);
+    return false;
+  }
+  const char *pos = data;
+  for (uint64_t skip = seq - seg->first_seq; skip > 0; --skip) {
+    pos = memchr(pos, '\n', data + seg->size - pos) + 1;
+  }
+  cursor->offset = pos - data;
+  munmap(data, seg->size);
+  return true;
+}
+
+/**
+ * Find where the cursor's segment ends. A deleted segment is not appended to
+ * anymore, so its file size is final.
+ *
+ * @param[out] is_last The segment is the one appended to.
+ */
+static bool cursor_segment_end(const struct chat_log_cursor *cursor,
+                               size_t *end, bool *is_last) {
+  const struct chat_log *log = cursor->log;
+  size_t i = segment_find(log, cursor->segment_seq);
+  if (log->segments[i].first_seq == cursor->segment_seq) {
+    *end = log->segments[i].size;
+    *is_last = i + 1 == log->segment_count;
+    return true;
+  }
+  struct stat st;
+  if (fstat(cursor->fd, &st) != 0) {
+    return false;
+  }
+  *end = st.st_size;
+  *is_last = false;
+  return true;
+}
+
+/** Move the cursor to the segment after its current one. */
+static bool cursor_next_segment(struct chat_log_cursor *cursor) {
+  const struct chat_log *log = cursor->log;
+  size_t i = segment_find(log, cursor->segment_seq);
+  if (log->segments[i].first_seq <= cursor->segment_seq) {
+    ++i;
+  }
+  close(cursor->fd);
+  cursor->segment_seq = log->segments[i].first_seq;
+  cursor->offset = 0;
+  cursor->fd = segment_open(log, cursor->segment_seq, O_RDONLY);
+  return cursor->fd >= 0;
+}
+
+int chat_log_send(struct chat_log_cursor *cursor, int sock) {
+  sigset_t pipe_set;
+  sigset_t old_set;
+  sigemptyset(&pipe_set);
+  sigaddset(&pipe_set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+  int rc;
+  while (true) {
+    size_t end;
+    bool is_last;
+    if (!cursor_segment_end(cursor, &end, &is_last)) {
+      rc = -1;
+      break;
+    }
+    if ((size_t)cursor->offset >= end) {
+      if (is_last) {
+        rc = 1;
+        break;
+      }
+      if (!cursor_next_segment(cursor)) {
+        rc = -1;
+        break;
+      }
+      continue;
+    }
+    size_t len = end - cursor->offset;
+    if (len > CHAT_LOG_SEND_CHUNK) {
+      len = CHAT_LOG_SEND_CHUNK;
+    }
+    ssize_t sent = sendfile(sock, cursor->fd, &cursor->offset, len);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      rc = errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+      break;
+    }
+    if (sent == 0) {
+      /* The file is shorter than logged, it was cut from outside. */
+      errno = EIO;
+      rc = -1;
+      break;
+    }
+  }
+  if (rc < 0 && errno == EPIPE) {
+    /* Consume the SIGPIPE while it is blocked, it is not for the process. */
+    int err = errno;
+    struct timespec zero = {0, 0};
+    sigtimedwait(&pipe_set, NULL, &zero);
+    errno = err;
+  }
+  int err = errno;
+  pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+  errno = err;
+  return rc;
+}
+
+void chat_log_cursor_close(struct chat_log_cursor *cursor) {
+  if (cursor->fd >= 0) {
+    close(cursor->fd);
+    cursor->fd = -1;
+  }
+}
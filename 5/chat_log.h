@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/**
+ * Append-only log of broadcast lines on disk. It is split into segment files
+ * named after the sequence number of their first line, and a line's sequence
+ * number is the number of lines logged before it. The lines are stored
+ * exactly as text peers get them, '\n' included, so a replay is sendfile()
+ * from the segments straight into the socket.
+ */
+struct chat_log_segment {
+  uint64_t first_seq;
+  uint64_t line_count;
+  size_t size;
+  /* Time of the last append, for the age limit. */
+  time_t mtime;
+};
+
+struct chat_log {
+  char *dir;
+  /* A segment is closed once it gets this big. */
+  size_t segment_size;
+  /* Retention, closed segments over the limits are deleted. 0 is no limit. */
+  uint64_t max_bytes;
+  double max_age;
+  /* Oldest first, the last one is appended to. Never empty. */
+  struct chat_log_segment *segments;
+  size_t segment_count;
+  size_t segment_capacity;
+  /* Descriptor of the last segment. */
+  int fd;
+  uint64_t next_seq;
+  uint64_t total_size;
+};
+
+/** Position of a replay in the log. */
+struct chat_log_cursor {
+  struct chat_log *log;
+  /*
+   * Segment being sent, by its first sequence number, and its descriptor. It
+   * stays readable even if the segment is deleted meanwhile.
+   */
+  uint64_t segment_seq;
+  int fd;
+  off_t offset;
+};
+
+/**
+ * Open the log in @a dir, creating the directory if needed. The existing
+ * segments are scanned via mmap() to count their lines, and an unfinished
+ * line at the end of the last one, left by a crash, is cut off.
+ *
+ * @retval not-NULL The log.
+ * @retval NULL Error, check errno.
+ */
+struct chat_log *chat_log_open(const char *dir, size_t segment_size,
+                               uint64_t max_bytes, double max_age);
+
+/** Close the log, the files stay. */
+void chat_log_close(struct chat_log *log);
+
+/**
+ * Append @a size bytes of complete lines. Each '\n' ends a line taking a
+ * sequence number. A failed write is rolled back.
+ *
+ * @retval true Success.
+ * @retval false Error, check errno.
+ */
+bool chat_log_append(struct chat_log *log, const char *data, size_t size);
+
+/**
+ * Position @a cursor at the line @a seq. A line which is already deleted
+ * means the oldest kept one, a line which is not logged yet means the end.
+ * The segment is read via mmap() to find the line.
+ *
+ * @retval true Success.
+ * @retval false Error, check errno.
+ */
+bool chat_log_seek(struct chat_log *log, uint64_t seq,
+                   struct chat_log_cursor *cursor);
+
+/**
+ * Send the log from the cursor to the end with sendfile(), moving from
+ * segment to segment. Doesn't raise SIGPIPE on a closed socket, just like
+ * MSG_NOSIGNAL.
+ *
+ * @retval 1 Everything is sent.
+ * @retval 0 The socket is full, more is left.
+ * @retval -1 Error, check errno.
+ */
+int chat_log_send(struct chat_log_cursor *cursor, int sock);
+
+/** Release the cursor's segment. */
+void chat_log_cursor_close(struct chat_log_cursor *cursor);
@@ -0,0 +1,308 @@
+#include "chat_ring.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Newlines are searched a vector at a time: AVX2 when the compiler targets it
+ * (-mavx2 or -march=native), else SSE2, which every x86-64 has. Set to 0 to
+ * force the plain byte loop.
+ */
+#ifndef CHAT_RING_USE_SIMD
+#define CHAT_RING_USE_SIMD 1
+#endif
+
+#if CHAT_RING_USE_SIMD && defined(__AVX2__)
+#include <immintrin.h>
+#elif CHAT_RING_USE_SIMD && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+enum {
+  CHAT_RING_MIN_CAPACITY = 1024,
+};
+
+void chat_ring_create(struct chat_ring *ring) {
+  chat_ring_create_in(ring, NULL, 0);
+}
+
+void chat_ring_create_in(struct chat_ring *ring, char *buf, size_t size) {
+  ring->data = buf;
+  ring->capacity = size;
+  ring->head = 0;
+  ring->tail = 0;
+  ring->storage = buf;
+  ring->storage_size = size;
+}
+
+void chat_ring_destroy(struct chat_ring *ring) {
+  if (ring->data != ring->storage) {
+    free(ring->data);
+  }
+  chat_ring_create_in(ring, ring->storage, ring->storage_size);
+}
+
+void chat_ring_shrink(struct chat_ring *ring) {
+  if (ring->storage != NULL && chat_ring_size(ring) == 0) {
+    chat_ring_destroy(ring);
+  }
+}
+
+bool chat_ring_reserve(struct chat_ring *ring, size_t size) {
+  size_t used = chat_ring_size(ring);
+  if (ring->capacity - used >= size) {
+    return true;
+  }
+  if (used + size < used) {
+    return false;
+  }
+  size_t new_capacity = ring->capacity;
+  if (new_capacity == 0) {
+    new_capacity = CHAT_RING_MIN_CAPACITY;
+  }
+  while (new_capacity < used + size) {
+    if (new_capacity * 2 < new_capacity) {
+      return false;
+    }
+    new_capacity *= 2;
+  }
+  char *new_data = malloc(new_capacity);
+  if (new_data == NULL) {
+    return false;
+  }
+  chat_ring_peek(ring, new_data, used);
+  if (ring->data != ring->storage) {
+    free(ring->data);
+  }
+  ring->data = new_data;
+  ring->capacity = new_capacity;
+  ring->head = 0;
+  ring->tail = used;
+  return true;
+}
+
+bool chat_ring_append(struct chat_ring *ring, const char *data, size_t size) {
+  if (!chat_ring_reserve(ring, size)) {
+    return false;
+  }
+  struct iovec iov[2];
+  int count = chat_ring_free_iov(ring, iov);
+  size_t done = 0;
+  for (int i = 0; i < count && done < size; ++i) {
+    size_t part = iov[i].iov_len < size - done ? iov[i].iov_len : size - done;
+    memcpy(iov[i].iov_base, data + done, part);
+    done += part;
+  }
+  chat_ring_produce(ring, size);
+  return true;
+}
+
+int chat_ring_free_iov(struct chat_ring *ring, struct iovec *iov) {
+  size_t free_size = ring->capacity - chat_ring_size(ring);
+  if (free_size == 0) {
+    return 0;
+  }
+  size_t mask = ring->capacity - 1;
+  size_t tail = ring->tail & mask;
+  size_t first = ring->capacity - tail;
+  if (first > free_size) {
+    first = free_size;
+  }
+  iov[0].iov_base = ring->data + tail;
+  iov[0].iov_len = first;
+  if (first == free_size) {
+    return 1;
+  }
+  iov[1].iov_base = ring->data;
+  iov[1].iov_len = free_size - first;
+  return 2;
+}
+
+int chat_ring_data_iov(const struct chat_ring *ring, struct iovec *iov) {
+  size_t used = chat_ring_size(ring);
+  if (used == 0) {
+    return 0;
+  }
+  size_t mask = ring->capacity - 1;
+  size_t head = ring->head & mask;
+  size_t first = ring->capacity - head;
+  if (first > used) {
+    first = used;
+  }
+  iov[0].iov_base = ring->data + head;
+  iov[0].iov_len = first;
+  if (first == used) {
+    return 1;
+  }
+  iov[1].iov_base = ring->data;
+  iov[1].iov_len = used - first;
+  return 2;
+}
+
+ptrdiff_t chat_ring_find(const struct chat_ring *ring, size_t from, char c) {
+  struct iovec iov[2];
+  int count = chat_ring_data_iov(ring, iov);
+  size_t base = 0;
+  for (int i = 0; i < count; ++i) {
+    size_t len = iov[i].iov_len;
+    if (from < base + len) {
+      size_t skip = from > base ? from - base : 0;
+      const char *start = (const char *)iov[i].iov_base + skip;
+      const char *pos = memchr(start, c, len - skip);
+      if (pos != NULL) {
+        return base + (pos - (const char *)iov[i].iov_base);
+      }
+    }
+    base += len;
+  }
+  return -1;
+}
+
+void chat_ring_peek(const struct chat_ring *ring, char *dst, size_t size) {
+  chat_ring_copy(ring, 0, dst, size);
+}
+
+void chat_ring_copy(const struct chat_ring *ring, size_t from, char *dst,
+                    size_t size) {
+  if (size == 0) {
+    return;
+  }
+  size_t pos = (ring->head + from) & (ring->capacity - 1);
+  size_t first = ring->capacity - pos;
+  if (first > size) {
+    first = size;
+  }
+  memcpy(dst, ring->data + pos, first);
+  memcpy(dst + first, ring->data, size - first);
+}
+
+#if CHAT_RING_USE_SIMD && defined(__AVX2__)
+#define CHAT_RING_VEC_SIZE 32
+typedef __m256i ring_vec;
+#define vec_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define vec_eq(v, c) _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))
+#define vec_or(a, b) _mm256_or_si256(a, b)
+#define vec_mask(v) ((uint32_t)_mm256_movemask_epi8(v))
+#elif CHAT_RING_USE_SIMD && defined(__SSE2__)
+#define CHAT_RING_VEC_SIZE 16
+typedef __m128i ring_vec;
+#define vec_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define vec_eq(v, c) _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+#define vec_or(a, b) _mm_or_si128(a, b)
+#define vec_mask(v) ((uint32_t)_mm_movemask_epi8(v))
+#else
+#define CHAT_RING_VEC_SIZE 0
+#endif
+
+struct line_splitter {
+  const struct chat_ring *ring;
+  struct chat_span *spans;
+  size_t max;
+  size_t count;
+  /** Offset of the line which is not terminated yet. */
+  size_t line_start;
+};
+
+/**
+ * Add the line ending with the newline at offset @a newline, trimmed.
+ * @retval false No room for more lines.
+ */
+static inline bool splitter_add(struct line_splitter *s, size_t newline) {
+  size_t start = s->line_start;
+  size_t end = newline;
+  while (start < end && isspace((unsigned char)chat_ring_at(s->ring, start))) {
+    ++start;
+  }
+  while (end > start &&
+         isspace((unsigned char)chat_ring_at(s->ring, end - 1))) {
+    --end;
+  }
+  s->spans[s->count].start = start;
+  s->spans[s->count].size = end - start;
+  s->line_start = newline + 1;
+  return ++s->count < s->max;
+}
+
+#if CHAT_RING_VEC_SIZE > 0
+
+/**
+ * Add the lines ending with the newlines set in @a mask, bit i stands for
+ * offset @a base + i.
+ * @retval false No room for more lines.
+ */
+static inline bool splitter_add_mask(struct line_splitter *s, uint32_t mask,
+                                     size_t base) {
+  for (; mask != 0; mask &= mask - 1) {
+    if (!splitter_add(s, base + __builtin_ctz(mask))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#endif
+
+/**
+ * Add the lines ending in @a data[pos, len), which is a contiguous part of
+ * the ring starting at offset @a base. All the newlines of a vector come out
+ * of one compare as a bit mask, and 4 vectors are checked at once, so long
+ * lines are skipped quickly.
+ * @retval false No room for more lines.
+ */
+static bool splitter_scan(struct line_splitter *s, const char *data,
+                          size_t pos, size_t len, size_t base) {
+#if CHAT_RING_VEC_SIZE > 0
+  for (; len - pos >= 4 * CHAT_RING_VEC_SIZE; pos += 4 * CHAT_RING_VEC_SIZE) {
+    const char *p = data + pos;
+    ring_vec e0 = vec_eq(vec_load(p), '\n');
+    ring_vec e1 = vec_eq(vec_load(p + CHAT_RING_VEC_SIZE), '\n');
+    ring_vec e2 = vec_eq(vec_load(p + 2 * CHAT_RING_VEC_SIZE), '\n');
+    ring_vec e3 = vec_eq(vec_load(p + 3 * CHAT_RING_VEC_SIZE), '\n');
+    if (vec_mask(vec_or(vec_or(e0, e1), vec_or(e2, e3))) == 0) {
+      continue;
+    }
+    size_t at = base + pos;
+    if (!splitter_add_mask(s, vec_mask(e0), at) ||
+        !splitter_add_mask(s, vec_mask(e1), at + CHAT_RING_VEC_SIZE) ||
+        !splitter_add_mask(s, vec_mask(e2), at + 2 * CHAT_RING_VEC_SIZE) ||
+        !splitter_add_mask(s, vec_mask(e3), at + 3 * CHAT_RING_VEC_SIZE)) {
+      return false;
+    }
+  }
+  for (; len - pos >= CHAT_RING_VEC_SIZE; pos += CHAT_RING_VEC_SIZE) {
+    uint32_t mask = vec_mask(vec_eq(vec_load(data + pos), '\n'));
+    if (!splitter_add_mask(s, mask, base + pos)) {
+      return false;
+    }
+  }
+#endif
+  for (; pos < len; ++pos) {
+    if (data[pos] == '\n' && !splitter_add(s, base + pos)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+size_t chat_ring_split_lines(const struct chat_ring *ring, size_t from,
+                             struct chat_span *spans, size_t max,
+                             size_t *end) {
+  struct line_splitter s = {ring, spans, max, 0, 0};
+  struct iovec iov[2];
+  int count = max > 0 ? chat_ring_data_iov(ring, iov) : 0;
+  size_t base = 0;
+  for (int i = 0; i < count; ++i) {
+    size_t len = iov[i].iov_len;
+    if (from < base + len) {
+      size_t skip = from > base ? from - base : 0;
+      if (!splitter_scan(&s, iov[i].iov_base, skip, len, base)) {
+        break;
+      }
+    }
+    base += len;
+  }
+  *end = s.line_start;
+  return s.count;
+}
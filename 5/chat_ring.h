@@ -0,0 +1,130 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/**
+ * Growable byte ring used for socket input and output queues. Positions are
+ * free-running counters masked by the power-of-two capacity, so producing and
+ * consuming are O(1) and never move the stored bytes.
+ */
+struct chat_ring {
+  char *data;
+  size_t capacity;
+  size_t head;
+  size_t tail;
+  /* Caller's buffer the ring starts in, never freed. NULL if none. */
+  char *storage;
+  size_t storage_size;
+};
+
+/** Initialize an empty ring without any memory. */
+void chat_ring_create(struct chat_ring *ring);
+
+/**
+ * Initialize an empty ring in the caller's buffer of @a size bytes, a power
+ * of 2. Only what does not fit goes to the heap.
+ */
+void chat_ring_create_in(struct chat_ring *ring, char *buf, size_t size);
+
+/** Free the ring's memory, it is empty in its own buffer again. */
+void chat_ring_destroy(struct chat_ring *ring);
+
+/** Free the heap memory of an empty ring which has a buffer of the caller. */
+void chat_ring_shrink(struct chat_ring *ring);
+
+/** Number of stored bytes. */
+static inline size_t chat_ring_size(const struct chat_ring *ring) {
+  return ring->tail - ring->head;
+}
+
+/**
+ * Make sure at least @a size more bytes fit. Stored bytes get linearized into
+ * a new buffer only when the ring has to grow.
+ *
+ * @retval true Success.
+ * @retval false Out of memory.
+ */
+bool chat_ring_reserve(struct chat_ring *ring, size_t size);
+
+/** Append @a size bytes. @retval false Out of memory. */
+bool chat_ring_append(struct chat_ring *ring, const char *data, size_t size);
+
+/**
+ * Fill @a iov with up to 2 spans of free space, for readv() into the ring.
+ * The read bytes have to be committed with chat_ring_produce().
+ *
+ * @return Number of used iovecs.
+ */
+int chat_ring_free_iov(struct chat_ring *ring, struct iovec *iov);
+
+/** Commit @a size bytes written into the free space. */
+static inline void chat_ring_produce(struct chat_ring *ring, size_t size) {
+  ring->tail += size;
+}
+
+/**
+ * Fill @a iov with up to 2 spans of stored bytes, for writev()/sendmsg() out
+ * of the ring. The sent bytes have to be dropped with chat_ring_consume().
+ *
+ * @return Number of used iovecs.
+ */
+int chat_ring_data_iov(const struct chat_ring *ring, struct iovec *iov);
+
+/** Drop @a size bytes from the head. */
+static inline void chat_ring_consume(struct chat_ring *ring, size_t size) {
+  ring->head += size;
+  if (ring->head == ring->tail) {
+    ring->head = 0;
+    ring->tail = 0;
+  }
+}
+
+/**
+ * Find the first @a c at or after offset @a from counting from the head.
+ *
+ * @retval >=0 Offset of the byte from the head.
+ * @retval -1 Not found.
+ */
+ptrdiff_t chat_ring_find(const struct chat_ring *ring, size_t from, char c);
+
+/** Copy the first @a size stored bytes into @a dst without consuming them. */
+void chat_ring_peek(const struct chat_ring *ring, char *dst, size_t size);
+
+/** Copy @a size stored bytes starting at offset @a from into @a dst. */
+void chat_ring_copy(const struct chat_ring *ring, size_t from, char *dst,
+                    size_t size);
+
+/** Stored byte at @a offset from the head. */
+static inline char chat_ring_at(const struct chat_ring *ring, size_t offset) {
+  return ring->data[(ring->head + offset) & (ring->capacity - 1)];
+}
+
+/** Stored bytes as an offset from the head and a size. */
+struct chat_span {
+  size_t start;
+  size_t size;
+};
+
+enum {
+  /** Spans worth splitting at once, they fit the stack. */
+  CHAT_RING_SPLIT_BATCH = 64,
+};
+
+/**
+ * Split the stored bytes into up to @a max complete lines with a vectorized
+ * newline search. Each span covers a line without its newline and without
+ * leading and trailing whitespace, which is cut off by moving the bounds, so
+ * nothing is copied or moved. A line of only whitespace gets size 0.
+ *
+ * @param from Offset to search newlines from, the bytes before it are known
+ *        to have none.
+ * @param[out] end Offset right after the last found newline, 0 if none. That
+ *        is how many bytes the found lines take.
+ * @return Number of spans. When it is less than @a max, there are no more
+ *         newlines after @a end.
+ */
+size_t chat_ring_split_lines(const struct chat_ring *ring, size_t from,
+                             struct chat_span *spans, size_t max,
+                             size_t *end);
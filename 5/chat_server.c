@@ -1,42 +1,419 @@
 #include "chat_server.h"
 #include "chat.h"
+#include "chat_ring.h"
 #include <arpa/inet.h>
-#include <ctype.h>
 #include <errno.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-void trim_server_message(char *str) {
-  if (str == NULL) {
+/*
+ * The io_uring backend talks to the kernel via raw syscalls, so it only needs
+ * the kernel headers. Build with -DCHAT_SERVER_USE_URING=0 to drop it.
+ */
+#ifndef CHAT_SERVER_USE_URING
+#ifdef __linux__
+#define CHAT_SERVER_USE_URING 1
+#else
+#define CHAT_SERVER_USE_URING 0
+#endif
+#endif
+
+#if CHAT_SERVER_USE_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+enum {
+  /* Iovecs handed to one sendmsg() call of a peer flush. */
+  CHAT_SEND_IOV_MAX = 64,
+  /*
+   * Free input space to read into at least. It is less than the inline input
+   * buffer, so a partial line left there doesn't make it spill.
+   */
+  CHAT_RECV_MIN = 256,
+};
+
+#if CHAT_SERVER_USE_URING
+static int listen_uring(struct chat_server *server, int sock);
+static void uring_stop(struct chat_server *server);
+static void uring_arm_recv(struct chat_server *server, struct chat_peer *peer);
+static void uring_pause_recv(struct chat_server *server,
+                             struct chat_peer *peer);
+#endif
+static void broadcast(struct chat_server *server, struct chat_peer *sender);
+static bool start_replay(struct chat_server *server, struct chat_peer *peer,
+                         uint64_t seq);
+
+static struct chat_buffer *chat_buffer_alloc(size_t size) {
+  struct chat_buffer *buf = malloc(sizeof(*buf) + size);
+  if (buf == NULL) {
+    return NULL;
+  }
+  buf->refs = 1;
+  buf->size = size;
+  return buf;
+}
+
+/** A message encoded as a text line. */
+static struct chat_buffer *chat_buffer_new_line(const char *data,
+                                                size_t size) {
+  struct chat_buffer *buf = chat_buffer_alloc(size + 1);
+  if (buf == NULL) {
+    return NULL;
+  }
+  memcpy(buf->data, data, size);
+  buf->data[size] = '\n';
+  return buf;
+}
+
+/** A message encoded as a binary frame. */
+static struct chat_buffer *chat_buffer_new_frame(const char *data,
+                                                 size_t size) {
+  char header[CHAT_VARINT_MAX];
+  size_t header_size = chat_varint_encode(size, header);
+  struct chat_buffer *buf = chat_buffer_alloc(header_size + size);
+  if (buf == NULL) {
+    return NULL;
+  }
+  memcpy(buf->data, header, header_size);
+  memcpy(buf->data + header_size, data, size);
+  return buf;
+}
+
+/*
+ * The counter is atomic because in the sharded mode one buffer is queued to
+ * peers of several reactor threads.
+ */
+static void chat_buffer_ref(struct chat_buffer *buf) {
+  __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void chat_buffer_unref(struct chat_buffer *buf) {
+  if (__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(buf);
+  }
+}
+
+/*
+ * Each server's counters are written only by its own thread, the atomics are
+ * for the main server summing up the shards' ones.
+ */
+static void stat_add(uint64_t *counter, uint64_t delta) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + delta,
+                   __ATOMIC_RELAXED);
+}
+
+/** Mark the peer to be freed at the end of the update. */
+static void close_peer(struct chat_peer *peer) {
+  if (peer->is_closed) {
+    return;
+  }
+  struct chat_server *server = peer->p_data.server;
+  peer->is_closed = true;
+  peer->next = server->closed_peers;
+  server->closed_peers = peer;
+}
+
+/**
+ * Account @a size bytes leaving the peer's output queue. A congested peer
+ * stops holding the paused senders when it is down to half of the limit.
+ */
+static void peer_unqueued(struct chat_peer *peer, size_t size) {
+  struct chat_server *server = peer->p_data.server;
+  peer->out_size -= size;
+  stat_add(&server->stats.queued_bytes, -(uint64_t)size);
+  if (peer->is_congested && peer->out_size <= server->out_limit / 2) {
+    peer->is_congested = false;
+    server->congested_count--;
+  }
+}
+
+/** Queue a reference to @a buf for sending. The buffer gets one more ref. */
+static bool peer_push_ref(struct chat_peer *peer, struct chat_buffer *buf) {
+  if (peer->out_count == peer->out_capacity) {
+    size_t new_capacity = peer->out_capacity * 2;
+    struct chat_out_ref *new_refs = malloc(new_capacity * sizeof(*new_refs));
+    if (new_refs == NULL) {
+      return false;
+    }
+    for (size_t i = 0; i < peer->out_count; ++i) {
+      new_refs[i] = peer->out_refs[(peer->out_head + i) % peer->out_capacity];
+    }
+    if (peer->out_refs != peer->out_inline) {
+      free(peer->out_refs);
+    }
+    peer->out_refs = new_refs;
+    peer->out_capacity = new_capacity;
+    peer->out_head = 0;
+  }
+  size_t tail = (peer->out_head + peer->out_count) % peer->out_capacity;
+  peer->out_refs[tail].buf = buf;
+  peer->out_refs[tail].offset = 0;
+  peer->out_count++;
+  peer->out_size += buf->size;
+  stat_add(&peer->p_data.server->stats.queued_bytes, buf->size);
+  chat_buffer_ref(buf);
+  return true;
+}
+
+/** Move an empty output queue back into the peer if it has grown out. */
+static void peer_shrink_refs(struct chat_peer *peer) {
+  if (peer->out_refs != peer->out_inline) {
+    free(peer->out_refs);
+    peer->out_refs = peer->out_inline;
+    peer->out_capacity = CHAT_PEER_INLINE_REFS;
+  }
+  peer->out_head = 0;
+}
+
+static void peer_clear_refs(struct chat_peer *peer) {
+  for (size_t i = 0; i < peer->out_count; ++i) {
+    struct chat_out_ref *ref =
+        &peer->out_refs[(peer->out_head + i) % peer->out_capacity];
+    chat_buffer_unref(ref->buf);
+  }
+  peer_unqueued(peer, peer->out_size);
+  peer->out_count = 0;
+  peer_shrink_refs(peer);
+}
+
+static void stop_replay(struct chat_peer *peer) {
+  if (!peer->is_replaying) {
     return;
   }
-  char *start = str;
-  while (isspace(*start)) {
-    start++;
+  chat_log_cursor_close(&peer->replay);
+  peer->is_replaying = false;
+}
+
+static void inbox_push(struct chat_server *server,
+                       struct chat_inbox_node *node) {
+  struct chat_inbox_node *head =
+      __atomic_load_n(&server->inbox, __ATOMIC_RELAXED);
+  do {
+    node->next = head;
+  } while (!__atomic_compare_exchange_n(&server->inbox, &head, node, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  /*
+   * The consumer empties the whole stack at once, so only the push into an
+   * empty inbox has to wake it up.
+   */
+  if (head == NULL) {
+    uint64_t one = 1;
+    ssize_t rc = write(server->event_fd, &one, sizeof(one));
+    (void)rc;
+  }
+}
+
+/** Take all the queued nodes in the order they were pushed. */
+static struct chat_inbox_node *inbox_take(struct chat_server *server) {
+  struct chat_inbox_node *node =
+      __atomic_exchange_n(&server->inbox, NULL, __ATOMIC_ACQUIRE);
+  struct chat_inbox_node *fifo = NULL;
+  while (node != NULL) {
+    struct chat_inbox_node *next = node->next;
+    node->next = fifo;
+    fifo = node;
+    node = next;
+  }
+  return fifo;
+}
+
+static void inbox_free(struct chat_inbox_node *node) {
+  while (node != NULL) {
+    struct chat_inbox_node *next = node->next;
+    if (node->buf != NULL) {
+      chat_buffer_unref(node->buf);
+    }
+    if (node->bin_buf != NULL) {
+      chat_buffer_unref(node->bin_buf);
+    }
+    chat_message_delete(node->msg);
+    free(node->room);
+    free(node);
+    node = next;
+  }
+}
+
+static uint32_t room_hash(const char *name) {
+  /* FNV-1a. */
+  uint32_t h = 2166136261u;
+  for (; *name != 0; ++name) {
+    h = (h ^ (unsigned char)*name) * 16777619u;
+  }
+  return h;
+}
+
+/** Slot of the named room, or the free slot where it would be inserted. */
+static struct chat_room **room_slot(struct chat_server *server,
+                                    const char *name) {
+  size_t mask = server->room_capacity - 1;
+  for (size_t i = room_hash(name) & mask;; i = (i + 1) & mask) {
+    struct chat_room **slot = &server->rooms[i];
+    if (*slot == NULL || strcmp((*slot)->name, name) == 0) {
+      return slot;
+    }
+  }
+}
+
+/** The named room, the lobby for NULL. NULL if there is no such room. */
+static struct chat_room *room_find(struct chat_server *server,
+                                   const char *name) {
+  if (name == NULL) {
+    return &server->lobby;
+  }
+  if (server->room_count == 0) {
+    return NULL;
+  }
+  return *room_slot(server, name);
+}
+
+/** Find the named room or create an empty one. NULL if out of memory. */
+static struct chat_room *room_get(struct chat_server *server,
+                                  const char *name) {
+  struct chat_room *room = room_find(server, name);
+  if (room != NULL) {
+    return room;
+  }
+  if ((server->room_count + 1) * 2 > server->room_capacity) {
+    size_t old_capacity = server->room_capacity;
+    struct chat_room **old_rooms = server->rooms;
+    size_t new_capacity = old_capacity == 0 ? 64 : old_capacity * 2;
+    struct chat_room **new_rooms = calloc(new_capacity, sizeof(*new_rooms));
+    if (new_rooms == NULL) {
+      return NULL;
+    }
+    server->rooms = new_rooms;
+    server->room_capacity = new_capacity;
+    for (size_t i = 0; i < old_capacity; ++i) {
+      if (old_rooms[i] != NULL) {
+        *room_slot(server, old_rooms[i]->name) = old_rooms[i];
+      }
+    }
+    free(old_rooms);
+  }
+  room = calloc(1, sizeof(*room));
+  if (room == NULL) {
+    return NULL;
+  }
+  room->name = strdup(name);
+  if (room->name == NULL) {
+    free(room);
+    return NULL;
+  }
+  *room_slot(server, name) = room;
+  server->room_count++;
+  return room;
+}
+
+static void room_free(struct chat_room *room) {
+  free(room->name);
+  free(room->members);
+  free(room);
+}
+
+/** Remove an empty room, re-inserting the rest of its probe chain. */
+static void room_delete(struct chat_server *server, struct chat_room *room) {
+  struct chat_room **slot = room_slot(server, room->name);
+  *slot = NULL;
+  server->room_count--;
+  room_free(room);
+  size_t mask = server->room_capacity - 1;
+  for (size_t i = (slot - server->rooms + 1) & mask; server->rooms[i] != NULL;
+       i = (i + 1) & mask) {
+    struct chat_room *moved = server->rooms[i];
+    server->rooms[i] = NULL;
+    *room_slot(server, moved->name) = moved;
   }
-  if (start != str) {
-    memmove(str, start, strlen(start) + 1);
+}
+
+/** Take the peer out of its room, the last member takes its place. */
+static void room_leave(struct chat_server *server, struct chat_peer *peer) {
+  struct chat_room *room = peer->room;
+  if (room == NULL) {
+    return;
   }
-  char *end = str + strlen(str) - 1;
-  while (end >= str && isspace(*end)) {
-    end--;
+  struct chat_peer *last = room->members[--room->member_count];
+  room->members[peer->room_index] = last;
+  last->room_index = peer->room_index;
+  peer->room = NULL;
+  if (room->member_count == 0 && room != &server->lobby) {
+    room_delete(server, room);
   }
-  *(end + 1) = '\0';
 }
 
-bool is_empty_server_message(const char *str) {
-  while (*str) {
-    if (!isspace(*str)) {
+/**
+ * Move the peer to the named room, the lobby for NULL.
+ * @retval false Out of memory, the peer stays where it was.
+ */
+static bool room_join(struct chat_server *server, struct chat_peer *peer,
+                      const char *name) {
+  struct chat_room *room = room_get(server, name);
+  if (room == NULL) {
+    return false;
+  }
+  if (room == peer->room) {
+    return true;
+  }
+  if (room->member_count == room->member_capacity) {
+    size_t new_capacity =
+        room->member_capacity == 0 ? 4 : room->member_capacity * 2;
+    struct chat_peer **new_members =
+        realloc(room->members, new_capacity * sizeof(*new_members));
+    if (new_members == NULL) {
+      if (room->member_count == 0 && room != &server->lobby) {
+        room_delete(server, room);
+      }
       return false;
     }
-    str++;
+    room->members = new_members;
+    room->member_capacity = new_capacity;
   }
+  room_leave(server, peer);
+  peer->room = room;
+  peer->room_index = room->member_count;
+  room->members[room->member_count++] = peer;
   return true;
 }
 
+enum peer_command {
+  PEER_COMMAND_NONE,
+  PEER_COMMAND_JOIN,
+  PEER_COMMAND_LEAVE,
+  PEER_COMMAND_RESUME,
+};
+
+/**
+ * Find out if a message is a command.
+ * @param[out] arg Room to join or sequence number to resume from.
+ */
+static enum peer_command parse_command(const char *msg, size_t size,
+                                       const char **arg) {
+  size_t join_size = strlen(CHAT_ROOM_JOIN);
+  if (size > join_size && memcmp(msg, CHAT_ROOM_JOIN, join_size) == 0) {
+    *arg = msg + join_size;
+    return PEER_COMMAND_JOIN;
+  }
+  if (size == strlen(CHAT_ROOM_LEAVE) &&
+      memcmp(msg, CHAT_ROOM_LEAVE, size) == 0) {
+    return PEER_COMMAND_LEAVE;
+  }
+  size_t resume_size = strlen(CHAT_LOG_RESUME);
+  if (size > resume_size && memcmp(msg, CHAT_LOG_RESUME, resume_size) == 0 &&
+      strspn(msg + resume_size, "0123456789") == size - resume_size) {
+    *arg = msg + resume_size;
+    return PEER_COMMAND_RESUME;
+  }
+  return PEER_COMMAND_NONE;
+}
+
 static bool update_peer_events(struct peer_data *pd, uint32_t new_events) {
   new_events |= EPOLLET | EPOLLRDHUP;
   struct epoll_event ev;
@@ -57,79 +434,123 @@ struct chat_server *chat_server_new(void) {
   }
   server->socket = -1;
   server->epoll_fd = -1;
-  server->msg_capacity = 8;
-  server->messages = malloc(server->msg_capacity * sizeof(struct chat_message));
-  if (server->messages == NULL) {
-    free(server);
-    return NULL;
-  }
-  server->msg_count = 0;
+  chat_msg_queue_create(&server->messages);
+  chat_ring_create(&server->feed);
   server->peer_count = 0;
   server->peer_capacity = 8;
   server->peers = malloc(server->peer_capacity * sizeof(struct chat_peer *));
   if (server->peers == NULL) {
-    free(server->messages);
     free(server);
     return NULL;
   }
   server->listener_pd = NULL;
+  server->event_fd = -1;
+  const char *backend = getenv("CHAT_SERVER_BACKEND");
+  if (backend != NULL && strcmp(backend, "io_uring") == 0) {
+    server->backend = CHAT_SERVER_BACKEND_IO_URING;
+  }
   return server;
 }
 
-static struct chat_peer *create_peer(int socket) {
-  struct chat_peer *peer = calloc(1, sizeof(struct chat_peer));
-  if (peer == NULL) {
-    return NULL;
+/**
+ * Take a peer for the socket from the slab, a new chunk is allocated when no
+ * freed one is left. The io_uring send arguments stay with the slot.
+ */
+static struct chat_peer *create_peer(struct chat_server *server, int socket) {
+  if (server->free_peers == NULL) {
+    struct chat_peer_chunk *chunk = calloc(1, sizeof(*chunk));
+    if (chunk == NULL) {
+      return NULL;
+    }
+    chunk->next = server->peer_chunks;
+    server->peer_chunks = chunk;
+    for (size_t i = 0; i < CHAT_PEER_SLAB_CHUNK; ++i) {
+      chunk->peers[i].next = server->free_peers;
+      server->free_peers = &chunk->peers[i];
+    }
   }
+  struct chat_peer *peer = server->free_peers;
+  server->free_peers = peer->next;
+  struct chat_uring_send *uring_send = peer->uring_send;
+  /* The inline buffers don't need zeroing. */
+  memset(peer, 0, offsetof(struct chat_peer, out_inline));
+  peer->uring_send = uring_send;
   peer->socket = socket;
-  peer->partial_capacity = 1024;
-  peer->partial_in = malloc(peer->partial_capacity);
-  if (peer->partial_in == NULL) {
-    free(peer);
-    return NULL;
-  }
-  peer->partial_size = 0;
+  chat_ring_create_in(&peer->in, peer->in_inline, CHAT_PEER_INLINE_IN);
+  peer->out_refs = peer->out_inline;
+  peer->out_capacity = CHAT_PEER_INLINE_REFS;
+  peer->p_data.fd = socket;
+  peer->p_data.peer = peer;
+  peer->p_data.server = server;
+  return peer;
+}
 
-  peer->out_capacity = 1024;
-  peer->out_buffer = malloc(peer->out_capacity);
-  if (peer->out_buffer == NULL) {
-    free(peer->partial_in);
-    free(peer);
-    return NULL;
+/** Release the peer's resources and give it back to the slab. */
+static void free_peer(struct chat_server *server, struct chat_peer *peer) {
+  if (server->epoll_fd >= 0) {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, peer->socket, NULL);
   }
-  peer->out_size = 0;
-  peer->p_data = NULL;
-  peer->is_closed = false;
-  return peer;
+  close(peer->socket);
+  chat_ring_destroy(&peer->in);
+  peer_clear_refs(peer);
+  stop_replay(peer);
+  free(peer->name);
+  peer->next = server->free_peers;
+  server->free_peers = peer;
 }
 
-static void free_peer(struct chat_peer *peer) {
-  if (peer == NULL) {
-    return;
+static void stop_shards(struct chat_server *server) {
+  for (size_t i = 0; i < server->shard_count; ++i) {
+    struct chat_server *shard = server->shards[i];
+    if (shard == NULL || !shard->is_running) {
+      continue;
+    }
+    __atomic_store_n(&shard->is_stopping, true, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    ssize_t rc = write(shard->event_fd, &one, sizeof(one));
+    (void)rc;
   }
-  if (peer->p_data != NULL && peer->p_data->server != NULL &&
-      peer->p_data->server->epoll_fd >= 0) {
-    if (peer->p_data->fd != -1) {
-      epoll_ctl(peer->p_data->server->epoll_fd, EPOLL_CTL_DEL, peer->p_data->fd,
-                NULL);
+  for (size_t i = 0; i < server->shard_count; ++i) {
+    struct chat_server *shard = server->shards[i];
+    if (shard != NULL && shard->is_running) {
+      pthread_join(shard->thread, NULL);
+      shard->is_running = false;
     }
   }
-  if (peer->socket >= 0) {
-    close(peer->socket);
+  /* All the threads are gone, so nothing can push into the inboxes now. */
+  for (size_t i = 0; i < server->shard_count; ++i) {
+    chat_server_delete(server->shards[i]);
   }
-  free(peer->partial_in);
-  free(peer->out_buffer);
-  free(peer->name);
-  free(peer->p_data);
-  free(peer);
+  free(server->shards);
+  server->shards = NULL;
 }
 
 void chat_server_delete(struct chat_server *server) {
   if (server == NULL) {
     return;
   }
-  if (server->listener_pd != NULL && server->epoll_fd >= 0) {
-    if (server->listener_pd->fd != -1) {
+  if (server->shards != NULL) {
+    stop_shards(server);
+  }
+#if CHAT_SERVER_USE_URING
+  if (server->uring != NULL) {
+    uring_stop(server);
+  }
+#endif
+  inbox_free(inbox_take(server));
+  if (server->event_pd != NULL) {
+    if (server->epoll_fd >= 0) {
+      epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, server->event_fd, NULL);
+    }
+    free(server->event_pd);
+    server->event_pd = NULL;
+  }
+  if (server->event_fd >= 0) {
+    close(server->event_fd);
+    server->event_fd = -1;
+  }
+  if (server->listener_pd != NULL) {
+    if (server->epoll_fd >= 0 && server->listener_pd->fd != -1) {
       epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, server->listener_pd->fd, NULL);
     }
     free(server->listener_pd);
@@ -143,33 +564,36 @@ void chat_server_delete(struct chat_server *server) {
     close(server->socket);
     server->socket = -1;
   }
-  if (server->peers != NULL) {
-    for (size_t i = 0; i < server->peer_count; i++) {
-      if (server->peers[i] != NULL) {
-        free_peer(server->peers[i]);
-      }
-    }
-    free(server->peers);
-    server->peers = NULL;
+  for (size_t i = 0; i < server->peer_count; i++) {
+    free_peer(server, server->peers[i]);
   }
+  free(server->peers);
+  server->peers = NULL;
   server->peer_count = 0;
   server->peer_capacity = 0;
-  if (server->messages != NULL) {
-    for (size_t i = 0; i < server->msg_count; i++) {
-      free(server->messages[i].data);
+  while (server->peer_chunks != NULL) {
+    struct chat_peer_chunk *chunk = server->peer_chunks;
+    server->peer_chunks = chunk->next;
+    for (size_t i = 0; i < CHAT_PEER_SLAB_CHUNK; ++i) {
+      free(chunk->peers[i].uring_send);
+    }
+    free(chunk);
+  }
+  for (size_t i = 0; i < server->room_capacity; ++i) {
+    if (server->rooms[i] != NULL) {
+      room_free(server->rooms[i]);
     }
-    free(server->messages);
-    server->messages = NULL;
   }
-  server->msg_count = 0;
-  server->msg_capacity = 0;
+  free(server->rooms);
+  free(server->lobby.members);
+  chat_log_close(server->log);
+  chat_ring_destroy(&server->feed);
+  free(server->feed_room);
+  chat_msg_queue_destroy(&server->messages);
   free(server);
 }
 
-int chat_server_listen(struct chat_server *server, uint16_t port) {
-  if (server->socket >= 0) {
-    return CHAT_ERR_ALREADY_STARTED;
-  }
+static int open_listen_socket(uint16_t port, bool reuse_port, int *out) {
   int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
   if (sock < 0) {
     return CHAT_ERR_SYS;
@@ -183,6 +607,11 @@ int chat_server_listen(struct chat_server *server, uint16_t port) {
     close(sock);
     return CHAT_ERR_SYS;
   }
+  if (reuse_port &&
+      setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+    close(sock);
+    return CHAT_ERR_SYS;
+  }
   if (bind(sock, (struct sockaddr *)&addr, sizeof(addr))) {
     close(sock);
     return (errno == EADDRINUSE) ? CHAT_ERR_PORT_BUSY : CHAT_ERR_SYS;
@@ -191,215 +620,1419 @@ int chat_server_listen(struct chat_server *server, uint16_t port) {
     close(sock);
     return CHAT_ERR_SYS;
   }
-  server->socket = sock;
-  server->epoll_fd = epoll_create1(0);
-  if (server->epoll_fd == -1) {
-    close(server->socket);
-    return CHAT_ERR_SYS;
-  }
+  *out = sock;
+  return 0;
+}
+
+static struct peer_data *watch_fd(struct chat_server *server, int fd) {
   struct peer_data *pd = malloc(sizeof(struct peer_data));
   if (pd == NULL) {
-    close(server->epoll_fd);
-    close(server->socket);
-    return CHAT_ERR_SYS;
+    return NULL;
   }
-  pd->fd = server->socket;
+  pd->fd = fd;
   pd->peer = NULL;
   pd->server = server;
   pd->current_events = 0;
   if (update_peer_events(pd, EPOLLIN) == false) {
     free(pd);
+    return NULL;
+  }
+  return pd;
+}
+
+/** Create the epoll of the server and watch the listening socket with it. */
+static int start_reactor(struct chat_server *server, int sock) {
+  server->socket = sock;
+  server->epoll_fd = epoll_create1(0);
+  if (server->epoll_fd == -1) {
+    close(server->socket);
+    server->socket = -1;
+    return CHAT_ERR_SYS;
+  }
+  server->listener_pd = watch_fd(server, server->socket);
+  if (server->listener_pd == NULL) {
     close(server->epoll_fd);
     close(server->socket);
+    server->epoll_fd = -1;
+    server->socket = -1;
     return CHAT_ERR_SYS;
   }
-  server->listener_pd = pd;
+  if (server->event_fd >= 0) {
+    server->event_pd = watch_fd(server, server->event_fd);
+    if (server->event_pd == NULL) {
+      return CHAT_ERR_SYS;
+    }
+  }
   return 0;
 }
 
-static void get_in_data(struct chat_server *server, struct chat_peer *peer) {
-  char buffer[1024];
-  ssize_t received;
-  size_t msg_count = server->msg_count;
-  while ((received = recv(peer->socket, buffer, sizeof(buffer), 0)) > 0) {
-    if (received > 0) {
-      if (peer->partial_size > SIZE_MAX - received) {
-        peer->is_closed = true;
-        return;
-      }
-      size_t new_size = peer->partial_size + received;
-      if (new_size < peer->partial_size) {
-        peer->is_closed = true;
-        return;
-      }
-      if (new_size + 1 > peer->partial_capacity) {
-        size_t new_capacity = new_size * 2 + 1;
-        if (new_capacity < new_size + 1) {
-          peer->is_closed = true;
-          return;
-        }
-        char *new_buf = realloc(peer->partial_in, new_capacity);
-        if (new_buf == NULL) {
-          peer->is_closed = true;
-          return;
-        }
-        peer->partial_in = new_buf;
-        peer->partial_capacity = new_capacity;
-      }
-      memcpy(peer->partial_in + peer->partial_size, buffer, received);
-      peer->partial_size = new_size;
-      peer->partial_in[peer->partial_size] = '\0';
-      char *start = peer->partial_in;
-      while (1) {
-        char *end = memchr(start, '\n',
-                           peer->partial_size - (start - peer->partial_in));
-        if (end == NULL) {
-          break;
-        }
-        size_t msg_len = end - start;
-        char *msg = malloc(msg_len + 1);
-        if (msg == NULL) {
-          peer->is_closed = true;
-          break;
-        }
-        memcpy(msg, start, msg_len);
-        msg[msg_len] = '\0';
-        trim_server_message(msg);
-        if (!is_empty_server_message(msg)) {
-          if (server->msg_count == server->msg_capacity) {
-            size_t new_msg_capacity = server->msg_capacity * 2;
-            if (new_msg_capacity == 0)
-              new_msg_capacity = 8;
-            if (new_msg_capacity < server->msg_capacity) {
-              free(msg);
-              peer->is_closed = true;
-              break;
-            }
-            struct chat_message *new_msgs =
-                realloc(server->messages,
-                        new_msg_capacity * sizeof(struct chat_message));
-            if (new_msgs == NULL) {
-              free(msg);
-              peer->is_closed = true;
-              break;
-            }
-            server->messages = new_msgs;
-            server->msg_capacity = new_msg_capacity;
-          }
-          server->messages[server->msg_count].data = msg;
-          server->messages[server->msg_count].size = strlen(msg);
-          server->msg_count++;
-        } else {
-          free(msg);
-        }
-        start = end + 1;
-      }
+static int listen_sharded(struct chat_server *server, uint16_t port);
 
-      size_t remaining = peer->partial_size - (start - peer->partial_in);
-      if (remaining > 0) {
-        memmove(peer->partial_in, start, remaining);
-      } else if (start != peer->partial_in) {
-        peer->partial_in[0] = '\0';
-      }
-      peer->partial_size = remaining;
-    } else if (received == 0) {
-      peer->is_closed = true;
-      return;
-    } else if (received == -1) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        break;
-      } else {
-        peer->is_closed = true;
-        return;
-      }
+int chat_server_listen(struct chat_server *server, uint16_t port) {
+  if (server->socket >= 0) {
+    return CHAT_ERR_ALREADY_STARTED;
+  }
+  if (server->shard_count > 1) {
+    if (server->log != NULL) {
+      return CHAT_ERR_NOT_IMPLEMENTED;
     }
+    return listen_sharded(server, port);
   }
-  if (server->msg_count > msg_count && peer->is_closed == false) {
-    for (size_t m = msg_count; m < server->msg_count; m++) {
-      struct chat_message *new_msg = &server->messages[m];
-      for (size_t j = 0; j < server->peer_count; ++j) {
-        struct chat_peer *other_peer = server->peers[j];
-        if (other_peer == NULL || other_peer->is_closed == true ||
-            other_peer == peer) {
-          continue;
-        }
-        size_t required_capacity = other_peer->out_size + new_msg->size + 1;
-        if (required_capacity < other_peer->out_size) {
-          other_peer->is_closed = true;
-          continue;
-        }
-        if (required_capacity > other_peer->out_capacity) {
-          size_t new_out_capacity = required_capacity * 2;
-          if (new_out_capacity < required_capacity) {
-            other_peer->is_closed = true;
-            continue;
-          }
-          char *new_out_buffer =
-              realloc(other_peer->out_buffer, new_out_capacity);
-          if (new_out_buffer == NULL) {
-            other_peer->is_closed = true;
-            continue;
-          }
-          other_peer->out_buffer = new_out_buffer;
-          other_peer->out_capacity = new_out_capacity;
-        }
-        memcpy(other_peer->out_buffer + other_peer->out_size, new_msg->data,
-               new_msg->size);
-        other_peer->out_size += new_msg->size;
-        other_peer->out_buffer[other_peer->out_size++] = '\n';
-      }
+  int sock;
+  int rc = open_listen_socket(port, false, &sock);
+  if (rc != 0) {
+    return rc;
+  }
+#if CHAT_SERVER_USE_URING
+  /* Fall back to epoll when io_uring is not available, like in a sandbox. */
+  if (server->backend == CHAT_SERVER_BACKEND_IO_URING &&
+      listen_uring(server, sock) == 0) {
+    return 0;
+  }
+  server->socket = -1;
+#endif
+  return start_reactor(server, sock);
+}
+
+static bool append_message(struct chat_server *server, char *msg,
+                           size_t size) {
+  struct chat_message *new_msg = chat_message_new(msg, size);
+  if (new_msg == NULL) {
+    return false;
+  }
+  if (!chat_msg_queue_push(&server->messages, new_msg)) {
+    /* The caller still owns the data. */
+    new_msg->data = NULL;
+    chat_message_delete(new_msg);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Queue a received message, or apply it if it is a command. The messages
+ * before a command are broadcast to the room they were sent to first. Takes
+ * the ownership of @a msg.
+ *
+ * @retval false Out of memory.
+ */
+static bool receive_message(struct chat_server *server, struct chat_peer *peer,
+                            char *msg, size_t size) {
+  const char *arg = NULL;
+  enum peer_command command = parse_command(msg, size, &arg);
+  if (command == PEER_COMMAND_RESUME &&
+      (server->log == NULL || peer->is_binary)) {
+    command = PEER_COMMAND_NONE;
+  }
+  if (command == PEER_COMMAND_NONE) {
+    if (!append_message(server, msg, size)) {
+      free(msg);
+      return false;
+    }
+    return true;
+  }
+  broadcast(server, peer);
+  bool ok;
+  if (command == PEER_COMMAND_RESUME) {
+    ok = start_replay(server, peer, strtoull(arg, NULL, 10));
+  } else {
+    /* The replay is of the lobby only. */
+    if (command == PEER_COMMAND_JOIN) {
+      stop_replay(peer);
     }
+    ok = room_join(server, peer, arg);
   }
+  free(msg);
+  return ok;
 }
 
-static void send_data(struct chat_peer *peer) {
-  while (peer->out_size > 0) {
-    ssize_t sent =
-        send(peer->socket, peer->out_buffer, peer->out_size, MSG_NOSIGNAL);
-    if (sent > 0) {
-      memmove(peer->out_buffer, peer->out_buffer + sent, peer->out_size - sent);
-      peer->out_size -= sent;
-    } else if (sent == -1) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        break;
-      } else {
-        peer->is_closed = true;
+/**
+ * Move all the complete lines of the peer's input ring to the server's message
+ * list. Bytes before a newline were already scanned, so a long line arriving
+ * in small pieces is searched only once. The lines come trimmed in batches,
+ * each is copied out of the ring once.
+ */
+static void extract_lines(struct chat_server *server, struct chat_peer *peer) {
+  struct chat_span spans[CHAT_RING_SPLIT_BATCH];
+  size_t count;
+  do {
+    size_t end;
+    count = chat_ring_split_lines(&peer->in, peer->in_scanned, spans,
+                                  CHAT_RING_SPLIT_BATCH, &end);
+    for (size_t i = 0; i < count; ++i) {
+      size_t msg_len = spans[i].size;
+      /* Text never starts with a zero byte, the binary hello does. */
+      if (msg_len == 0 || chat_ring_at(&peer->in, spans[i].start) == '\0') {
+        continue;
+      }
+      char *msg = malloc(msg_len + 1);
+      if (msg == NULL) {
+        close_peer(peer);
+        return;
+      }
+      chat_ring_copy(&peer->in, spans[i].start, msg, msg_len);
+      msg[msg_len] = '\0';
+      if (!receive_message(server, peer, msg, msg_len)) {
+        close_peer(peer);
         return;
       }
     }
+    chat_ring_consume(&peer->in, end);
+    peer->in_scanned = 0;
+  } while (count == CHAT_RING_SPLIT_BATCH);
+  peer->in_scanned = chat_ring_size(&peer->in);
+}
+
+/**
+ * Move all the complete frames of a binary peer's input to the server's
+ * message list. A payload text peers and the log can't take as one line, with
+ * a '\n' or starting with a zero byte, is dropped like such lines are.
+ */
+static void extract_frames(struct chat_server *server, struct chat_peer *peer) {
+  while (true) {
+    size_t size = chat_ring_size(&peer->in);
+    char header[CHAT_VARINT_MAX];
+    size_t header_size = size < sizeof(header) ? size : sizeof(header);
+    chat_ring_peek(&peer->in, header, header_size);
+    uint64_t len;
+    int rc = chat_varint_decode(header, header_size, &len);
+    if (rc == 0) {
+      return;
+    }
+    if (rc < 0 || len > CHAT_FRAME_MAX) {
+      close_peer(peer);
+      return;
+    }
+    if (size < rc + len) {
+      return;
+    }
+    chat_ring_consume(&peer->in, rc);
+    char *msg = malloc(len + 1);
+    if (msg == NULL) {
+      close_peer(peer);
+      return;
+    }
+    chat_ring_peek(&peer->in, msg, len);
+    msg[len] = '\0';
+    chat_ring_consume(&peer->in, len);
+    if (len == 0 || msg[0] == '\0' || memchr(msg, '\n', len) != NULL) {
+      free(msg);
+      continue;
+    }
+    if (!receive_message(server, peer, msg, len)) {
+      close_peer(peer);
+      return;
+    }
   }
 }
 
-struct chat_message *chat_server_pop_next(struct chat_server *server) {
-  if (server == NULL || server->msg_count == 0) {
-    return NULL;
+/**
+ * Find out the peer's protocol from its first bytes. A binary peer gets the
+ * hello back, queued after whatever text lines it already has.
+ *
+ * @retval false Not enough input yet.
+ */
+static bool detect_protocol(struct chat_server *server,
+                            struct chat_peer *peer) {
+  size_t size = chat_ring_size(&peer->in);
+  if (size == 0) {
+    return false;
   }
-  struct chat_message *msg = malloc(sizeof(struct chat_message));
-  if (msg == NULL) {
-    return NULL;
+  char hello[CHAT_BINARY_HELLO_SIZE];
+  size_t hello_size = size < sizeof(hello) ? size : sizeof(hello);
+  chat_ring_peek(&peer->in, hello, hello_size);
+  if (memcmp(hello, CHAT_BINARY_HELLO, hello_size) != 0) {
+    peer->is_protocol_known = true;
+    return true;
+  }
+  if (hello_size < sizeof(hello)) {
+    return false;
+  }
+  chat_ring_consume(&peer->in, sizeof(hello));
+  peer->is_protocol_known = true;
+  peer->is_binary = true;
+  server->binary_peer_count++;
+  struct chat_buffer *ack = chat_buffer_alloc(sizeof(hello));
+  if (ack == NULL) {
+    close_peer(peer);
+    return true;
+  }
+  memcpy(ack->data, CHAT_BINARY_HELLO, sizeof(hello));
+  if (!peer_push_ref(peer, ack)) {
+    close_peer(peer);
   }
-  msg->data = strdup(server->messages[0].data);
-  msg->size = server->messages[0].size;
-  free(server->messages[0].data);
-  memmove(server->messages, server->messages + 1,
-          (server->msg_count - 1) * sizeof(*server->messages));
-  server->msg_count--;
-  return msg;
+  chat_buffer_unref(ack);
+  return true;
 }
 
-int chat_server_update(struct chat_server *server, double timeout) {
-  if (server == NULL || server->socket < 0 || server->epoll_fd < 0) {
-    return CHAT_ERR_NOT_STARTED;
+/** Move all the complete messages of the peer's input to the server's list. */
+static void extract_messages(struct chat_server *server,
+                             struct chat_peer *peer) {
+  if (!peer->is_protocol_known && !detect_protocol(server, peer)) {
+    return;
   }
-  int epoll_timeout;
-  if (timeout < 0) {
-    epoll_timeout = -1;
+  if (peer->is_binary) {
+    extract_frames(server, peer);
   } else {
-    epoll_timeout = (int)(timeout * 1000);
+    extract_lines(server, peer);
   }
-  struct epoll_event events[30];
-  int number = epoll_wait(server->epoll_fd, events, 30, epoll_timeout);
-  if (number == 0) {
+  chat_ring_shrink(&peer->in);
+}
+
+static void pause_peer(struct chat_server *server, struct chat_peer *peer) {
+  if (peer->is_paused) {
+    return;
+  }
+  peer->is_paused = true;
+  server->paused_count++;
+  stat_add(&server->stats.sender_pauses, 1);
+#if CHAT_SERVER_USE_URING
+  if (server->uring != NULL) {
+    uring_pause_recv(server, peer);
+  }
+#endif
+}
+
+static void peer_count_drop(struct chat_server *server, struct chat_peer *peer,
+                            size_t size) {
+  peer->dropped_messages++;
+  peer->dropped_bytes += size;
+  stat_add(&server->stats.dropped_messages, 1);
+  stat_add(&server->stats.dropped_bytes, size);
+}
+
+/**
+ * Number of references at the head of the output queue whose sending has
+ * started. They have to go out whole, so they are never dropped.
+ */
+static size_t peer_started_refs(const struct chat_peer *peer) {
+  if (peer->is_sending) {
+    return peer->uring_send_refs;
+  }
+  if (peer->out_count > 0 && peer->out_refs[peer->out_head].offset > 0) {
+    return 1;
+  }
+  return 0;
+}
+
+/** Drop the oldest not started messages until @a size more bytes fit. */
+static void peer_drop_oldest(struct chat_server *server, struct chat_peer *peer,
+                             size_t size) {
+  size_t keep = peer_started_refs(peer);
+  while (peer->out_count > keep && peer->out_size + size > server->out_limit) {
+    size_t cap = peer->out_capacity;
+    struct chat_buffer *buf =
+        peer->out_refs[(peer->out_head + keep) % cap].buf;
+    /* Shift the started references over the dropped one. */
+    for (size_t i = keep; i > 0; --i) {
+      peer->out_refs[(peer->out_head + i) % cap] =
+          peer->out_refs[(peer->out_head + i - 1) % cap];
+    }
+    peer->out_head = (peer->out_head + 1) % cap;
+    peer->out_count--;
+    peer_count_drop(server, peer, buf->size);
+    peer_unqueued(peer, buf->size);
+    chat_buffer_unref(buf);
+  }
+}
+
+/**
+ * Start sending the log to the peer from the line @a seq on, in place of its
+ * queued messages which sending hasn't started.
+ *
+ * @retval false Error, the peer is to be closed.
+ */
+static bool start_replay(struct chat_server *server, struct chat_peer *peer,
+                         uint64_t seq) {
+  if (!room_join(server, peer, NULL)) {
+    return false;
+  }
+  stop_replay(peer);
+  size_t keep = peer_started_refs(peer);
+  size_t dropped_size = 0;
+  for (size_t i = keep; i < peer->out_count; ++i) {
+    struct chat_buffer *buf =
+        peer->out_refs[(peer->out_head + i) % peer->out_capacity].buf;
+    dropped_size += buf->size;
+    chat_buffer_unref(buf);
+  }
+  peer->out_count = keep;
+  peer_unqueued(peer, dropped_size);
+  if (!chat_log_seek(server->log, seq, &peer->replay)) {
+    return false;
+  }
+  peer->is_replaying = true;
+  return true;
+}
+
+/**
+ * Queue @a buf to @a peer within the output limit. @a sender is the local
+ * peer the message came from, NULL for the messages of other shards.
+ */
+static void peer_enqueue(struct chat_server *server, struct chat_peer *peer,
+                         struct chat_peer *sender, struct chat_buffer *buf) {
+  if (server->out_limit != 0 &&
+      peer->out_size + buf->size > server->out_limit) {
+    enum chat_overflow_policy policy = server->overflow_policy;
+    if (policy == CHAT_OVERFLOW_PAUSE_SENDER && sender == NULL) {
+      policy = CHAT_OVERFLOW_DROP_OLDEST;
+    }
+    switch (policy) {
+    case CHAT_OVERFLOW_DISCONNECT:
+      close_peer(peer);
+      stat_add(&server->stats.overflow_disconnects, 1);
+      return;
+    case CHAT_OVERFLOW_DROP_OLDEST:
+      peer_drop_oldest(server, peer, buf->size);
+      if (peer->out_size + buf->size > server->out_limit) {
+        peer_count_drop(server, peer, buf->size);
+        return;
+      }
+      break;
+    case CHAT_OVERFLOW_PAUSE_SENDER:
+      if (!peer->is_congested) {
+        peer->is_congested = true;
+        server->congested_count++;
+      }
+      pause_peer(server, sender);
+      break;
+    }
+  }
+  if (!peer_push_ref(peer, buf)) {
+    close_peer(peer);
+  }
+}
+
+/**
+ * Queue a message to the members of @a room except @a sender, as the @a line
+ * to text peers and as the @a frame to binary ones.
+ */
+static void broadcast_buffer(struct chat_server *server,
+                             struct chat_peer *sender, struct chat_room *room,
+                             struct chat_buffer *line,
+                             struct chat_buffer *frame) {
+  for (size_t j = 0; j < room->member_count; ++j) {
+    struct chat_peer *other_peer = room->members[j];
+    if (other_peer->is_closed == true || other_peer == sender ||
+        other_peer->is_replaying) {
+      continue;
+    }
+    peer_enqueue(server, other_peer, sender,
+                 other_peer->is_binary ? frame : line);
+  }
+}
+
+/**
+ * Give every shard of the @a main server except @a from references to a
+ * message for the room named @a room, NULL for the lobby.
+ */
+static void forward_to_shards(struct chat_server *main,
+                              struct chat_server *from, const char *room,
+                              struct chat_buffer *line,
+                              struct chat_buffer *frame) {
+  for (size_t i = 0; i < main->shard_count; ++i) {
+    struct chat_server *shard = main->shards[i];
+    if (shard == from) {
+      continue;
+    }
+    struct chat_inbox_node *node = calloc(1, sizeof(*node));
+    if (node == NULL) {
+      continue;
+    }
+    if (room != NULL && (node->room = strdup(room)) == NULL) {
+      free(node);
+      continue;
+    }
+    chat_buffer_ref(line);
+    chat_buffer_ref(frame);
+    node->buf = line;
+    node->bin_buf = frame;
+    inbox_push(shard, node);
+  }
+}
+
+/**
+ * Encode a message for the text and the binary peers. Only the encodings
+ * somebody reads are made, shards may need both for the other shards and the
+ * log takes the text one.
+ *
+ * @retval false Out of memory.
+ */
+static bool make_buffers(const struct chat_server *server, const char *data,
+                         size_t size, struct chat_buffer **line,
+                         struct chat_buffer **frame) {
+  bool is_sharded = server->parent != NULL || server->shards != NULL;
+  bool need_line = is_sharded || server->log != NULL ||
+                   server->binary_peer_count < server->peer_count;
+  bool need_frame = is_sharded || server->binary_peer_count > 0;
+  *line = NULL;
+  *frame = NULL;
+  if (need_line) {
+    *line = chat_buffer_new_line(data, size);
+  }
+  if (need_frame) {
+    *frame = chat_buffer_new_frame(data, size);
+  }
+  if ((need_line && *line == NULL) || (need_frame && *frame == NULL)) {
+    if (*line != NULL) {
+      chat_buffer_unref(*line);
+    }
+    if (*frame != NULL) {
+      chat_buffer_unref(*frame);
+    }
+    return false;
+  }
+  return true;
+}
+
+static void unref_buffers(struct chat_buffer *line, struct chat_buffer *frame) {
+  if (line != NULL) {
+    chat_buffer_unref(line);
+  }
+  if (frame != NULL) {
+    chat_buffer_unref(frame);
+  }
+}
+
+/**
+ * Append a line of the lobby to the log. A failed write loses the line for
+ * the replays only, the live peers still get it.
+ */
+static void log_line(struct chat_server *server, const struct chat_room *room,
+                     const struct chat_buffer *line) {
+  if (server->log != NULL && room == &server->lobby) {
+    chat_log_append(server->log, line->data, line->size);
+  }
+}
+
+/** Deliver the sender's messages not broadcast yet to its room. */
+static void broadcast(struct chat_server *server, struct chat_peer *sender) {
+  size_t first = server->broadcast_first;
+  server->broadcast_first = server->messages.count;
+  struct chat_room *room = sender->room;
+  for (size_t m = first; m < server->messages.count; m++) {
+    struct chat_message *new_msg = chat_msg_queue_at(&server->messages, m);
+    struct chat_buffer *line;
+    struct chat_buffer *frame;
+    if (!make_buffers(server, new_msg->data, new_msg->size, &line, &frame)) {
+      close_peer(sender);
+      return;
+    }
+    log_line(server, room, line);
+    broadcast_buffer(server, sender, room, line, frame);
+    if (server->parent != NULL) {
+      forward_to_shards(server->parent, server, room->name, line, frame);
+    }
+    unref_buffers(line, frame);
+  }
+}
+
+/**
+ * Hand the new messages of a shard over to the main server to pop. A shard
+ * keeps none of its own, so its whole queue is new.
+ */
+static void pass_to_parent(struct chat_server *server) {
+  struct chat_message *msg;
+  while ((msg = chat_msg_queue_pop(&server->messages)) != NULL) {
+    struct chat_inbox_node *node = calloc(1, sizeof(*node));
+    if (node == NULL) {
+      chat_message_delete(msg);
+      continue;
+    }
+    node->msg = msg;
+    inbox_push(server->parent, node);
+  }
+}
+
+/** Queue the lines other shards have received to this shard's peers. */
+static void drain_shard_inbox(struct chat_server *server) {
+  uint64_t count;
+  ssize_t rc = read(server->event_fd, &count, sizeof(count));
+  (void)rc;
+  struct chat_inbox_node *node = inbox_take(server);
+  while (node != NULL) {
+    struct chat_inbox_node *next = node->next;
+    struct chat_room *room = room_find(server, node->room);
+    if (room != NULL) {
+      broadcast_buffer(server, NULL, room, node->buf, node->bin_buf);
+    }
+    node->next = NULL;
+    inbox_free(node);
+    node = next;
+  }
+}
+
+static void get_in_data(struct chat_server *server, struct chat_peer *peer) {
+  while (!peer->is_paused) {
+    if (!chat_ring_reserve(&peer->in, CHAT_RECV_MIN)) {
+      close_peer(peer);
+      break;
+    }
+    struct iovec iov[2];
+    int iov_count = chat_ring_free_iov(&peer->in, iov);
+    ssize_t received = readv(peer->socket, iov, iov_count);
+    if (received > 0) {
+      server->broadcast_first = server->messages.count;
+      chat_ring_produce(&peer->in, received);
+      extract_messages(server, peer);
+      if (peer->is_closed) {
+        break;
+      }
+      /* Broadcast chunk by chunk, a slow receiver can pause the sender. */
+      broadcast(server, peer);
+    } else if (received == 0) {
+      close_peer(peer);
+      break;
+    } else if (errno != EINTR) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        close_peer(peer);
+      }
+      break;
+    }
+  }
+  if (server->parent != NULL) {
+    pass_to_parent(server);
+  }
+}
+
+/** Describe up to @a max queued references as iovecs, oldest first. */
+static size_t peer_fill_iov(const struct chat_peer *peer, struct iovec *iov,
+                            size_t max) {
+  size_t count = 0;
+  for (; count < peer->out_count && count < max; ++count) {
+    const struct chat_out_ref *ref =
+        &peer->out_refs[(peer->out_head + count) % peer->out_capacity];
+    iov[count].iov_base = ref->buf->data + ref->offset;
+    iov[count].iov_len = ref->buf->size - ref->offset;
+  }
+  return count;
+}
+
+/** Advance the output queue by @a size sent bytes. */
+static void peer_consume_sent(struct chat_peer *peer, size_t size) {
+  peer_unqueued(peer, size);
+  while (size > 0) {
+    struct chat_out_ref *ref = &peer->out_refs[peer->out_head];
+    size_t rest = ref->buf->size - ref->offset;
+    if (size < rest) {
+      ref->offset += size;
+      break;
+    }
+    size -= rest;
+    chat_buffer_unref(ref->buf);
+    peer->out_head = (peer->out_head + 1) % peer->out_capacity;
+    peer->out_count--;
+  }
+  if (peer->out_count == 0) {
+    peer_shrink_refs(peer);
+  }
+}
+
+/** Send more of the log replay. */
+static void send_replay(struct chat_peer *peer) {
+  int rc = chat_log_send(&peer->replay, peer->socket);
+  if (rc < 0) {
+    close_peer(peer);
+  } else if (rc > 0) {
+    /* Caught up, the next lines are queued live. */
+    stop_replay(peer);
+  }
+}
+
+static void send_data(struct chat_peer *peer) {
+  while (peer->out_count > 0) {
+    struct iovec iov[CHAT_SEND_IOV_MAX];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = peer_fill_iov(peer, iov, CHAT_SEND_IOV_MAX);
+    ssize_t sent = sendmsg(peer->socket, &msg, MSG_NOSIGNAL);
+    if (sent > 0) {
+      peer_consume_sent(peer, sent);
+    } else if (sent == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      } else {
+        close_peer(peer);
+        return;
+      }
+    }
+  }
+  if (peer->out_count == 0 && peer->is_replaying) {
+    send_replay(peer);
+  }
+}
+
+/**
+ * Register a freshly accepted socket as a new peer. The socket is closed on
+ * failure.
+ */
+static struct chat_peer *add_peer(struct chat_server *server, int sock) {
+  if (server->peer_count == server->peer_capacity) {
+    size_t new_capacity = server->peer_capacity * 2;
+    if (new_capacity == 0) {
+      new_capacity = 8;
+    }
+    struct chat_peer **new_peers =
+        realloc(server->peers, new_capacity * sizeof(struct chat_peer *));
+    if (new_capacity < server->peer_capacity || new_peers == NULL) {
+      close(sock);
+      return NULL;
+    }
+    server->peers = new_peers;
+    server->peer_capacity = new_capacity;
+  }
+  /*
+   * The queued lines go out batched anyway, Nagle would only delay the last
+   * one of a batch for an ACK.
+   */
+  int one = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  struct chat_peer *peer = create_peer(server, sock);
+  if (peer == NULL) {
+    close(sock);
+    return NULL;
+  }
+  if (!room_join(server, peer, NULL)) {
+    free_peer(server, peer);
+    return NULL;
+  }
+  peer->index = server->peer_count;
+  server->peers[server->peer_count++] = peer;
+  return peer;
+}
+
+/**
+ * Free the closed peers. A peer still referenced by in-flight io_uring
+ * operations stays until they complete.
+ */
+static void remove_closed_peers(struct chat_server *server) {
+  struct chat_peer *peer = server->closed_peers;
+  server->closed_peers = NULL;
+  while (peer != NULL) {
+    struct chat_peer *next = peer->next;
+    if (peer->uring_ops > 0) {
+      peer->next = server->closed_peers;
+      server->closed_peers = peer;
+      peer = next;
+      continue;
+    }
+    if (peer->is_paused) {
+      server->paused_count--;
+    }
+    if (peer->is_binary) {
+      server->binary_peer_count--;
+    }
+    room_leave(server, peer);
+    struct chat_peer *last = server->peers[--server->peer_count];
+    server->peers[peer->index] = last;
+    last->index = peer->index;
+    free_peer(server, peer);
+    peer = next;
+  }
+}
+
+/**
+ * Let the paused senders in again once no peer is over the limit.
+ * @retval true Some input was read and broadcast right away.
+ */
+static bool resume_paused(struct chat_server *server) {
+  bool has_read = false;
+  for (size_t i = 0; i < server->peer_count; ++i) {
+    /* A resumed sender may have congested someone right away. */
+    if (server->paused_count == 0 || server->congested_count > 0) {
+      break;
+    }
+    struct chat_peer *peer = server->peers[i];
+    if (!peer->is_paused) {
+      continue;
+    }
+    peer->is_paused = false;
+    server->paused_count--;
+    if (peer->is_closed) {
+      continue;
+    }
+#if CHAT_SERVER_USE_URING
+    if (server->uring != NULL) {
+      if (!peer->is_receiving) {
+        uring_arm_recv(server, peer);
+      }
+      continue;
+    }
+#endif
+    /* Edge-triggered epoll won't report the input left unread again. */
+    get_in_data(server, peer);
+    has_read = true;
+  }
+  return has_read;
+}
+
+struct chat_message *chat_server_pop_next(struct chat_server *server) {
+  if (server == NULL) {
+    return NULL;
+  }
+  return chat_msg_queue_pop(&server->messages);
+}
+
+size_t chat_server_pop_batch(struct chat_server *server,
+                             struct chat_message **msgs, size_t count) {
+  if (server == NULL) {
+    return 0;
+  }
+  return chat_msg_queue_pop_batch(&server->messages, msgs, count);
+}
+
+#if CHAT_SERVER_USE_URING
+
+enum {
+  CHAT_URING_ENTRIES = 256,
+  /* Provided receive buffers, the count has to be a power of 2. */
+  CHAT_URING_BUF_COUNT = 256,
+  CHAT_URING_BUF_SIZE = 4096,
+  CHAT_URING_BUF_GROUP = 0,
+  CHAT_URING_BR_LEN = CHAT_URING_BUF_COUNT * sizeof(struct io_uring_buf),
+};
+
+/* Kind of a request, kept in the low bits of its user_data. */
+enum chat_uring_op {
+  CHAT_URING_OP_ACCEPT,
+  CHAT_URING_OP_RECV,
+  CHAT_URING_OP_SEND,
+  CHAT_URING_OP_CANCEL,
+  CHAT_URING_OP_POLL,
+  CHAT_URING_OP_MASK = 7,
+};
+
+struct chat_uring {
+  int fd;
+  void *ring_ptr;
+  size_t ring_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  /* Provided buffer ring the multishot receives pick buffers from. */
+  struct io_uring_buf_ring *br;
+  char *bufs;
+  uint16_t br_tail;
+  /* Created disabled, enabled by the first io_uring_enter() caller. */
+  bool is_disabled;
+  bool is_accepting;
+};
+
+/** A peer's sendmsg() arguments, alive while the request is in flight. */
+struct chat_uring_send {
+  struct msghdr msg;
+  struct iovec iov[CHAT_SEND_IOV_MAX];
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags, void *arg, size_t arg_size) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      arg, arg_size);
+}
+
+static int sys_io_uring_register(int fd, unsigned op, void *arg,
+                                 unsigned count) {
+  return (int)syscall(__NR_io_uring_register, fd, op, arg, count);
+}
+
+static uint64_t uring_data(struct peer_data *pd, enum chat_uring_op op) {
+  return (uint64_t)(uintptr_t)pd | op;
+}
+
+static void uring_delete(struct chat_uring *ring) {
+  if (ring->ring_ptr != NULL) {
+    munmap(ring->ring_ptr, ring->ring_len);
+  }
+  if (ring->sqes != NULL) {
+    munmap(ring->sqes, ring->sqes_len);
+  }
+  if (ring->fd >= 0) {
+    close(ring->fd);
+  }
+  if (ring->br != NULL) {
+    munmap(ring->br, CHAT_URING_BR_LEN);
+  }
+  free(ring->bufs);
+  free(ring);
+}
+
+/** Give the buffer @a bid back to the kernel for the next receives. */
+static void uring_put_buf(struct chat_uring *ring, uint16_t bid) {
+  struct io_uring_buf *buf =
+      &ring->br->bufs[ring->br_tail & (CHAT_URING_BUF_COUNT - 1)];
+  buf->addr = (uintptr_t)(ring->bufs + (size_t)bid * CHAT_URING_BUF_SIZE);
+  buf->len = CHAT_URING_BUF_SIZE;
+  buf->bid = bid;
+  ring->br_tail++;
+  __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+static struct chat_uring *uring_new(void) {
+  struct chat_uring *ring = calloc(1, sizeof(*ring));
+  if (ring == NULL) {
+    return NULL;
+  }
+  /*
+   * Completions are better run only inside chat_server_update(). Otherwise
+   * the kernel flags the task for them and interrupts whatever else the
+   * thread is blocked in, like a client's epoll_wait() in the same thread.
+   * Older kernels get the closest supported mode. A single issuer ring
+   * belongs to the thread enabling it, so it starts disabled to let the
+   * thread calling chat_server_update() be another than the creator.
+   */
+  const unsigned setup_flags[] = {
+      IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+          IORING_SETUP_R_DISABLED,
+      IORING_SETUP_COOP_TASKRUN,
+      0,
+  };
+  struct io_uring_params p;
+  ring->fd = -1;
+  for (size_t i = 0; i < sizeof(setup_flags) / sizeof(setup_flags[0]); ++i) {
+    memset(&p, 0, sizeof(p));
+    p.flags = setup_flags[i];
+    ring->fd = sys_io_uring_setup(CHAT_URING_ENTRIES, &p);
+    if (ring->fd >= 0 || errno != EINVAL) {
+      break;
+    }
+  }
+  if (ring->fd < 0 || (p.features & IORING_FEAT_SINGLE_MMAP) == 0 ||
+      (p.features & IORING_FEAT_EXT_ARG) == 0) {
+    uring_delete(ring);
+    return NULL;
+  }
+  ring->is_disabled = (p.flags & IORING_SETUP_R_DISABLED) != 0;
+  size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ring_len = sq_len > cq_len ? sq_len : cq_len;
+  ring->ring_ptr = mmap(NULL, ring->ring_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->ring_ptr == MAP_FAILED) {
+    ring->ring_ptr = NULL;
+    uring_delete(ring);
+    return NULL;
+  }
+  ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    uring_delete(ring);
+    return NULL;
+  }
+  char *ptr = ring->ring_ptr;
+  ring->sq_head = (unsigned *)(ptr + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(ptr + p.sq_off.tail);
+  ring->sq_array = (unsigned *)(ptr + p.sq_off.array);
+  ring->sq_mask = *(unsigned *)(ptr + p.sq_off.ring_mask);
+  ring->sq_entries = p.sq_entries;
+  ring->cq_head = (unsigned *)(ptr + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(ptr + p.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(ptr + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(ptr + p.cq_off.cqes);
+
+  /* The buffer ring has to be page aligned, anonymous pages are zeroed. */
+  ring->br = mmap(NULL, CHAT_URING_BR_LEN, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring->br == MAP_FAILED) {
+    ring->br = NULL;
+    uring_delete(ring);
+    return NULL;
+  }
+  ring->bufs = malloc((size_t)CHAT_URING_BUF_COUNT * CHAT_URING_BUF_SIZE);
+  if (ring->bufs == NULL) {
+    uring_delete(ring);
+    return NULL;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t)ring->br;
+  reg.ring_entries = CHAT_URING_BUF_COUNT;
+  reg.bgid = CHAT_URING_BUF_GROUP;
+  if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    uring_delete(ring);
+    return NULL;
+  }
+  for (uint16_t bid = 0; bid < CHAT_URING_BUF_COUNT; ++bid) {
+    uring_put_buf(ring, bid);
+  }
+  return ring;
+}
+
+/**
+ * Submit the queued requests and wait for at least one completion for
+ * @a timeout seconds, a negative one means forever. Timing out is not an
+ * error, the caller just finds the completion queue empty.
+ */
+static int uring_enter(struct chat_uring *ring, bool wait, double timeout) {
+  if (ring->is_disabled) {
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_ENABLE_RINGS, NULL,
+                              0) < 0) {
+      return CHAT_ERR_SYS;
+    }
+    ring->is_disabled = false;
+  }
+  unsigned to_submit =
+      *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (!wait) {
+    if (to_submit == 0) {
+      return 0;
+    }
+    if (sys_io_uring_enter(ring->fd, to_submit, 0, 0, NULL, 0) < 0 &&
+        errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      return CHAT_ERR_SYS;
+    }
+    return 0;
+  }
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if (timeout >= 0) {
+    ts.tv_sec = (long long)timeout;
+    ts.tv_nsec = (long long)((timeout - ts.tv_sec) * 1e9);
+    arg.ts = (uintptr_t)&ts;
+  }
+  if (sys_io_uring_enter(ring->fd, to_submit, 1,
+                         IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                         sizeof(arg)) < 0 &&
+      errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+    return CHAT_ERR_SYS;
+  }
+  return 0;
+}
+
+/**
+ * Get a zeroed SQE. Without SQPOLL the kernel looks at the queue only inside
+ * io_uring_enter(), so the tail can be published before the SQE is filled.
+ */
+static struct io_uring_sqe *uring_get_sqe(struct chat_uring *ring) {
+  unsigned tail = *ring->sq_tail;
+  if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) ==
+      ring->sq_entries) {
+    uring_enter(ring, false, 0);
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) ==
+        ring->sq_entries) {
+      return NULL;
+    }
+  }
+  unsigned idx = tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[idx] = idx;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+static void uring_arm_accept(struct chat_server *server) {
+  struct io_uring_sqe *sqe = uring_get_sqe(server->uring);
+  if (sqe == NULL) {
+    return;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = server->socket;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = uring_data(server->listener_pd, CHAT_URING_OP_ACCEPT);
+  server->uring->is_accepting = true;
+}
+
+static void uring_arm_recv(struct chat_server *server, struct chat_peer *peer) {
+  struct io_uring_sqe *sqe = uring_get_sqe(server->uring);
+  if (sqe == NULL) {
+    close_peer(peer);
+    return;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = peer->socket;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = CHAT_URING_BUF_GROUP;
+  sqe->user_data = uring_data(&peer->p_data, CHAT_URING_OP_RECV);
+  peer->uring_ops++;
+  peer->is_receiving = true;
+}
+
+static void uring_send(struct chat_server *server, struct chat_peer *peer) {
+  if (peer->uring_send == NULL) {
+    peer->uring_send = malloc(sizeof(*peer->uring_send));
+    if (peer->uring_send == NULL) {
+      close_peer(peer);
+      return;
+    }
+  }
+  struct io_uring_sqe *sqe = uring_get_sqe(server->uring);
+  if (sqe == NULL) {
+    return;
+  }
+  struct chat_uring_send *op = peer->uring_send;
+  memset(&op->msg, 0, sizeof(op->msg));
+  op->msg.msg_iov = op->iov;
+  op->msg.msg_iovlen = peer_fill_iov(peer, op->iov, CHAT_SEND_IOV_MAX);
+  peer->uring_send_refs = op->msg.msg_iovlen;
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = peer->socket;
+  sqe->addr = (uintptr_t)&op->msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = uring_data(&peer->p_data, CHAT_URING_OP_SEND);
+  peer->uring_ops++;
+  peer->is_sending = true;
+}
+
+/**
+ * Send more of the log replay. The file goes to the socket with sendfile()
+ * right away, and a full socket is polled to get writable again.
+ */
+static void uring_send_replay(struct chat_server *server,
+                              struct chat_peer *peer) {
+  int rc = chat_log_send(&peer->replay, peer->socket);
+  if (rc < 0) {
+    close_peer(peer);
+    return;
+  }
+  if (rc > 0) {
+    stop_replay(peer);
+    return;
+  }
+  struct io_uring_sqe *sqe = uring_get_sqe(server->uring);
+  if (sqe == NULL) {
+    return;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = peer->socket;
+  sqe->poll32_events = POLLOUT;
+  sqe->user_data = uring_data(&peer->p_data, CHAT_URING_OP_POLL);
+  peer->uring_ops++;
+  peer->is_polling = true;
+}
+
+/** Cancel everything in flight for a closed peer so it can be freed. */
+static void uring_cancel(struct chat_server *server, struct chat_peer *peer) {
+  if (peer->uring_ops == 0 || peer->is_canceled) {
+    return;
+  }
+  struct io_uring_sqe *sqe = uring_get_sqe(server->uring);
+  if (sqe == NULL) {
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = peer->socket;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = uring_data(NULL, CHAT_URING_OP_CANCEL);
+  peer->is_canceled = true;
+}
+
+/** Stop the multishot receive of a paused peer, it is re-armed on resume. */
+static void uring_pause_recv(struct chat_server *server,
+                             struct chat_peer *peer) {
+  if (!peer->is_receiving) {
+    return;
+  }
+  struct io_uring_sqe *sqe = uring_get_sqe(server->uring);
+  if (sqe == NULL) {
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = uring_data(&peer->p_data, CHAT_URING_OP_RECV);
+  sqe->user_data = uring_data(NULL, CHAT_URING_OP_CANCEL);
+}
+
+static void uring_on_accept(struct chat_server *server,
+                            const struct io_uring_cqe *cqe) {
+  if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+    server->uring->is_accepting = false;
+  }
+  if (cqe->res < 0) {
+    return;
+  }
+  struct chat_peer *peer = add_peer(server, cqe->res);
+  if (peer != NULL) {
+    uring_arm_recv(server, peer);
+  }
+}
+
+static void uring_on_recv(struct chat_server *server, struct chat_peer *peer,
+                          const struct io_uring_cqe *cqe) {
+  struct chat_uring *ring = server->uring;
+  bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+  if (!more) {
+    peer->uring_ops--;
+    peer->is_receiving = false;
+  }
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (cqe->res > 0 && !peer->is_closed) {
+      server->broadcast_first = server->messages.count;
+      const char *data = ring->bufs + (size_t)bid * CHAT_URING_BUF_SIZE;
+      if (!chat_ring_append(&peer->in, data, cqe->res)) {
+        close_peer(peer);
+      } else {
+        extract_messages(server, peer);
+      }
+      if (!peer->is_closed) {
+        broadcast(server, peer);
+      }
+    }
+    uring_put_buf(ring, bid);
+  }
+  if (cqe->res == 0 ||
+      (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)) {
+    close_peer(peer);
+  } else if (!more && !peer->is_closed && !peer->is_paused) {
+    /*
+     * The kernel ran out of provided buffers or just ended the multishot, or
+     * the peer was paused and resumed before the cancellation completed.
+     */
+    uring_arm_recv(server, peer);
+  }
+}
+
+static void uring_on_send(struct chat_peer *peer,
+                          const struct io_uring_cqe *cqe) {
+  peer->uring_ops--;
+  peer->is_sending = false;
+  if (cqe->res > 0) {
+    peer_consume_sent(peer, cqe->res);
+  } else if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+    close_peer(peer);
+  }
+}
+
+/** The socket of a replaying peer can take more, or is broken. */
+static void uring_on_poll(struct chat_peer *peer,
+                          const struct io_uring_cqe *cqe) {
+  peer->uring_ops--;
+  peer->is_polling = false;
+  if (cqe->res < 0 && cqe->res != -ECANCELED) {
+    close_peer(peer);
+  }
+}
+
+/** Process all the completions. @retval true There were some. */
+static bool uring_reap(struct chat_server *server) {
+  struct chat_uring *ring = server->uring;
+  bool has_events = false;
+  while (true) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+    struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    has_events = true;
+    uint64_t op = cqe.user_data & CHAT_URING_OP_MASK;
+    struct peer_data *pd = (struct peer_data *)(uintptr_t)(cqe.user_data - op);
+    switch (op) {
+    case CHAT_URING_OP_ACCEPT:
+      uring_on_accept(server, &cqe);
+      break;
+    case CHAT_URING_OP_RECV:
+      uring_on_recv(server, pd->peer, &cqe);
+      break;
+    case CHAT_URING_OP_SEND:
+      uring_on_send(pd->peer, &cqe);
+      break;
+    case CHAT_URING_OP_POLL:
+      uring_on_poll(pd->peer, &cqe);
+      break;
+    default:
+      break;
+    }
+  }
+  return has_events;
+}
+
+/**
+ * Start a sendmsg() for every peer with queued data and none in flight, and
+ * continue the replays of the peers with nothing else to send.
+ */
+static void uring_flush(struct chat_server *server) {
+  for (size_t i = 0; i < server->peer_count; ++i) {
+    struct chat_peer *peer = server->peers[i];
+    if (peer->is_closed) {
+      uring_cancel(server, peer);
+    } else if (peer->is_sending || peer->is_polling) {
+      continue;
+    } else if (peer->out_count > 0) {
+      uring_send(server, peer);
+    } else if (peer->is_replaying) {
+      uring_send_replay(server, peer);
+    }
+  }
+}
+
+static int update_uring(struct chat_server *server, double timeout) {
+  if (!server->uring->is_accepting) {
+    uring_arm_accept(server);
+  }
+  uring_flush(server);
+  if (uring_enter(server->uring, true, timeout) != 0) {
+    return CHAT_ERR_SYS;
+  }
+  bool has_events = uring_reap(server);
+  remove_closed_peers(server);
+  resume_paused(server);
+  uring_flush(server);
+  if (uring_enter(server->uring, false, 0) != 0) {
+    return CHAT_ERR_SYS;
+  }
+  return has_events ? 0 : CHAT_ERR_TIMEOUT;
+}
+
+static int listen_uring(struct chat_server *server, int sock) {
+  server->uring = uring_new();
+  if (server->uring == NULL) {
+    return -1;
+  }
+  server->listener_pd = malloc(sizeof(struct peer_data));
+  if (server->listener_pd == NULL) {
+    uring_delete(server->uring);
+    server->uring = NULL;
+    return -1;
+  }
+  server->listener_pd->fd = sock;
+  server->listener_pd->peer = NULL;
+  server->listener_pd->server = server;
+  server->listener_pd->current_events = 0;
+  server->socket = sock;
+  uring_arm_accept(server);
+  return 0;
+}
+
+/**
+ * Cancel all the requests and wait for them to complete, so that the kernel
+ * does not touch the peers and buffers after they are freed.
+ */
+static void uring_stop(struct chat_server *server) {
+  struct chat_uring *ring = server->uring;
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (sqe != NULL) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = server->socket;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = uring_data(NULL, CHAT_URING_OP_CANCEL);
+  }
+  for (size_t i = 0; i < server->peer_count; ++i) {
+    close_peer(server->peers[i]);
+  }
+  for (int attempt = 0; attempt < 100; ++attempt) {
+    bool is_busy = ring->is_accepting;
+    for (size_t i = 0; i < server->peer_count; ++i) {
+      uring_cancel(server, server->peers[i]);
+      is_busy = is_busy || server->peers[i]->uring_ops > 0;
+    }
+    if (!is_busy) {
+      break;
+    }
+    /* Only the thread running the updates can drive a single issuer ring. */
+    if (uring_enter(ring, true, 0.01) != 0) {
+      break;
+    }
+    uring_reap(server);
+  }
+  uring_delete(ring);
+  server->uring = NULL;
+}
+
+#endif
+
+/** Accept all the pending connections as new peers. */
+static void accept_peers(struct chat_server *server) {
+  while (true) {
+    int client_sock = accept(server->socket, NULL, NULL);
+    if (client_sock < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      continue;
+    }
+    int flags = fcntl(client_sock, F_GETFL, 0);
+    if (flags == -1 ||
+        fcntl(client_sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+      close(client_sock);
+      continue;
+    }
+    struct chat_peer *new_peer = add_peer(server, client_sock);
+    if (new_peer == NULL) {
+      continue;
+    }
+#if CHAT_SERVER_USE_URING
+    if (server->uring != NULL) {
+      uring_arm_recv(server, new_peer);
+      continue;
+    }
+#endif
+    if (update_peer_events(&new_peer->p_data, EPOLLIN | EPOLLOUT) == false) {
+      close_peer(new_peer);
+    }
+  }
+}
+
+static int update_sharded(struct chat_server *server, double timeout) {
+  if (__atomic_load_n(&server->inbox, __ATOMIC_RELAXED) == NULL) {
+    struct pollfd pfd;
+    pfd.fd = server->event_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int rc = poll(&pfd, 1, timeout < 0 ? -1 : (int)(timeout * 1000));
+    if (rc == 0) {
+      return CHAT_ERR_TIMEOUT;
+    }
+    if (rc == -1) {
+      return errno == EINTR ? CHAT_ERR_TIMEOUT : CHAT_ERR_SYS;
+    }
+  }
+  uint64_t count;
+  ssize_t rc = read(server->event_fd, &count, sizeof(count));
+  (void)rc;
+  struct chat_inbox_node *node = inbox_take(server);
+  while (node != NULL) {
+    struct chat_inbox_node *next = node->next;
+    if (chat_msg_queue_push(&server->messages, node->msg)) {
+      node->msg = NULL;
+    }
+    node->next = NULL;
+    inbox_free(node);
+    node = next;
+  }
+  return 0;
+}
+
+int chat_server_update(struct chat_server *server, double timeout) {
+  if (server != NULL && server->shards != NULL && server->socket >= 0) {
+    return update_sharded(server, timeout);
+  }
+#if CHAT_SERVER_USE_URING
+  if (server != NULL && server->uring != NULL) {
+    return update_uring(server, timeout);
+  }
+#endif
+  if (server == NULL || server->socket < 0 || server->epoll_fd < 0) {
+    return CHAT_ERR_NOT_STARTED;
+  }
+  int epoll_timeout;
+  if (timeout < 0) {
+    epoll_timeout = -1;
+  } else {
+    epoll_timeout = (int)(timeout * 1000);
+  }
+  struct epoll_event events[30];
+  int number = epoll_wait(server->epoll_fd, events, 30, epoll_timeout);
+  if (number == 0) {
     return CHAT_ERR_TIMEOUT;
   }
   if (number == -1) {
@@ -415,69 +2048,21 @@ int chat_server_update(struct chat_server *server, double timeout) {
     if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
       current = true;
     }
+    if (pd == server->event_pd) {
+      drain_shard_inbox(server);
+      continue;
+    }
     if (peer == NULL) {
       if (current) {
         return CHAT_ERR_SYS;
       }
-      while (true) {
-        int client_sock = accept(server->socket, NULL, NULL);
-        if (client_sock < 0) {
-          if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            break;
-          }
-          continue;
-        }
-        if (server->peer_count == server->peer_capacity) {
-          size_t new_capacity = server->peer_capacity * 2;
-          if (new_capacity == 0) {
-            new_capacity = 8;
-          }
-          if (new_capacity < server->peer_capacity) {
-            close(client_sock);
-            return CHAT_ERR_SYS;
-          }
-          struct chat_peer **new_peers =
-              realloc(server->peers, new_capacity * sizeof(struct chat_peer *));
-          if (new_peers == NULL) {
-            close(client_sock);
-            return CHAT_ERR_SYS;
-          }
-          server->peers = new_peers;
-          server->peer_capacity = new_capacity;
-        }
-        int flags = fcntl(client_sock, F_GETFL, 0);
-        if (flags == -1 ||
-            fcntl(client_sock, F_SETFL, flags | O_NONBLOCK) == -1) {
-          close(client_sock);
-          continue;
-        }
-        struct chat_peer *new_peer = create_peer(client_sock);
-        if (new_peer == NULL) {
-          close(client_sock);
-          continue;
-        }
-        new_peer->p_data = malloc(sizeof(*new_peer->p_data));
-        if (new_peer->p_data == NULL) {
-          free_peer(new_peer);
-          continue;
-        }
-        new_peer->p_data->fd = client_sock;
-        new_peer->p_data->peer = new_peer;
-        new_peer->p_data->server = server;
-        new_peer->p_data->current_events = 0;
-        if (update_peer_events(new_peer->p_data, EPOLLIN | EPOLLOUT) == false) {
-          free(new_peer->p_data);
-          free_peer(new_peer);
-          continue;
-        }
-        server->peers[server->peer_count++] = new_peer;
-      }
+      accept_peers(server);
     } else {
       if (peer->is_closed) {
         continue;
       }
       if (current == true) {
-        peer->is_closed = true;
+        close_peer(peer);
       }
       if (events[i].events & EPOLLIN) {
         get_in_data(server, peer);
@@ -487,22 +2072,195 @@ int chat_server_update(struct chat_server *server, double timeout) {
       }
     }
   }
-  for (size_t j = 0; j < server->peer_count;) {
-    if (server->peers[j]->is_closed == true) {
-      free_peer(server->peers[j]);
-      memmove(&server->peers[j], &server->peers[j + 1],
-              (server->peer_count - j - 1) * sizeof(*server->peers));
-      server->peer_count--;
-    } else {
-      j++;
+  remove_closed_peers(server);
+  /*
+   * No edge is coming for the lines of resumed senders, flush them now. That
+   * ends when they are paused again or have no more input.
+   */
+  do {
+    for (size_t i = 0; i < server->peer_count; ++i) {
+      struct chat_peer *peer = server->peers[i];
+      if (peer != NULL && peer->is_closed == false &&
+          (peer->out_size > 0 || peer->is_replaying)) {
+        send_data(peer);
+      }
+    }
+  } while (resume_paused(server));
+  return 0;
+}
+
+static void *shard_thread_f(void *arg) {
+  struct chat_server *shard = arg;
+  while (!__atomic_load_n(&shard->is_stopping, __ATOMIC_ACQUIRE)) {
+    int rc = chat_server_update(shard, -1);
+    if (rc != 0 && rc != CHAT_ERR_TIMEOUT) {
+      break;
     }
   }
-  for (size_t i = 0; i < server->peer_count; ++i) {
-    struct chat_peer *peer = server->peers[i];
-    if (peer != NULL && peer->is_closed == false && peer->out_size > 0) {
-      send_data(peer);
+  return NULL;
+}
+
+static int listen_sharded(struct chat_server *server, uint16_t port) {
+  server->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (server->event_fd < 0) {
+    return CHAT_ERR_SYS;
+  }
+  server->shards = calloc(server->shard_count, sizeof(*server->shards));
+  if (server->shards == NULL) {
+    return CHAT_ERR_SYS;
+  }
+  int rc = 0;
+  for (size_t i = 0; i < server->shard_count && rc == 0; ++i) {
+    struct chat_server *shard = chat_server_new();
+    if (shard == NULL) {
+      rc = CHAT_ERR_SYS;
+      break;
+    }
+    server->shards[i] = shard;
+    shard->parent = server;
+    shard->out_limit = server->out_limit;
+    shard->overflow_policy = server->overflow_policy;
+    shard->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shard->event_fd < 0) {
+      rc = CHAT_ERR_SYS;
+      break;
+    }
+    int sock;
+    rc = open_listen_socket(port, true, &sock);
+    if (rc != 0) {
+      break;
+    }
+    if (port == 0) {
+      /* All the shards have to share the port picked for the first one. */
+      struct sockaddr_in addr;
+      socklen_t len = sizeof(addr);
+      if (getsockname(sock, (struct sockaddr *)&addr, &len) != 0) {
+        close(sock);
+        rc = CHAT_ERR_SYS;
+        break;
+      }
+      port = ntohs(addr.sin_port);
+    }
+    rc = start_reactor(shard, sock);
+  }
+  if (rc == 0) {
+    server->socket = dup(server->shards[0]->socket);
+    if (server->socket < 0) {
+      rc = CHAT_ERR_SYS;
+    }
+  }
+  for (size_t i = 0; i < server->shard_count && rc == 0; ++i) {
+    struct chat_server *shard = server->shards[i];
+    if (pthread_create(&shard->thread, NULL, shard_thread_f, shard) != 0) {
+      rc = CHAT_ERR_SYS;
+      break;
+    }
+    shard->is_running = true;
+  }
+  if (rc != 0) {
+    stop_shards(server);
+    if (server->socket >= 0) {
+      close(server->socket);
+      server->socket = -1;
+    }
+    close(server->event_fd);
+    server->event_fd = -1;
+  }
+  return rc;
+}
+
+int chat_server_set_backend(struct chat_server *server,
+                            enum chat_server_backend backend) {
+  if (server->socket >= 0) {
+    return CHAT_ERR_ALREADY_STARTED;
+  }
+#if !CHAT_SERVER_USE_URING
+  if (backend == CHAT_SERVER_BACKEND_IO_URING) {
+    return CHAT_ERR_NOT_IMPLEMENTED;
+  }
+#endif
+  server->backend = backend;
+  return 0;
+}
+
+int chat_server_set_log(struct chat_server *server, const char *dir,
+                        size_t segment_size, uint64_t max_bytes,
+                        double max_age) {
+  if (server->socket >= 0) {
+    return CHAT_ERR_ALREADY_STARTED;
+  }
+  if (dir == NULL || segment_size == 0) {
+    return CHAT_ERR_INVALID_ARGUMENT;
+  }
+  struct chat_log *log = chat_log_open(dir, segment_size, max_bytes, max_age);
+  if (log == NULL) {
+    return CHAT_ERR_SYS;
+  }
+  chat_log_close(server->log);
+  server->log = log;
+  return 0;
+}
+
+int chat_server_set_out_limit(struct chat_server *server, size_t limit,
+                              enum chat_overflow_policy policy) {
+  if (server->socket >= 0) {
+    return CHAT_ERR_ALREADY_STARTED;
+  }
+  if (policy != CHAT_OVERFLOW_DISCONNECT &&
+      policy != CHAT_OVERFLOW_DROP_OLDEST &&
+      policy != CHAT_OVERFLOW_PAUSE_SENDER) {
+    return CHAT_ERR_INVALID_ARGUMENT;
+  }
+  server->out_limit = limit;
+  server->overflow_policy = policy;
+  return 0;
+}
+
+static void stats_add_from(struct chat_server_stats *sum,
+                           const struct chat_server *server) {
+  const struct chat_server_stats *stats = &server->stats;
+  sum->queued_bytes += __atomic_load_n(&stats->queued_bytes, __ATOMIC_RELAXED);
+  sum->dropped_messages +=
+      __atomic_load_n(&stats->dropped_messages, __ATOMIC_RELAXED);
+  sum->dropped_bytes += __atomic_load_n(&stats->dropped_bytes, __ATOMIC_RELAXED);
+  sum->overflow_disconnects +=
+      __atomic_load_n(&stats->overflow_disconnects, __ATOMIC_RELAXED);
+  sum->sender_pauses += __atomic_load_n(&stats->sender_pauses, __ATOMIC_RELAXED);
+}
+
+void chat_server_get_stats(const struct chat_server *server,
+                           struct chat_server_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  stats_add_from(stats, server);
+  for (size_t i = 0; server->shards != NULL && i < server->shard_count; ++i) {
+    if (server->shards[i] != NULL) {
+      stats_add_from(stats, server->shards[i]);
     }
   }
+}
+
+int chat_server_get_peer_stats(const struct chat_server *server, size_t index,
+                               struct chat_peer_stats *stats) {
+  if (server->shards != NULL) {
+    return CHAT_ERR_NOT_IMPLEMENTED;
+  }
+  if (index >= server->peer_count) {
+    return CHAT_ERR_INVALID_ARGUMENT;
+  }
+  const struct chat_peer *peer = server->peers[index];
+  stats->socket = peer->socket;
+  stats->queued_bytes = peer->out_size;
+  stats->dropped_messages = peer->dropped_messages;
+  stats->dropped_bytes = peer->dropped_bytes;
+  stats->is_paused = peer->is_paused;
+  return 0;
+}
+
+int chat_server_set_shard_count(struct chat_server *server, uint32_t count) {
+  if (server->socket >= 0) {
+    return CHAT_ERR_ALREADY_STARTED;
+  }
+  server->shard_count = count;
   return 0;
 }
 
@@ -513,7 +2271,7 @@ int chat_server_get_events(const struct chat_server *server) {
   int events = CHAT_EVENT_INPUT;
   for (size_t i = 0; i < server->peer_count; i++) {
     if (server->peers[i] != NULL && server->peers[i]->is_closed == false &&
-        server->peers[i]->out_size > 0) {
+        (server->peers[i]->out_size > 0 || server->peers[i]->is_replaying)) {
       events |= CHAT_EVENT_OUTPUT;
       break;
     }
@@ -522,36 +2280,109 @@ int chat_server_get_events(const struct chat_server *server) {
 }
 
 int chat_server_get_descriptor(const struct chat_server *server) {
-#if NEED_SERVER_FEED
-  /* IMPLEMENT THIS FUNCTION if want +5 points. */
-
-  /*
-   * Server has multiple sockets - own and from connected clients. Hence
-   * you can't return a socket here. But if you are using epoll/kqueue,
-   * then you can return their descriptor. These descriptors can be polled
-   * just like sockets and will return an event when any of their owned
-   * descriptors has any events.
-   *
-   * For example, assume you created an epoll descriptor and added to
-   * there a listen-socket and a few client-sockets. Now if you will call
-   * poll() on the epoll's descriptor, then on return from poll() you can
-   * be sure epoll_wait() can return something useful for some of those
-   * sockets.
-   */
+  if (server->shards != NULL) {
+    return server->event_fd;
+  }
+#if CHAT_SERVER_USE_URING
+  if (server->uring != NULL) {
+    return server->uring->fd;
+  }
 #endif
-  (void)server;
-  return -1;
+  return server->epoll_fd;
+}
+
+/** Apply a room command of the feed. @retval false Out of memory. */
+static bool feed_room_command(struct chat_server *server,
+                              enum peer_command command, const char *name) {
+  char *room = NULL;
+  if (command == PEER_COMMAND_JOIN && (room = strdup(name)) == NULL) {
+    return false;
+  }
+  free(server->feed_room);
+  server->feed_room = room;
+  return true;
+}
+
+/** Deliver a fed line to the feed's room on this server or on its shards. */
+static bool feed_line(struct chat_server *server, const char *data,
+                      size_t size) {
+  struct chat_buffer *line;
+  struct chat_buffer *frame;
+  if (!make_buffers(server, data, size, &line, &frame)) {
+    return false;
+  }
+  if (server->shards != NULL) {
+    forward_to_shards(server, NULL, server->feed_room, line, frame);
+  } else {
+    struct chat_room *room = room_find(server, server->feed_room);
+    if (room != NULL) {
+      log_line(server, room, line);
+      broadcast_buffer(server, NULL, room, line, frame);
+    }
+  }
+  unref_buffers(line, frame);
+  return true;
 }
 
 int chat_server_feed(struct chat_server *server, const char *msg,
                      uint32_t msg_size) {
-#if NEED_SERVER_FEED
-  /* IMPLEMENT THIS FUNCTION if want +5 points. */
-#endif
-  (void)server;
-  (void)msg;
-  (void)msg_size;
-  return CHAT_ERR_NOT_IMPLEMENTED;
+  if (server->socket < 0) {
+    return CHAT_ERR_NOT_STARTED;
+  }
+  if (!chat_ring_append(&server->feed, msg, msg_size)) {
+    return CHAT_ERR_SYS;
+  }
+  /* The clients which have already connected get the lines too. */
+  if (server->shards == NULL) {
+    accept_peers(server);
+  }
+  struct chat_span spans[CHAT_RING_SPLIT_BATCH];
+  size_t count;
+  do {
+    size_t end;
+    count = chat_ring_split_lines(&server->feed, server->feed_scanned, spans,
+                                  CHAT_RING_SPLIT_BATCH, &end);
+    for (size_t i = 0; i < count; ++i) {
+      size_t len = spans[i].size;
+      if (len == 0 || chat_ring_at(&server->feed, spans[i].start) == '\0') {
+        continue;
+      }
+      char *data = malloc(len + 1);
+      if (data == NULL) {
+        return CHAT_ERR_SYS;
+      }
+      chat_ring_copy(&server->feed, spans[i].start, data, len);
+      data[len] = '\0';
+      const char *name = NULL;
+      enum peer_command command = parse_command(data, len, &name);
+      bool ok = true;
+      if (command == PEER_COMMAND_NONE) {
+        ok = feed_line(server, data, len);
+      } else if (command != PEER_COMMAND_RESUME) {
+        ok = feed_room_command(server, command, name);
+      }
+      free(data);
+      if (!ok) {
+        return CHAT_ERR_SYS;
+      }
+    }
+    chat_ring_consume(&server->feed, end);
+    server->feed_scanned = 0;
+  } while (count == CHAT_RING_SPLIT_BATCH);
+  server->feed_scanned = chat_ring_size(&server->feed);
+  /*
+   * Epoll has no edge coming for the queued data, so try to send it now. The
+   * io_uring backend sends it on the next update.
+   */
+  if (server->epoll_fd >= 0 && server->shards == NULL) {
+    for (size_t i = 0; i < server->peer_count; ++i) {
+      struct chat_peer *peer = server->peers[i];
+      if (!peer->is_closed && (peer->out_size > 0 || peer->is_replaying)) {
+        send_data(peer);
+      }
+    }
+  }
+  return 0;
 }
 
 int chat_server_get_socket(const struct chat_server *server) {
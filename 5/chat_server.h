@@ -1,11 +1,14 @@
 #pragma once
 
 #include "chat.h"
+#include "chat_log.h"
+#include "chat_ring.h"
 
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -21,32 +24,262 @@ struct peer_data {
   uint32_t current_events;
 };
 
+/**
+ * Immutable line of a broadcast, '\n' included. It is allocated once per
+ * message and shared by the output queues of all the recipients. The last
+ * recipient to send it frees it.
+ */
+struct chat_buffer {
+  size_t refs;
+  size_t size;
+  char data[];
+};
+
+/** Position of a peer in a shared buffer still to be sent. */
+struct chat_out_ref {
+  struct chat_buffer *buf;
+  size_t offset;
+};
+
+/**
+ * Cross-thread hand-off in the sharded mode. A shard gets the lines other
+ * shards have received in @a buf and @a bin_buf, encoded for text and binary
+ * peers, to deliver to the members of @a room, NULL for the lobby. The main
+ * server gets the messages to pop in @a msg.
+ */
+struct chat_inbox_node {
+  struct chat_inbox_node *next;
+  struct chat_buffer *buf;
+  struct chat_buffer *bin_buf;
+  char *room;
+  struct chat_message *msg;
+};
+
+/**
+ * Peers talking to each other. A message goes only to the other members of
+ * its sender's room, so the fan-out cost does not depend on the total number
+ * of peers.
+ */
+struct chat_room {
+  /* NULL for the lobby. */
+  char *name;
+  /* Each member knows its index here, so leaving is O(1). */
+  struct chat_peer **members;
+  size_t member_count;
+  size_t member_capacity;
+};
+
+struct chat_uring_send;
+
+enum {
+  /* Input bytes and output references a peer holds without the heap. */
+  CHAT_PEER_INLINE_IN = 1024,
+  CHAT_PEER_INLINE_REFS = 8,
+};
+
+/**
+ * A peer is carved out of the server's slab together with the small buffers
+ * of a quiet connection, so accepting one usually takes no malloc(). Only a
+ * large backlog spills to the heap, and goes back in when it drains.
+ */
 struct chat_peer {
   int socket;
   char *name;
-  char *partial_in;
-  size_t partial_size;
-  size_t partial_capacity;
-  char *out_buffer;
-  size_t out_size;
+  struct chat_ring in;
+  /* Prefix of the input already known to have no newline. */
+  size_t in_scanned;
+  /*
+   * Ring of references, flushed with one sendmsg() per batch. It is
+   * out_inline unless it grew bigger.
+   */
+  struct chat_out_ref *out_refs;
+  size_t out_head;
+  size_t out_count;
   size_t out_capacity;
-  struct peer_data *p_data;
+  /* Total unsent bytes in all the queued references. */
+  size_t out_size;
+  struct peer_data p_data;
+  /* Index in the server's peer array. */
+  size_t index;
+  /* Link in the server's list of closed peers, or of free slab slots. */
+  struct chat_peer *next;
   bool is_closed;
+  /* Overflow handling, see chat_server_set_out_limit(). */
+  uint64_t dropped_messages;
+  uint64_t dropped_bytes;
+  /* Protocol is found out from the first bytes of the peer. */
+  bool is_protocol_known;
+  bool is_binary;
+  /* Not read from until the congested peers catch up. */
+  bool is_paused;
+  /* The queue went over the limit and still holds the paused senders. */
+  bool is_congested;
+  /* io_uring backend: requests the kernel still holds the peer by. */
+  unsigned uring_ops;
+  struct chat_uring_send *uring_send;
+  /* References handed to the in-flight sendmsg(). */
+  size_t uring_send_refs;
+  bool is_sending;
+  bool is_receiving;
+  bool is_canceled;
+  /* Room the peer talks in and its index among the members. */
+  struct chat_room *room;
+  size_t room_index;
+  /*
+   * Replay of the log asked by "/resume". The live lines are not queued
+   * meanwhile, the replay reaches them in the log.
+   */
+  bool is_replaying;
+  struct chat_log_cursor replay;
+  /* io_uring backend: waiting for the socket to take more of the replay. */
+  bool is_polling;
+  struct chat_out_ref out_inline[CHAT_PEER_INLINE_REFS];
+  char in_inline[CHAT_PEER_INLINE_IN];
+};
+
+enum {
+  /* Peers allocated at once when the slab runs out of free ones. */
+  CHAT_PEER_SLAB_CHUNK = 64,
+};
+
+/** Block of the peer slab. */
+struct chat_peer_chunk {
+  struct chat_peer_chunk *next;
+  struct chat_peer peers[CHAT_PEER_SLAB_CHUNK];
 };
 
+/** What to do when a peer's output queue is about to outgrow the limit. */
+enum chat_overflow_policy {
+  /* Close the slow peer. */
+  CHAT_OVERFLOW_DISCONNECT,
+  /* Drop the slow peer's oldest messages which sending hasn't started. */
+  CHAT_OVERFLOW_DROP_OLDEST,
+  /* Stop reading from the senders until the slow peers catch up. */
+  CHAT_OVERFLOW_PAUSE_SENDER,
+};
+
+struct chat_server_stats {
+  /* Bytes queued for sending to all the peers. */
+  uint64_t queued_bytes;
+  /* Messages and bytes not delivered to some peer due to the limit. */
+  uint64_t dropped_messages;
+  uint64_t dropped_bytes;
+  /* Peers closed due to the limit. */
+  uint64_t overflow_disconnects;
+  /* Times a sender was paused. */
+  uint64_t sender_pauses;
+};
+
+struct chat_peer_stats {
+  int socket;
+  /* Bytes queued for sending to the peer. */
+  size_t queued_bytes;
+  uint64_t dropped_messages;
+  uint64_t dropped_bytes;
+  bool is_paused;
+};
+
+enum chat_server_backend {
+  CHAT_SERVER_BACKEND_EPOLL,
+  CHAT_SERVER_BACKEND_IO_URING,
+};
+
+struct chat_uring;
+
 struct chat_server {
   int socket;
   int epoll_fd;
   struct peer_data *listener_pd;
+  /*
+   * Live peers in no particular order. Each knows its index, so removing one
+   * moves the last one into its place. The closed ones are also listed to be
+   * found without a scan.
+   */
   struct chat_peer **peers;
   size_t peer_count;
   size_t peer_capacity;
+  struct chat_peer *closed_peers;
+  /* Slab of the peers, the freed ones are reused. */
+  struct chat_peer_chunk *peer_chunks;
+  struct chat_peer *free_peers;
+  /* Peers which negotiated the binary protocol. */
+  size_t binary_peer_count;
+
+  /* Every peer starts in the lobby and can move to a named room. */
+  struct chat_room lobby;
+  /*
+   * Open addressing hash table of the named rooms, the capacity is a power of
+   * 2. A room is freed when its last member leaves.
+   */
+  struct chat_room **rooms;
+  size_t room_capacity;
+  size_t room_count;
+
+  struct chat_msg_queue messages;
+  /* Received messages from this index on are not broadcast yet. */
+  size_t broadcast_first;
+  /*
+   * Lines given to chat_server_feed() and the room they go to, NULL for the
+   * lobby.
+   */
+  struct chat_ring feed;
+  size_t feed_scanned;
+  char *feed_room;
+
+  /*
+   * Sharded mode. The main server owns the shards and only collects their
+   * messages, each shard is a server of its own run by a reactor thread.
+   */
+  struct chat_server *parent;
+  struct chat_server **shards;
+  size_t shard_count;
+  /* Lock-free stack of chat_inbox_node, event_fd signals it got non-empty. */
+  struct chat_inbox_node *inbox;
+  int event_fd;
+  struct peer_data *event_pd;
+  pthread_t thread;
+  bool is_running;
+  bool is_stopping;
 
-  struct chat_message *messages;
-  size_t msg_count;
-  size_t msg_capacity;
+  enum chat_server_backend backend;
+  struct chat_uring *uring;
+
+  /* Lines of the lobby kept on disk, NULL if not logged. */
+  struct chat_log *log;
+
+  /* Per-peer output limit in bytes, 0 is no limit. */
+  size_t out_limit;
+  enum chat_overflow_policy overflow_policy;
+  /* The paused senders resume when no peer is congested. */
+  size_t congested_count;
+  size_t paused_count;
+  /* Updated only by the server's own thread, read by anyone atomically. */
+  struct chat_server_stats stats;
 };
 
+/**
+ * Rooms. A peer sending the line "/join <name>" moves to the room with that
+ * name, created on demand, and "/leave" moves it back to the lobby, where
+ * every peer starts. Binary peers send the same commands as frames. The
+ * commands are neither broadcast nor returned by chat_server_pop_next(). Any
+ * other message goes to the other members of the sender's room only, while
+ * the server still gets all the messages of all the rooms. Rooms span all the
+ * reactor threads of a sharded server.
+ */
+#define CHAT_ROOM_JOIN "/join "
+#define CHAT_ROOM_LEAVE "/leave"
+
+/**
+ * Replay. With the log on, a text peer sending "/resume <seq>" gets the
+ * lobby's lines from the one with that sequence number on, streamed from the
+ * log, and then the live ones. The numbers count the lines from the start of
+ * the log, so a client keeping count of the lines it got since its resume
+ * knows where to resume from after a reconnect. The peer moves to the lobby,
+ * and whatever it has queued and not started to send yet is dropped in favor
+ * of the replay. Without the log it is an ordinary message.
+ */
+#define CHAT_LOG_RESUME "/resume "
+
 /**
  * Create a new chat server. No bind, no listen, just allocate and
  * initialize it.
@@ -56,6 +289,117 @@ struct chat_server *chat_server_new(void);
 /** Free all server's resources. */
 void chat_server_delete(struct chat_server *server);
 
+/**
+ * Choose how the server waits for and does I/O. The default is epoll, or the
+ * one named by the CHAT_SERVER_BACKEND environment variable ("epoll" or
+ * "io_uring"). The io_uring backend uses multishot accept, multishot receive
+ * into a provided buffer ring and sendmsg requests batched per update. When
+ * the kernel refuses io_uring, chat_server_listen() falls back to epoll.
+ * Shards of the sharded mode always use epoll. Has to be called before
+ * chat_server_listen().
+ *
+ * @param server Chat server.
+ * @param backend Backend to use.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - the backend is not built in.
+ */
+int chat_server_set_backend(struct chat_server *server,
+                            enum chat_server_backend backend);
+
+/**
+ * Serve the clients with @a count reactor threads instead of the caller's one.
+ * Each thread has its own epoll and its own listening socket bound to the same
+ * port with SO_REUSEPORT, so the kernel spreads new connections over them.
+ * Lines are broadcast across the threads via lock-free per-thread inboxes, and
+ * chat_server_update() only waits for the messages to pop. Has to be called
+ * before chat_server_listen(). 0 and 1 mean the single-threaded mode.
+ *
+ * @param server Chat server.
+ * @param count Number of reactor threads.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int chat_server_set_shard_count(struct chat_server *server, uint32_t count);
+
+/**
+ * Bound the bytes queued for sending to each peer. When a message doesn't fit
+ * into a peer's queue, @a policy decides:
+ * - CHAT_OVERFLOW_DISCONNECT closes the peer;
+ * - CHAT_OVERFLOW_DROP_OLDEST drops the peer's oldest queued messages to make
+ *   room, or the new one if it can't fit anyway. A message which has started
+ *   to be sent is never dropped;
+ * - CHAT_OVERFLOW_PAUSE_SENDER queues the message, but stops reading from its
+ *   sender until every peer over the limit drains down to half of it. The
+ *   limit is soft then: lines already read from a sender are still queued.
+ *   In the sharded mode messages of other threads' peers are dropped like
+ *   with CHAT_OVERFLOW_DROP_OLDEST, their senders can't be paused.
+ * Has to be called before chat_server_listen().
+ *
+ * @param server Chat server.
+ * @param limit Max bytes queued per peer, 0 means no limit (the default).
+ * @param policy What to do on overflow.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_INVALID_ARGUMENT - unknown policy.
+ */
+int chat_server_set_out_limit(struct chat_server *server, size_t limit,
+                              enum chat_overflow_policy policy);
+
+/**
+ * Keep the lines broadcast to the lobby in an on-disk log in @a dir for the
+ * peers to resume from, see CHAT_LOG_RESUME. The log is split into segment
+ * files of about @a segment_size bytes. The oldest segments are deleted while
+ * the log is over @a max_bytes or they are older than @a max_age seconds, 0
+ * means no limit. An existing log in @a dir is continued. Not supported in
+ * the sharded mode. Has to be called before chat_server_listen().
+ *
+ * @param server Chat server.
+ * @param dir Directory of the log, created if missing.
+ * @param segment_size Size of a segment file.
+ * @param max_bytes Max total size of the log.
+ * @param max_age Max age of a segment in seconds.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_INVALID_ARGUMENT - no directory or a zero segment size.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int chat_server_set_log(struct chat_server *server, const char *dir,
+                        size_t segment_size, uint64_t max_bytes,
+                        double max_age);
+
+/**
+ * Get the output queue and overflow counters, summed over all the reactor
+ * threads in the sharded mode.
+ */
+void chat_server_get_stats(const struct chat_server *server,
+                           struct chat_server_stats *stats);
+
+/**
+ * Get the output queue counters of one peer. Peers are numbered from 0 in an
+ * unspecified order which changes when peers come and go.
+ *
+ * @param server Chat server.
+ * @param index Peer number.
+ * @param stats Where to store the counters.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - no peer with such a number.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - the server is sharded, its peers belong to
+ *       other threads.
+ */
+int chat_server_get_peer_stats(const struct chat_server *server, size_t index,
+                               struct chat_peer_stats *stats);
+
 /**
  * Try to listen for new clients on the given port.
  *
@@ -66,6 +410,7 @@ void chat_server_delete(struct chat_server *server);
  * @retval !=0 Error code.
  *     - CHAT_ERR_PORT_BUSY - the port is already busy.
  *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - the log is on in the sharded mode.
  *     - CHAT_ERR_SYS - a system error, check errno.
  */
 int chat_server_listen(struct chat_server *server, uint16_t port);
@@ -81,6 +426,19 @@ int chat_server_listen(struct chat_server *server, uint16_t port);
  */
 struct chat_message *chat_server_pop_next(struct chat_server *server);
 
+/**
+ * Pop up to @a count next pending chat messages at once. Each of them has
+ * to be freed using chat_message_delete().
+ *
+ * @param server Chat server.
+ * @param msgs Array to store the messages to.
+ * @param count Size of @a msgs.
+ *
+ * @return Number of the messages popped, 0 when there are none yet.
+ */
+size_t chat_server_pop_batch(struct chat_server *server,
+                             struct chat_message **msgs, size_t count);
+
 /**
  * Wait for any update on any of the sockets for the given timeout
  * and do this update.
@@ -125,7 +483,11 @@ int chat_server_get_socket(const struct chat_server *server);
 int chat_server_get_events(const struct chat_server *server);
 
 /**
- * Feed a message to the server to broadcast to all clients.
+ * Feed a message to the server to broadcast to all clients. Like the clients'
+ * input it is split into lines, an unfinished line stays buffered until its
+ * newline comes. The lines go to the lobby until the feed itself has the
+ * "/join <name>" command, then to that room until "/leave". A "/resume" line
+ * is ignored, the feed has nothing to replay to.
  *
  * @param server Chat server.
  * @param msg Message.
@@ -133,8 +495,8 @@ int chat_server_get_events(const struct chat_server *server);
  *
  * @retval 0 Success.
  * @retval !=0 Error code.
- *     - CHAT_ERR_NOT_IMPLEMENTED - not implemented.
  *     - CHAT_ERR_NOT_STARTED - the server is not listening yet.
+ *     - CHAT_ERR_SYS - a system error, check errno.
  */
 int chat_server_feed(struct chat_server *server, const char *msg,
                      uint32_t msg_size);
@@ -1,10 +1,14 @@
 #include "chat.h"
 #include "chat_server.h"
 
+#include <assert.h>
 #include <errno.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 static int port_from_str(const char *str, uint16_t *port) {
   errno = 0;
@@ -22,7 +26,8 @@ static int port_from_str(const char *str, uint16_t *port) {
 
 int main(int argc, char **argv) {
   if (argc < 2) {
-    printf("Expected a port to listen on\n");
+    printf("Expected a port to listen on and optionally a thread count and "
+           "a log directory\n");
     return -1;
   }
   uint16_t port = 0;
@@ -31,7 +36,22 @@ int main(int argc, char **argv) {
     printf("Invalid port\n");
     return -1;
   }
+  uint16_t threads = 1;
+  if (argc > 2 && (port_from_str(argv[2], &threads) != 0 || threads == 0)) {
+    printf("Invalid thread count\n");
+    return -1;
+  }
   struct chat_server *serv = chat_server_new();
+  chat_server_set_shard_count(serv, threads);
+  if (argc > 3) {
+    /* Segments of 1MB, the oldest are dropped past 64MB or a day. */
+    rc = chat_server_set_log(serv, argv[3], 1 << 20, 64 << 20, 86400);
+    if (rc != 0) {
+      printf("Couldn't open the log: %d\n", rc);
+      chat_server_delete(serv);
+      return -1;
+    }
+  }
   rc = chat_server_listen(serv, port);
   if (rc != 0) {
     printf("Couldn't listen: %d\n", rc);
@@ -40,10 +60,63 @@ int main(int argc, char **argv) {
   }
 #if NEED_SERVER_FEED
   /*
-   * If want +5 points, then do similarly to the client_exe - create 2
-   * pollfd objects, wait on STDIN_FILENO and on
-   * chat_server_get_descriptor(), process events, etc.
+   * Lines typed into the standard input are fed to the clients, "/join room"
+   * and "/leave" choose where they go.
    */
+  struct pollfd poll_fds[2];
+  memset(poll_fds, 0, sizeof(poll_fds));
+
+  struct pollfd *poll_input = &poll_fds[0];
+  poll_input->fd = STDIN_FILENO;
+  poll_input->events = POLLIN;
+
+  struct pollfd *poll_server = &poll_fds[1];
+  poll_server->fd = chat_server_get_descriptor(serv);
+  assert(poll_server->fd >= 0);
+  poll_server->events = POLLIN;
+
+  const int buf_size = 1024;
+  char buf[buf_size];
+  while (true) {
+    /*
+     * The server's descriptor only tells that something happened, the update
+     * does whatever is ready. It goes first, because it is what submits the
+     * requests of the io_uring backend.
+     */
+    int rc = chat_server_update(serv, 0);
+    if (rc != 0 && rc != CHAT_ERR_TIMEOUT) {
+      printf("Update error: %d\n", rc);
+      break;
+    }
+    /* Flush all the pending messages to the standard output. */
+    struct chat_message *msg;
+    while ((msg = chat_server_pop_next(serv)) != NULL) {
+#if NEED_AUTHOR
+      printf("%s: %s\n", msg->author, msg->data);
+#else
+      printf("%s\n", msg->data);
+#endif
+      chat_message_delete(msg);
+    }
+    rc = poll(poll_fds, 2, -1);
+    if (rc < 0) {
+      printf("Poll error: %d\n", errno);
+      break;
+    }
+    if (poll_input->revents != 0) {
+      poll_input->revents = 0;
+      rc = read(STDIN_FILENO, buf, buf_size);
+      if (rc == 0) {
+        printf("EOF - exiting\n");
+        break;
+      }
+      if (rc > 0 && (rc = chat_server_feed(serv, buf, rc)) != 0) {
+        printf("Feed error: %d\n", rc);
+        break;
+      }
+    }
+    poll_server->revents = 0;
+  }
 #else
   /*
    * The basic implementation without server messages. Just serving
@@ -4,9 +4,12 @@
 #include "unit.h"
 
 #include <arpa/inet.h>
+#include <dirent.h>
 #include <pthread.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
 enum {
   TEST_MSG_ID_LEN = 64,
@@ -502,6 +505,606 @@ static void test_stress(void) {
   unit_test_finish();
 }
 
+static void test_sharded(void) {
+  unit_test_start();
+
+  struct chat_server *s = chat_server_new();
+  unit_check(chat_server_set_shard_count(s, 3) == 0, "set shards");
+  unit_fail_if(chat_server_listen(s, 0) != 0);
+  unit_check(chat_server_set_shard_count(s, 2) == CHAT_ERR_ALREADY_STARTED,
+             "no resharding after listen");
+  uint16_t port = server_get_port(s);
+  enum { client_count = 6 };
+  struct chat_client *clis[client_count];
+  struct chat_message *msg;
+
+  /* A message is popped only after its connection was accepted by a shard. */
+  for (int i = 0; i < client_count; ++i) {
+    clis[i] = chat_client_new("cli");
+    unit_fail_if(chat_client_connect(clis[i], make_addr_str(port)) != 0);
+    unit_fail_if(chat_client_feed(clis[i], "join\n", 5) != 0);
+    msg = server_pop_next_blocking_from(s, clis[i]);
+    unit_fail_if(strcmp(msg->data, "join") != 0);
+    chat_message_delete(msg);
+  }
+  char data[64];
+  for (int i = 0; i < client_count; ++i) {
+    int len = sprintf(data, "msg_%d\n", i);
+    unit_fail_if(chat_client_feed(clis[i], data, len) != 0);
+    chat_client_update(clis[i], 0);
+  }
+  int popped = 0;
+  while (popped < client_count) {
+    msg = server_pop_next_blocking_from(s, clis[0]);
+    unit_fail_if(strncmp(msg->data, "msg_", 4) != 0);
+    chat_message_delete(msg);
+    ++popped;
+  }
+  unit_check(popped == client_count, "server got all");
+  bool ok = true;
+  for (int i = 0; i < client_count; ++i) {
+    int got = 0;
+    while (got < client_count - 1) {
+      msg = client_pop_next_blocking(clis[i], s);
+      if (strcmp(msg->data, "join") != 0) {
+        int from = -1;
+        ok = ok && sscanf(msg->data, "msg_%d", &from) == 1 && from != i;
+        ++got;
+      }
+      chat_message_delete(msg);
+    }
+  }
+  unit_check(ok, "clients of all shards got the others' messages");
+  for (int i = 0; i < client_count; ++i) {
+    chat_client_delete(clis[i]);
+  }
+  chat_server_delete(s);
+
+  unit_test_finish();
+}
+
+static void test_io_uring(void) {
+  unit_test_start();
+
+  /* Falls back to epoll where io_uring is unavailable, the API is the same. */
+  struct chat_server *s = chat_server_new();
+  int rc = chat_server_set_backend(s, CHAT_SERVER_BACKEND_IO_URING);
+  unit_check(rc == 0 || rc == CHAT_ERR_NOT_IMPLEMENTED, "set backend");
+  unit_fail_if(chat_server_listen(s, 0) != 0);
+  unit_check(chat_server_set_backend(s, CHAT_SERVER_BACKEND_EPOLL) ==
+             CHAT_ERR_ALREADY_STARTED, "no backend change after listen");
+  uint16_t port = server_get_port(s);
+  struct chat_client *c1 = chat_client_new("c1");
+  struct chat_client *c2 = chat_client_new("c2");
+  unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+  unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+  unit_fail_if(chat_client_feed(c2, "hi\n", 3) != 0);
+  struct chat_message *msg = server_pop_next_blocking_from(s, c2);
+  chat_message_delete(msg);
+
+  unit_fail_if(chat_client_feed(c1, "one\ntwo\n", 8) != 0);
+  chat_client_update(c1, 0);
+  msg = client_pop_next_blocking(c2, s);
+  unit_check(strcmp(msg->data, "one") == 0, "first message");
+  chat_message_delete(msg);
+  msg = client_pop_next_blocking(c2, s);
+  unit_check(strcmp(msg->data, "two") == 0, "second message");
+  chat_message_delete(msg);
+  msg = client_pop_next_blocking(c1, s);
+  unit_check(strcmp(msg->data, "hi") == 0, "message from the other client");
+  chat_message_delete(msg);
+
+  chat_client_delete(c1);
+  chat_client_delete(c2);
+  chat_server_delete(s);
+
+  unit_test_finish();
+}
+
+static void test_out_limit_policy(enum chat_overflow_policy policy) {
+  struct chat_server *s = chat_server_new();
+  unit_fail_if(chat_server_set_out_limit(s, 1000, policy) != 0);
+  unit_fail_if(chat_server_listen(s, 0) != 0);
+  uint16_t port = server_get_port(s);
+  struct chat_client *c1 = chat_client_new("c1");
+  struct chat_client *c2 = chat_client_new("c2");
+  unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+  unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+  unit_fail_if(chat_client_feed(c2, "hi\n", 3) != 0);
+  chat_message_delete(server_pop_next_blocking_from(s, c2));
+  chat_message_delete(client_pop_next_blocking(c1, s));
+
+  /* Much more than the limit at once, c2 can't read it in time. */
+  enum { count = 100 };
+  char line[128];
+  for (int i = 0; i < count; ++i) {
+    int len = sprintf(line, "msg_%03d_%090d\n", i, 0);
+    unit_fail_if(chat_client_feed(c1, line, len) != 0);
+  }
+  int popped = 0;
+  while (popped < count) {
+    chat_message_delete(server_pop_next_blocking_from(s, c1));
+    ++popped;
+  }
+  struct chat_server_stats stats;
+  chat_server_get_stats(s, &stats);
+  if (policy == CHAT_OVERFLOW_DISCONNECT) {
+    unit_check(stats.overflow_disconnects == 1, "slow peer disconnected");
+    /* The slow peer goes away, an io_uring server waits for its requests. */
+    struct chat_peer_stats peer_stats;
+    while (chat_server_get_peer_stats(s, 1, &peer_stats) == 0) {
+      chat_server_update(s, 0.01);
+    }
+    unit_check(chat_server_get_peer_stats(s, 0, &peer_stats) == 0 &&
+               peer_stats.queued_bytes == 0, "the other peer stays");
+  } else {
+    int got = 0;
+    int last = -1;
+    bool is_ordered = true;
+    while (last != count - 1) {
+      struct chat_message *msg = client_pop_next_blocking(c2, s);
+      int n = -1;
+      is_ordered = is_ordered && sscanf(msg->data, "msg_%d", &n) == 1 &&
+                   n > last;
+      last = n;
+      ++got;
+      chat_message_delete(msg);
+    }
+    unit_check(is_ordered, "messages in order");
+    chat_server_get_stats(s, &stats);
+    if (policy == CHAT_OVERFLOW_DROP_OLDEST) {
+      unit_check(stats.dropped_messages > 0 &&
+                 got + stats.dropped_messages == count,
+                 "old messages dropped, the rest delivered");
+      uint64_t peer_drops = 0;
+      struct chat_peer_stats peer_stats;
+      for (size_t i = 0; chat_server_get_peer_stats(s, i, &peer_stats) == 0;
+           ++i) {
+        peer_drops += peer_stats.dropped_messages;
+      }
+      unit_check(peer_drops == stats.dropped_messages, "per-peer drops");
+    } else {
+      unit_check(stats.sender_pauses > 0, "sender paused");
+      unit_check(got == count && stats.dropped_messages == 0,
+                 "nothing lost while paused");
+    }
+  }
+  chat_client_delete(c1);
+  chat_client_delete(c2);
+  server_consume_events(s);
+  chat_server_get_stats(s, &stats);
+  unit_check(stats.queued_bytes == 0, "nothing queued after all left");
+  chat_server_delete(s);
+}
+
+static void test_out_limit(void) {
+  unit_test_start();
+
+  struct chat_server *s = chat_server_new();
+  unit_check(chat_server_set_out_limit(s, 1000, 100) ==
+             CHAT_ERR_INVALID_ARGUMENT, "bad policy");
+  unit_fail_if(chat_server_listen(s, 0) != 0);
+  unit_check(chat_server_set_out_limit(s, 1000, CHAT_OVERFLOW_DISCONNECT) ==
+             CHAT_ERR_ALREADY_STARTED, "no limit change after listen");
+  chat_server_delete(s);
+
+  test_out_limit_policy(CHAT_OVERFLOW_DISCONNECT);
+  test_out_limit_policy(CHAT_OVERFLOW_DROP_OLDEST);
+  test_out_limit_policy(CHAT_OVERFLOW_PAUSE_SENDER);
+
+  unit_test_finish();
+}
+
+static void test_binary(void) {
+  unit_test_start();
+
+  char buf[CHAT_VARINT_MAX];
+  uint64_t value = 0;
+  unit_check(chat_varint_encode(300, buf) == 2 && (uint8_t)buf[0] == 0xac &&
+             buf[1] == 2, "varint encode");
+  unit_check(chat_varint_decode(buf, 1, &value) == 0, "varint incomplete");
+  unit_check(chat_varint_decode(buf, 2, &value) == 2 && value == 300,
+             "varint decode");
+  memset(buf, 0x80, sizeof(buf));
+  unit_check(chat_varint_decode(buf, sizeof(buf), &value) == -1,
+             "varint too long");
+
+  struct chat_server *s = chat_server_new();
+  unit_fail_if(chat_server_listen(s, 0) != 0);
+  const char *addr = make_addr_str(server_get_port(s));
+  struct chat_client *bin1 = chat_client_new("bin1");
+  struct chat_client *text = chat_client_new("text");
+  struct chat_client *bin2 = chat_client_new("bin2");
+  unit_check(chat_client_set_protocol(bin1, 100) == CHAT_ERR_INVALID_ARGUMENT,
+             "bad protocol");
+  unit_fail_if(chat_client_set_protocol(bin1, CHAT_PROTOCOL_BINARY) != 0);
+  unit_fail_if(chat_client_set_protocol(bin2, CHAT_PROTOCOL_BINARY) != 0);
+  unit_fail_if(chat_client_connect(bin1, addr) != 0);
+  unit_check(chat_client_set_protocol(bin1, CHAT_PROTOCOL_TEXT) ==
+             CHAT_ERR_ALREADY_STARTED, "no protocol change after connect");
+  unit_fail_if(chat_client_connect(text, addr) != 0);
+  unit_fail_if(chat_client_connect(bin2, addr) != 0);
+  struct chat_client *clis[] = {bin1, text, bin2};
+  for (int i = 0; i < 3; ++i) {
+    unit_fail_if(chat_client_feed(clis[i], "join\n", 5) != 0);
+    chat_message_delete(server_pop_next_blocking_from(s, clis[i]));
+  }
+  /* Drop the joins of the others. */
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 2; ++j) {
+      chat_message_delete(client_pop_next_blocking(clis[i], s));
+    }
+  }
+
+  /* Lines split across feeds are framed whole. */
+  unit_fail_if(chat_client_feed(bin1, "  hel", 5) != 0);
+  unit_fail_if(chat_client_feed(bin1, "lo  \nwor", 8) != 0);
+  unit_fail_if(chat_client_feed(bin1, "ld\n", 3) != 0);
+  chat_client_update(bin1, 0);
+  struct chat_message *msg = server_pop_next_blocking_from(s, bin1);
+  unit_check(strcmp(msg->data, "hello") == 0 && msg->size == 5,
+             "server got a frame");
+  chat_message_delete(msg);
+  msg = client_pop_next_blocking(text, s);
+  unit_check(strcmp(msg->data, "hello") == 0, "text client got a line");
+  chat_message_delete(msg);
+  msg = client_pop_next_blocking(bin2, s);
+  unit_check(strcmp(msg->data, "hello") == 0, "binary client got a frame");
+  chat_message_delete(msg);
+  msg = client_pop_next_blocking(bin2, s);
+  unit_check(strcmp(msg->data, "world") == 0, "next frame");
+  chat_message_delete(msg);
+
+  /* A big one and a text one, the length prefix can contain '\n'. */
+  uint32_t big_size = 100 * 1000 + 10;
+  char *big = malloc(big_size + 1);
+  memset(big, 'a', big_size);
+  big[big_size] = '\n';
+  unit_fail_if(chat_client_feed(bin1, big, big_size + 1) != 0);
+  unit_fail_if(chat_client_feed(text, "from text\n", 10) != 0);
+  bool got_big = false;
+  bool got_text = false;
+  while (!got_big || !got_text) {
+    chat_client_update(bin1, 0);
+    chat_client_update(text, 0);
+    msg = client_pop_next_blocking(bin2, s);
+    got_big = got_big || msg->size == big_size;
+    got_text = got_text || strcmp(msg->data, "from text") == 0;
+    chat_message_delete(msg);
+  }
+  unit_check(got_big && got_text, "big and text messages as frames");
+  msg = client_pop_next_blocking(bin1, s);
+  unit_check(strcmp(msg->data, "from text") == 0, "binary got text peer's");
+  chat_message_delete(msg);
+  free(big);
+
+  /* Frames which are not a valid text line are dropped. */
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sa = {.sin_family = AF_INET};
+  sa.sin_port = htons(server_get_port(s));
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  unit_fail_if(connect(sock, (struct sockaddr *)&sa, sizeof(sa)) != 0);
+  const char frames[] = CHAT_BINARY_HELLO "\3a\nb\2\0x\2ok";
+  unit_fail_if(send(sock, frames, sizeof(frames) - 1, 0) !=
+               sizeof(frames) - 1);
+  /* The text client still has "world" and the big one. */
+  for (int i = 0; i < 2; ++i)
+    chat_message_delete(client_pop_next_blocking(text, s));
+  msg = client_pop_next_blocking(text, s);
+  unit_check(strcmp(msg->data, "ok") == 0, "text client got a valid frame");
+  chat_message_delete(msg);
+  msg = client_pop_next_blocking(bin2, s);
+  unit_check(strcmp(msg->data, "ok") == 0, "binary client got a valid frame");
+  chat_message_delete(msg);
+  close(sock);
+
+  for (int i = 0; i < 3; ++i) {
+    chat_client_delete(clis[i]);
+  }
+  chat_server_delete(s);
+
+  unit_test_finish();
+}
+
+/** Feed the lines and make sure the server has handled them. */
+static void client_send(struct chat_client *c, struct chat_server *s,
+                        const char *lines) {
+  unit_fail_if(chat_client_feed(c, lines, strlen(lines)) != 0);
+  client_consume_events(c);
+  server_consume_events(s);
+}
+
+static bool client_has_no_msg(struct chat_client *c) {
+  client_consume_events(c);
+  return chat_client_pop_next(c) == NULL;
+}
+
+static bool client_got(struct chat_client *c, struct chat_server *s,
+                       const char *data) {
+  struct chat_message *msg = client_pop_next_blocking(c, s);
+  bool ok = strcmp(msg->data, data) == 0;
+  chat_message_delete(msg);
+  return ok;
+}
+
+static void test_rooms(void) {
+  unit_test_start();
+
+  struct chat_server *s = chat_server_new();
+  unit_fail_if(chat_server_listen(s, 0) != 0);
+  const char *addr = make_addr_str(server_get_port(s));
+  struct chat_client *c1 = chat_client_new("c1");
+  struct chat_client *c2 = chat_client_new("c2");
+  struct chat_client *c3 = chat_client_new("c3");
+  unit_fail_if(chat_client_set_protocol(c2, CHAT_PROTOCOL_BINARY) != 0);
+  unit_fail_if(chat_client_connect(c1, addr) != 0);
+  unit_fail_if(chat_client_connect(c2, addr) != 0);
+  unit_fail_if(chat_client_connect(c3, addr) != 0);
+  server_consume_events(s);
+  unit_check(s->lobby.member_count == 3, "everybody starts in the lobby");
+
+  client_send(c1, s, "/join a\n");
+  client_send(c2, s, "/join a\n");
+  unit_check(s->room_count == 1 && s->lobby.member_count == 1, "room a");
+  unit_check(chat_server_pop_next(s) == NULL, "commands are not messages");
+  client_send(c1, s, "in a\n");
+  unit_check(client_got(c2, s, "in a"), "a binary member got it");
+  unit_check(client_has_no_msg(c3), "the lobby did not");
+  chat_message_delete(chat_server_pop_next(s));
+
+  /* Lines before a command go to the old room, after it to the new one. */
+  client_send(c3, s, "hello\n/join a\nlater\n");
+  unit_check(client_got(c1, s, "later"), "c1 got the line after join");
+  unit_check(client_got(c2, s, "later"), "c2 got the line after join");
+  unit_check(client_has_no_msg(c1) && client_has_no_msg(c2),
+             "nobody got the line before join");
+  struct chat_message *msg = chat_server_pop_next(s);
+  unit_check(msg != NULL && strcmp(msg->data, "hello") == 0,
+             "the server gets the messages of all the rooms");
+  chat_message_delete(msg);
+  chat_message_delete(chat_server_pop_next(s));
+
+  client_send(c1, s, "/leave\n");
+  client_send(c3, s, "without c1\n");
+  unit_check(client_got(c2, s, "without c1"), "c2 is still in a");
+  unit_check(client_has_no_msg(c1), "c1 left a");
+  chat_message_delete(chat_server_pop_next(s));
+
+  const char *feed = "to lobby\n/join a\nto a\n";
+  unit_fail_if(chat_server_feed(s, feed, strlen(feed)) != 0);
+  server_consume_events(s);
+  unit_check(client_got(c1, s, "to lobby"), "feed to the lobby");
+  unit_check(client_got(c2, s, "to a") && client_got(c3, s, "to a"),
+             "feed to a room");
+  unit_check(client_has_no_msg(c1) && client_has_no_msg(c2) &&
+                 client_has_no_msg(c3),
+             "feed went to one room at a time");
+
+  client_send(c2, s, "/leave\n");
+  chat_client_delete(c3);
+  server_consume_events(s);
+  unit_check(s->room_count == 0, "the empty room is freed");
+  unit_check(s->lobby.member_count == 2, "lobby members");
+
+  chat_client_delete(c1);
+  chat_client_delete(c2);
+  chat_server_delete(s);
+
+  /*
+   * Rooms span the reactor threads. The server pops a line only after the
+   * whole input around it is handled, so a line after a join tells the join
+   * is done.
+   */
+  s = chat_server_new();
+  unit_fail_if(chat_server_set_shard_count(s, 2) != 0);
+  unit_fail_if(chat_server_listen(s, 0) != 0);
+  addr = make_addr_str(server_get_port(s));
+  c1 = chat_client_new("c1");
+  c2 = chat_client_new("c2");
+  c3 = chat_client_new("c3");
+  unit_fail_if(chat_client_connect(c1, addr) != 0);
+  unit_fail_if(chat_client_connect(c2, addr) != 0);
+  unit_fail_if(chat_client_connect(c3, addr) != 0);
+  unit_fail_if(chat_client_feed(c1, "/join a\nsync1\n", 14) != 0);
+  chat_message_delete(server_pop_next_blocking_from(s, c1));
+  unit_fail_if(chat_client_feed(c2, "/join a\nsync2\n", 14) != 0);
+  chat_message_delete(server_pop_next_blocking_from(s, c2));
+  unit_fail_if(chat_client_feed(c1, "x\n/leave\nz\n", 12) != 0);
+  chat_client_update(c1, 0);
+  unit_check(client_got(c2, s, "x"), "sharded room member");
+  unit_check(client_got(c3, s, "z"), "sharded lobby member");
+  chat_client_delete(c1);
+  chat_client_delete(c2);
+  chat_client_delete(c3);
+  chat_server_delete(s);
+
+  unit_test_finish();
+}
+
+static size_t server_chunk_count(const struct chat_server *s) {
+  size_t count = 0;
+  for (const struct chat_peer_chunk *c = s->peer_chunks; c != NULL;
+       c = c->next) {
+    ++count;
+  }
+  return count;
+}
+
+static void test_peer_churn(void) {
+  unit_test_start();
+
+  struct chat_server *s = chat_server_new();
+  unit_fail_if(chat_server_listen(s, 0) != 0);
+  const char *addr = make_addr_str(server_get_port(s));
+  enum { COUNT = CHAT_PEER_SLAB_CHUNK + 10 };
+  struct chat_client *clis[COUNT];
+  bool ok = true;
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < COUNT; ++i) {
+      clis[i] = chat_client_new("c");
+      unit_fail_if(chat_client_connect(clis[i], addr) != 0);
+    }
+    server_consume_events(s);
+    ok = ok && s->peer_count == COUNT;
+    /* Every other one goes away, the rest fill the gaps in the array. */
+    for (int i = 0; i < COUNT; i += 2) {
+      chat_client_delete(clis[i]);
+    }
+    server_consume_events(s);
+    ok = ok && s->peer_count == COUNT / 2;
+    for (size_t i = 0; i < s->peer_count; ++i) {
+      ok = ok && s->peers[i]->index == i;
+    }
+    client_send(clis[1], s, "still here\n");
+    ok = client_got(clis[COUNT - 1], s, "still here") && ok;
+    chat_message_delete(chat_server_pop_next(s));
+    for (int i = 1; i < COUNT; i += 2) {
+      chat_client_delete(clis[i]);
+    }
+    server_consume_events(s);
+    ok = ok && s->peer_count == 0;
+  }
+  unit_check(ok, "peers come and go");
+  unit_check(server_chunk_count(s) == 2, "freed peers are reused");
+  chat_server_delete(s);
+
+  unit_test_finish();
+}
+
+static void remove_dir(const char *path) {
+  DIR *dir = opendir(path);
+  unit_fail_if(dir == NULL);
+  struct dirent *entry;
+  char file[512];
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] != '.') {
+      snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+      unlink(file);
+    }
+  }
+  closedir(dir);
+  rmdir(path);
+}
+
+/** Check that the client gets the lines "<prefix> <i>" for i in [from, to). */
+static bool client_got_range(struct chat_client *c, struct chat_server *s,
+                             const char *prefix, int from, int to) {
+  char *line = malloc(strlen(prefix) + 16);
+  bool ok = true;
+  for (int i = from; i < to; ++i) {
+    sprintf(line, "%s %d", prefix, i);
+    ok = client_got(c, s, line) && ok;
+  }
+  free(line);
+  return ok;
+}
+
+static void test_log(void) {
+  unit_test_start();
+
+  char dir[] = "/tmp/chat_log_XXXXXX";
+  unit_fail_if(mkdtemp(dir) == NULL);
+  struct chat_server *s = chat_server_new();
+  unit_fail_if(chat_server_set_shard_count(s, 2) != 0);
+  unit_fail_if(chat_server_set_log(s, dir, 16, 0, 0) != 0);
+  unit_check(chat_server_listen(s, 0) == CHAT_ERR_NOT_IMPLEMENTED,
+             "no log in the sharded mode");
+  chat_server_delete(s);
+
+  /* Tiny segments, so that a replay goes through several of them. */
+  s = chat_server_new();
+  unit_fail_if(chat_server_set_log(s, dir, 16, 0, 0) != 0);
+  unit_fail_if(chat_server_listen(s, 0) != 0);
+  const char *addr = make_addr_str(server_get_port(s));
+  struct chat_client *c1 = chat_client_new("c1");
+  unit_fail_if(chat_client_connect(c1, addr) != 0);
+  char line[64];
+  for (int i = 0; i < 10; ++i) {
+    sprintf(line, "line %d\n", i);
+    client_send(c1, s, line);
+    chat_message_delete(chat_server_pop_next(s));
+  }
+  unit_check(s->log->next_seq == 10 && s->log->segment_count == 4,
+             "lines are logged into segments");
+
+  struct chat_client *c2 = chat_client_new("c2");
+  unit_fail_if(chat_client_connect(c2, addr) != 0);
+  client_send(c2, s, "/resume 3\n");
+  unit_check(chat_server_pop_next(s) == NULL, "resume is not a message");
+  unit_check(client_got_range(c2, s, "line", 3, 10), "replay from the middle");
+  client_send(c1, s, "live\n");
+  chat_message_delete(chat_server_pop_next(s));
+  unit_check(client_got(c2, s, "live"), "live lines after the replay");
+  unit_check(client_has_no_msg(c2), "nothing twice");
+  chat_client_delete(c1);
+  chat_client_delete(c2);
+  chat_server_delete(s);
+
+  /* The log is continued, and only its last 40 bytes or so are kept. */
+  s = chat_server_new();
+  unit_fail_if(chat_server_set_log(s, dir, 16, 40, 0) != 0);
+  unit_check(s->log->next_seq == 11, "the log is continued");
+  unit_fail_if(chat_server_listen(s, 0) != 0);
+  addr = make_addr_str(server_get_port(s));
+  c1 = chat_client_new("c1");
+  unit_fail_if(chat_client_connect(c1, addr) != 0);
+  client_send(c1, s, "/resume 0\n");
+  unit_check(client_got_range(c1, s, "line", 6, 10) &&
+                 client_got(c1, s, "live"),
+             "replay from the oldest line kept");
+  client_send(c1, s, "/resume 100\n");
+  unit_check(client_has_no_msg(c1), "replay from the end");
+  chat_client_delete(c1);
+  chat_server_delete(s);
+  remove_dir(dir);
+
+  /* A replay bigger than the socket buffers, of the server's own lines. */
+  unit_fail_if(mkdtemp(strcpy(dir, "/tmp/chat_log_XXXXXX")) == NULL);
+  s = chat_server_new();
+  unit_fail_if(chat_server_set_log(s, dir, 64 * 1024, 0, 0) != 0);
+  unit_fail_if(chat_server_listen(s, 0) != 0);
+  int count = 4000;
+  char *big = malloc(1024);
+  memset(big, 'x', 1000);
+  for (int i = 0; i < count; ++i) {
+    int len = sprintf(big + 1000, " %d\n", i);
+    unit_fail_if(chat_server_feed(s, big, 1000 + len) != 0);
+  }
+  c1 = chat_client_new("c1");
+  unit_fail_if(chat_client_connect(c1, make_addr_str(server_get_port(s))) !=
+               0);
+  client_send(c1, s, "/resume 0\n");
+  big[1000] = 0;
+  unit_check(client_got_range(c1, s, big, 0, count), "big replay");
+  unit_fail_if(chat_server_feed(s, "/resume 0\nafter\n", 17) != 0);
+  unit_check(client_got(c1, s, "after"), "feed doesn't broadcast resume");
+  free(big);
+  chat_client_delete(c1);
+  chat_server_delete(s);
+  remove_dir(dir);
+
+  /* A segment cut from outside fails the replay instead of spinning. */
+  unit_fail_if(mkdtemp(strcpy(dir, "/tmp/chat_log_XXXXXX")) == NULL);
+  struct chat_log *log = chat_log_open(dir, 1024, 0, 0);
+  unit_fail_if(log == NULL);
+  unit_fail_if(!chat_log_append(log, "a\nb\n", 4));
+  sprintf(line, "%s/%020d.log", dir, 0);
+  unit_fail_if(truncate(line, 2) != 0);
+  struct chat_log_cursor cursor;
+  unit_fail_if(!chat_log_seek(log, 0, &cursor));
+  int fds[2];
+  unit_fail_if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0);
+  unit_check(chat_log_send(&cursor, fds[0]) == -1 && errno == EIO,
+             "truncated segment");
+  close(fds[0]);
+  close(fds[1]);
+  chat_log_cursor_close(&cursor);
+  chat_log_close(log);
+  remove_dir(dir);
+
+  unit_test_finish();
+}
+
 static void test_big_author(void) {
 #if NEED_AUTHOR
   unit_test_start();
@@ -630,6 +1233,171 @@ static void test_server_feed(void) {
 #endif
 }
 
+static void test_ring(void) {
+  unit_test_start();
+
+  struct chat_ring ring;
+  chat_ring_create(&ring);
+  unit_fail_if(!chat_ring_append(&ring, "abc\n", 4));
+  char buf[2048];
+  memset(buf, 'x', sizeof(buf));
+  /* Leave 3 bytes stored and wrap the next append around the end. */
+  chat_ring_consume(&ring, 1);
+  unit_fail_if(!chat_ring_append(&ring, buf, 1020));
+  chat_ring_consume(&ring, 1000);
+  unit_fail_if(!chat_ring_append(&ring, "tail\n", 5));
+  struct iovec iov[2];
+  unit_check(chat_ring_data_iov(&ring, iov) == 2, "data wraps around");
+  unit_check(chat_ring_size(&ring) == 28, "size");
+  unit_check(chat_ring_find(&ring, 0, '\n') == 27, "newline across the end");
+  unit_check(chat_ring_find(&ring, 28, '\n') == -1, "no newline past size");
+  char out[28];
+  chat_ring_peek(&ring, out, sizeof(out));
+  unit_check(memcmp(out + 23, "tail\n", 5) == 0, "peek across the end");
+
+  /* Growing keeps the order of wrapped data. */
+  unit_fail_if(!chat_ring_append(&ring, buf, sizeof(buf)));
+  unit_check(chat_ring_size(&ring) == 28 + sizeof(buf), "grown size");
+  chat_ring_peek(&ring, out, sizeof(out));
+  unit_check(memcmp(out + 23, "tail\n", 5) == 0, "grown data");
+  chat_ring_consume(&ring, chat_ring_size(&ring));
+  unit_check(chat_ring_size(&ring) == 0, "empty");
+
+  /*
+   * Split lines wrapping around the end, long enough for whole vectors, with
+   * whitespace to trim and a blank line.
+   */
+  unit_fail_if(!chat_ring_append(&ring, buf, sizeof(buf)));
+  unit_fail_if(!chat_ring_append(&ring, buf, 1912));
+  chat_ring_consume(&ring, 3959);
+  char lines[200];
+  memset(lines, 'y', sizeof(lines));
+  memcpy(lines, "  first \n \t \nsecond", 19);
+  lines[99] = '\n';
+  memcpy(lines + 150, "\n last\t", 7);
+  unit_fail_if(!chat_ring_append(&ring, lines, sizeof(lines)));
+  chat_ring_consume(&ring, 1);
+  unit_check(chat_ring_data_iov(&ring, iov) == 2, "lines wrap around");
+  struct chat_span spans[8];
+  size_t end;
+  unit_check(chat_ring_split_lines(&ring, 0, spans, 8, &end) == 4, "4 lines");
+  unit_check(end == 151, "end after the last newline");
+  unit_check(spans[0].start == 2 && spans[0].size == 5, "leading trimmed");
+  unit_check(spans[1].size == 0, "blank line");
+  unit_check(spans[2].start == 13 && spans[2].size == 86, "long line");
+  unit_check(spans[3].start == 100 && spans[3].size == 50, "line after it");
+  chat_ring_copy(&ring, spans[0].start, out, spans[0].size);
+  unit_check(memcmp(out, "first", 5) == 0, "copy a span");
+  chat_ring_copy(&ring, spans[3].start, lines, spans[3].size);
+  unit_check(memcmp(lines, lines + 100, 50) == 0, "copy across the end");
+  unit_check(chat_ring_split_lines(&ring, 0, spans, 2, &end) == 2 &&
+                 end == 13,
+             "split stops at max");
+  unit_check(chat_ring_split_lines(&ring, 151, spans, 8, &end) == 0 &&
+                 end == 0,
+             "nothing after from");
+  chat_ring_destroy(&ring);
+
+  /* A ring in a caller's buffer spills to the heap and comes back. */
+  char small[16];
+  chat_ring_create_in(&ring, small, sizeof(small));
+  unit_fail_if(!chat_ring_append(&ring, "0123456789", 10));
+  unit_check(ring.data == small, "in the caller's buffer");
+  unit_fail_if(!chat_ring_append(&ring, "abcdefghij", 10));
+  unit_check(ring.data != small && chat_ring_size(&ring) == 20, "spilled");
+  chat_ring_peek(&ring, out, 20);
+  unit_check(memcmp(out, "0123456789abcdefghij", 20) == 0, "spilled data");
+  chat_ring_shrink(&ring);
+  unit_check(ring.data != small, "not shrunk while not empty");
+  chat_ring_consume(&ring, 20);
+  chat_ring_shrink(&ring);
+  unit_check(ring.data == small && ring.capacity == sizeof(small), "shrunk");
+  chat_ring_destroy(&ring);
+
+  unit_test_finish();
+}
+
+static struct chat_message *make_msg(int i) {
+  char *data = malloc(16);
+  int len = sprintf(data, "m%d", i);
+  return chat_message_new(data, len);
+}
+
+static void test_msg_queue(void) {
+  unit_test_start();
+
+  struct chat_msg_queue queue;
+  chat_msg_queue_create(&queue);
+  unit_check(chat_msg_queue_pop(&queue) == NULL, "empty pop");
+  /* Wrap around the end of the initial 8 slots, then grow. */
+  for (int i = 0; i < 6; ++i) {
+    unit_fail_if(!chat_msg_queue_push(&queue, make_msg(i)));
+  }
+  struct chat_message *msgs[16];
+  unit_check(chat_msg_queue_pop_batch(&queue, msgs, 4) == 4, "batch of 4");
+  bool ok = true;
+  for (int i = 0; i < 4; ++i) {
+    ok = ok && msgs[i]->data[1] - '0' == i;
+    chat_message_delete(msgs[i]);
+  }
+  unit_check(ok, "batch order");
+  for (int i = 6; i < 16; ++i) {
+    unit_fail_if(!chat_msg_queue_push(&queue, make_msg(i)));
+  }
+  unit_check(strcmp(chat_msg_queue_at(&queue, 0)->data, "m4") == 0, "at");
+  struct chat_message *msg = chat_msg_queue_pop(&queue);
+  unit_check(strcmp(msg->data, "m4") == 0 && msg->size == 2, "pop after grow");
+  chat_message_delete(msg);
+  size_t count = chat_msg_queue_pop_batch(&queue, msgs, 16);
+  unit_check(count == 11, "batch takes what is left");
+  ok = true;
+  for (size_t i = 0; i < count; ++i) {
+    int n = -1;
+    ok = ok && sscanf(msgs[i]->data, "m%d", &n) == 1 && n == (int)i + 5;
+    chat_message_delete(msgs[i]);
+  }
+  unit_check(ok, "order across the wrap");
+  /* Leftovers are freed by destroy. */
+  unit_fail_if(!chat_msg_queue_push(&queue, make_msg(0)));
+  chat_msg_queue_destroy(&queue);
+
+  struct chat_server *s = chat_server_new();
+  unit_fail_if(chat_server_listen(s, 0) != 0);
+  struct chat_client *c1 = chat_client_new("c1");
+  struct chat_client *c2 = chat_client_new("c2");
+  unit_fail_if(chat_client_connect(c1, make_addr_str(server_get_port(s))) != 0);
+  unit_fail_if(chat_client_connect(c2, make_addr_str(server_get_port(s))) != 0);
+  unit_fail_if(chat_client_feed(c2, "hi\n", 3) != 0);
+  chat_message_delete(server_pop_next_blocking_from(s, c2));
+  unit_fail_if(chat_client_feed(c1, "a\nb\nc\n", 6) != 0);
+  chat_client_update(c1, 0);
+  count = 0;
+  while (count < 3) {
+    count += chat_server_pop_batch(s, msgs + count, 16 - count);
+    chat_server_update(s, 0);
+  }
+  unit_check(strcmp(msgs[0]->data, "a") == 0 &&
+             strcmp(msgs[2]->data, "c") == 0, "server batch pop");
+  for (size_t i = 0; i < count; ++i) {
+    chat_message_delete(msgs[i]);
+  }
+  count = 0;
+  while (count < 3) {
+    count += chat_client_pop_batch(c2, msgs + count, 16 - count);
+    chat_client_update(c2, 0);
+    chat_server_update(s, 0);
+  }
+  unit_check(strcmp(msgs[1]->data, "b") == 0, "client batch pop");
+  for (size_t i = 0; i < count; ++i) {
+    chat_message_delete(msgs[i]);
+  }
+  chat_client_delete(c1);
+  chat_client_delete(c2);
+  chat_server_delete(s);
+
+  unit_test_finish();
+}
+
 int main(int argc, char **argv) {
   if (doCmdMaxPoints(argc, argv)) {
     int result = 15;
@@ -644,11 +1412,20 @@ int main(int argc, char **argv) {
   }
   unit_test_start();
 
+  test_ring();
+  test_msg_queue();
   test_basic();
   test_big_messages();
   test_multi_feed();
   test_multi_client();
   test_stress();
+  test_sharded();
+  test_io_uring();
+  test_out_limit();
+  test_binary();
+  test_rooms();
+  test_peer_churn();
+  test_log();
   test_big_author();
   test_server_feed();
 